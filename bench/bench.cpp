@@ -0,0 +1,149 @@
+// Host benchmarks of the pipeline in sensor_pipeline.h, run against the mocks:
+//   filter  cost per raw sample of filterAdcSample() + ChannelFilter
+//   encode  JSON (encodeRecords) and compact (encodeRecordsCompact) throughput
+//   flush   latency of one batch flush through UploadBatcher and
+//           encodeUploadBody(), as flushUploadBatch() does it, into the
+//           static body buffer and on to the database
+// Usage: bench [filter|encode|flush]... (all three without arguments)
+#include "host_channels.h"
+#include "mocks.h"
+#include <algorithm>
+#include <chrono>
+
+// The firmware's default batch sizes (UPLOAD_BATCH_SIZE, LOG_REPLAY_BATCH in main.cpp)
+const int UPLOAD_BATCH_SIZE = 8;
+const int UPLOAD_MAX_RECORDS = 20;
+char uploadBody[RECORD_JSON_MAX * UPLOAD_MAX_RECORDS + 4];
+
+volatile float sink; // Keeps results alive past the optimizer
+
+double nowNs() {
+  using namespace std::chrono;
+  return duration<double, std::nano>(steady_clock::now().time_since_epoch()).count();
+}
+
+// Records as the acquisition task would produce them from the mock sensors
+std::vector<LogRecord> makeRecords(int n) {
+  MockAdc adc(ANALOG_CHANNEL_COUNT);
+  MockOneWire temp;
+  HostAnalogChannels filters;
+  std::vector<LogRecord> records(n);
+  uint64_t t = 1760000000000ULL;
+  for (int i = 0; i < n; i++) {
+    MockAdc::Frame fr;
+    adc.next(fr);
+    float tempC = temp.readC(fr.ms);
+    for (int c = 0; c < ANALOG_CHANNEL_COUNT; c++) filters.push(c, fr.raw[c], MockAdc::rawToVolts(fr.raw[c]));
+    LogRecord& r = records[i];
+    memset(&r, 0xFF, sizeof(r));
+    r.timestampMs = t + i * 15000ULL;
+    r.value[TEMP_CHANNEL] = tempC;
+    for (int c = 0; c < ANALOG_CHANNEL_COUNT; c++) r.value[ANALOG_INDEX[c]] = filters.value(c, tempC);
+    r.session = 1;
+    r.flags = 0;
+    r.alerts = 0;
+  }
+  return records;
+}
+
+void benchFilter() {
+  const int FRAMES = 200000;
+  MockAdc adc(ANALOG_CHANNEL_COUNT);
+  std::vector<MockAdc::Frame> frames(FRAMES);
+  for (MockAdc::Frame& fr : frames) adc.next(fr);
+  HostAnalogChannels filters;
+  double start = nowNs();
+  for (const MockAdc::Frame& fr : frames) {
+    for (int c = 0; c < ANALOG_CHANNEL_COUNT; c++) filters.push(c, fr.raw[c], MockAdc::rawToVolts(fr.raw[c]));
+  }
+  double ns = nowNs() - start;
+  unsigned long rejected = 0;
+  for (int c = 0; c < ANALOG_CHANNEL_COUNT; c++) {
+    sink = sink + filters.volts(c);
+    rejected += filters.rejected(c);
+  }
+  printf("filter: %d samples, %.1f ns/sample, %lu rail hits rejected\n", FRAMES * ANALOG_CHANNEL_COUNT,
+         ns / (FRAMES * ANALOG_CHANNEL_COUNT), rejected);
+}
+
+void benchEncode() {
+  const int ROUNDS = 20000;
+  std::vector<LogRecord> records = makeRecords(UPLOAD_MAX_RECORDS);
+  size_t jsonBytes = 0;
+  double start = nowNs();
+  for (int i = 0; i < ROUNDS; i++) {
+    BufWriter w(uploadBody, sizeof(uploadBody));
+    encodeRecords(records.data(), UPLOAD_MAX_RECORDS, VALUE_FORMATS.data(), CHANNEL_COUNT, w);
+    jsonBytes = w.len;
+    if (w.overflow) printf("encode: JSON body overflowed\n");
+  }
+  double jsonNs = nowNs() - start;
+  size_t compactBytes = 0;
+  start = nowNs();
+  for (int i = 0; i < ROUNDS; i++) {
+    BufWriter w(uploadBody, sizeof(uploadBody));
+    encodeRecordsCompact<UPLOAD_MAX_RECORDS>(records.data(), UPLOAD_MAX_RECORDS, VALUE_FORMATS.data(), CHANNEL_COUNT, w);
+    compactBytes = w.len;
+  }
+  double compactNs = nowNs() - start;
+  double encoded = (double)ROUNDS * UPLOAD_MAX_RECORDS;
+  printf("encode: JSON    %.0f records/s, %.1f bytes/record\n", encoded / (jsonNs / 1e9),
+         (double)jsonBytes / UPLOAD_MAX_RECORDS);
+  printf("encode: compact %.0f records/s, %.1f bytes/record\n", encoded / (compactNs / 1e9),
+         (double)compactBytes / UPLOAD_MAX_RECORDS);
+}
+
+// Time n flushes of one UPLOAD_BATCH_SIZE batch and print percentiles
+template <bool Compact>
+void timeFlushes(const char* name) {
+  const int FLUSHES = 20000;
+  std::vector<LogRecord> records = makeRecords(UPLOAD_BATCH_SIZE);
+  MockFirebase db;
+  db.keepBodies = false;
+  UploadBatcher<LogRecord, UPLOAD_BATCH_SIZE> batch;
+  int status = 0;
+  auto send = [&](const LogRecord* r, int n) {
+    BufWriter body(uploadBody, sizeof(uploadBody));
+    bool packed = encodeUploadBody<UPLOAD_MAX_RECORDS, Compact>(r, n, VALUE_FORMATS.data(), CHANNEL_COUNT, body);
+    const char* path = packed ? "/devices/host/packed" : "/devices/host/readings";
+    status = body.overflow ? -1 : db.patch(path, body.buf, body.len);
+  };
+  std::vector<double> ns(FLUSHES);
+  for (int i = 0; i < FLUSHES; i++) {
+    for (const LogRecord& r : records) batch.add(r, 0, UPLOAD_BATCH_SIZE, send);
+    double start = nowNs();
+    batch.flush(send);
+    ns[i] = nowNs() - start;
+    if (status != 200) printf("flush: request failed (%d)\n", status);
+  }
+  std::sort(ns.begin(), ns.end());
+  printf("flush: %-7s batch of %d, p50 %.2f us, p90 %.2f us, max %.2f us, %.0f bytes/flush, %u malformed\n", name,
+         UPLOAD_BATCH_SIZE, ns[FLUSHES / 2] / 1000, ns[FLUSHES * 9 / 10] / 1000, ns.back() / 1000,
+         (double)db.bytes / db.count, (unsigned)db.malformed);
+}
+
+void benchFlush() {
+  timeFlushes<false>("JSON");
+  timeFlushes<true>("compact");
+}
+
+int main(int argc, char** argv) {
+  bool all = argc < 2;
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "filter") && strcmp(argv[i], "encode") && strcmp(argv[i], "flush")) {
+      fprintf(stderr, "usage: %s [filter|encode|flush]...\n", argv[0]);
+      return 2;
+    }
+  }
+  auto wanted = [&](const char* name) {
+    if (all) return true;
+    for (int i = 1; i < argc; i++) {
+      if (strcmp(argv[i], name) == 0) return true;
+    }
+    return false;
+  };
+  if (wanted("filter")) benchFilter();
+  if (wanted("encode")) benchEncode();
+  if (wanted("flush")) benchFlush();
+  return 0;
+}
@@ -0,0 +1,61 @@
+// Host glue for the firmware's channel table (sensor_channels.h): the
+// encoders' clock hook and the analog channels' filters, driven by channel
+// number at run time. The table, its filter sizes, conversions and default
+// calibration are the firmware's own, so the host runs the pipeline exactly
+// as the device would.
+#pragma once
+#include "sensor_channels.h"
+
+// The encoders' clock hook. The host has no power sessions: a record is
+// dated unless it was flagged as taken before the clock was set.
+inline bool recordEpochMs(const LogRecord& r, uint64_t& epochMs) {
+  if (r.flags & LOG_FLAG_UNSYNCED) return false;
+  epochMs = r.timestampMs;
+  return true;
+}
+
+// The analog channels in ADC scan order, one ChannelFilter each, as the
+// acquisition task holds them (channelFilters in main.cpp)
+struct HostAnalogChannels {
+  ChannelFilters filters = makeChannelFilters(std::make_index_sequence<ANALOG_CHANNEL_COUNT>());
+
+  // Feed one raw sample of analog channel c; true if it was a rail hit
+  bool push(int c, int raw, float volts) {
+    bool railHit = false;
+    forChannel(c, [&](auto& f, auto) { railHit = filterAdcSample(raw, volts, f); });
+    return railHit;
+  }
+  // Filtered volts of channel c, -1 until it has a good sample
+  float volts(int c) {
+    float v = -1.0f;
+    forChannel(c, [&](auto& f, auto) { v = f.hasValue() ? f.value() : -1.0f; });
+    return v;
+  }
+  // Converted value of channel c, as sampleChannel() computes it
+  float value(int c, float tempC) {
+    float v = -1.0f;
+    float in = volts(c);
+    forChannel(c, [&](auto&, auto i) { v = analogValue<decltype(i)::value>(in, tempC); });
+    return v;
+  }
+  unsigned long rejected(int c) {
+    unsigned long n = 0;
+    forChannel(c, [&](auto& f, auto) { n = f.rejected; });
+    return n;
+  }
+
+  // Call fn(filter, std::integral_constant<size_t, c>) for channel c
+  template <typename Fn>
+  void forChannel(int c, Fn fn) {
+    forChannel(c, fn, std::make_index_sequence<ANALOG_CHANNEL_COUNT>());
+  }
+  template <typename Fn, size_t... I>
+  void forChannel(int c, Fn fn, std::index_sequence<I...>) {
+    ((c == (int)I ? fn(std::get<I>(filters), std::integral_constant<size_t, I>()) : void()), ...);
+  }
+};
+
+// Upload key of analog channel c
+inline const char* analogKey(int c) {
+  return SENSOR_CHANNELS[ANALOG_INDEX[c]].format.key;
+}
@@ -0,0 +1,157 @@
+// Host mocks of the hardware and network the firmware talks to: the ADC, the
+// DS18B20 on the OneWire bus and the Firebase RTDB. They stand in for
+// readRawAdc()/adcRawToVolts(), getTemp() and rtdbPatch() in main.cpp.
+#pragma once
+#include <ctype.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <string>
+#include <vector>
+
+// ADC1 with the analog channels in scan order. Frames come from a recorded
+// trace (see loadTrace()) or, without one, from a synthetic signal: a slow
+// drift around a level per channel, a little noise, occasional spikes and
+// rare rail hits, like a probe with bubbles and a loose connector.
+struct MockAdc {
+  static const int MAX_CHANNELS = 8;
+  struct Frame {
+    uint32_t ms = 0;             // Time of the frame since the trace started
+    int raw[MAX_CHANNELS] = {};  // 12-bit samples, -1 for no sample
+    float tempC = NAN;           // NAN if the trace has no temperature column
+  };
+  int channels;
+  std::vector<Frame> trace;      // Empty: synthetic
+  size_t pos = 0;
+  uint32_t seed = 12345;
+  uint32_t periodMs;             // Synthetic frame spacing
+
+  explicit MockAdc(int channelCount, uint32_t framePeriodMs = 1000)
+      : channels(channelCount), periodMs(framePeriodMs) {}
+
+  // Raw counts to volts: a straight line over the 11 dB range, close to what
+  // esp_adc_cal gives with the default Vref
+  static float rawToVolts(int raw) { return raw * (3.1f / 4095.0f); }
+
+  // Read a trace as CSV, one frame per line:
+  //   ms,raw0,raw1,...[,tempC]
+  // with one raw column per channel. Lines starting with '#' or a letter
+  // (a header) are skipped. Returns false if the file cannot be read or a
+  // line has too few columns.
+  bool loadTrace(FILE* f) {
+    char line[256];
+    int lineNo = 0;
+    while (fgets(line, sizeof(line), f)) {
+      lineNo++;
+      if (line[0] == '#' || line[0] == '\n' || line[0] == '\r' || isalpha((unsigned char)line[0])) continue;
+      Frame fr;
+      char* p = line;
+      char* end;
+      fr.ms = strtoul(p, &end, 10);
+      if (end == p) return traceError(lineNo);
+      for (int c = 0; c < channels; c++) {
+        p = end;
+        if (*p != ',') return traceError(lineNo);
+        fr.raw[c] = (int)strtol(p + 1, &end, 10);
+        if (end == p + 1) return traceError(lineNo);
+      }
+      if (*end == ',') fr.tempC = strtof(end + 1, NULL);
+      trace.push_back(fr);
+    }
+    return true;
+  }
+  bool traceError(int lineNo) {
+    fprintf(stderr, "trace line %d: expected ms and %d raw columns\n", lineNo, channels);
+    return false;
+  }
+
+  // Next frame; false once a trace has run out (a synthetic signal never does)
+  bool next(Frame& fr) {
+    if (!trace.empty()) {
+      if (pos >= trace.size()) return false;
+      fr = trace[pos++];
+      return true;
+    }
+    fr.ms = (uint32_t)pos * periodMs;
+    fr.tempC = NAN;
+    for (int c = 0; c < channels; c++) fr.raw[c] = synthetic(c, pos);
+    pos++;
+    return true;
+  }
+  void rewind() { pos = 0; }
+
+  uint32_t random() {
+    seed = seed * 1664525u + 1013904223u;
+    return seed >> 8;
+  }
+  int synthetic(int c, size_t i) {
+    float level = 1400 + 600 * c + 80 * sinf(i * 0.002f * (c + 1));
+    float noise = (int)(random() % 21) - 10;
+    uint32_t r = random() % 1000;
+    if (r == 0) return (c & 1) ? 4095 : 0;        // Rail hit
+    if (r < 15) noise += (r & 1) ? 900 : -900;    // Spike
+    int raw = (int)(level + noise);
+    return raw < 1 ? 1 : (raw > 4094 ? 4094 : raw);
+  }
+};
+
+// DS18B20 on the OneWire bus: a slowly varying water temperature, or the
+// DallasTemperature library's error value while "disconnected"
+struct MockOneWire {
+  static constexpr float DISCONNECTED_C = -127.0f;
+  bool disconnected = false;
+  float baseC = 24.0f;
+
+  float readC(uint32_t ms) const {
+    if (disconnected) return DISCONNECTED_C;
+    return baseC + 1.5f * sinf(ms / 3600000.0f * 6.2832f);
+  }
+};
+
+// The Firebase RTDB as rtdbPatch() sees it: takes a path and a body, answers
+// with an HTTP status. Every request is kept so a run can be inspected, and
+// bodies are checked for balanced JSON braces and quotes, which catches a
+// truncated encode. status and failEvery script the answers.
+struct MockFirebase {
+  struct Request {
+    std::string path;
+    std::string body;
+    int status;
+  };
+  std::vector<Request> requests;
+  bool keepBodies = true;     // false: only count, for benchmarks
+  int status = 200;           // Answer to every request
+  int failEvery = 0;          // Answer every n-th request with failStatus instead (0 = never)
+  int failStatus = 503;
+  uint64_t bytes = 0;
+  uint32_t count = 0;
+  uint32_t malformed = 0;
+
+  int patch(const char* path, const char* body, size_t len) {
+    count++;
+    bytes += len;
+    if (!wellFormed(body, len)) malformed++;
+    int answer = (failEvery > 0 && count % failEvery == 0) ? failStatus : status;
+    if (keepBodies) requests.push_back({ path, std::string(body, len), answer });
+    return answer;
+  }
+  static bool wellFormed(const char* body, size_t len) {
+    int depth = 0;
+    bool inString = false;
+    for (size_t i = 0; i < len; i++) {
+      char c = body[i];
+      if (inString) {
+        if (c == '"') inString = false;
+      } else if (c == '"') {
+        inString = true;
+      } else if (c == '{' || c == '[') {
+        depth++;
+      } else if (c == '}' || c == ']') {
+        if (--depth < 0) return false;
+      }
+    }
+    return depth == 0 && !inString && len > 0;
+  }
+};
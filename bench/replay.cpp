@@ -0,0 +1,72 @@
+// Trace replay: run a recorded ADC trace through the same filters and
+// conversions as the acquisition task and print what the device would have
+// reported, one line per frame.
+//   replay <trace.csv>      replay a trace ("-" reads stdin)
+//   replay --synth <n>      write n frames of the mock ADC's synthetic signal
+//                           as a trace, e.g. to try out the replay
+// A trace is CSV with one frame per line, ms,p,n,d[,tempC]: the time of the
+// frame, the raw 12-bit reading of each analog channel in ADC scan order
+// (-1 for no sample yet) and optionally the water temperature. Without a
+// temperature column 25 C is assumed. Output columns are ms, then per channel
+// its filtered volts and converted value (-1 while it has no good sample),
+// and a closing summary of rail hits per channel goes to stderr.
+#include "host_channels.h"
+#include "mocks.h"
+
+int writeSynthetic(long frames) {
+  MockAdc adc(ANALOG_CHANNEL_COUNT, 50);
+  MockOneWire temp;
+  printf("ms");
+  for (int c = 0; c < ANALOG_CHANNEL_COUNT; c++) printf(",%s", analogKey(c));
+  printf(",tempC\n");
+  for (long i = 0; i < frames; i++) {
+    MockAdc::Frame fr;
+    adc.next(fr);
+    printf("%u", (unsigned)fr.ms);
+    for (int c = 0; c < ANALOG_CHANNEL_COUNT; c++) printf(",%d", fr.raw[c]);
+    printf(",%.2f\n", temp.readC(fr.ms));
+  }
+  return 0;
+}
+
+int replay(FILE* f) {
+  MockAdc adc(ANALOG_CHANNEL_COUNT);
+  if (!adc.loadTrace(f)) return 1;
+  HostAnalogChannels filters;
+  printf("ms");
+  for (int c = 0; c < ANALOG_CHANNEL_COUNT; c++) printf(",%s_volts,%s", analogKey(c), analogKey(c));
+  printf("\n");
+  MockAdc::Frame fr;
+  while (adc.next(fr)) {
+    float tempC = isnan(fr.tempC) ? 25.0f : fr.tempC;
+    for (int c = 0; c < ANALOG_CHANNEL_COUNT; c++) filters.push(c, fr.raw[c], MockAdc::rawToVolts(fr.raw[c]));
+    printf("%u", (unsigned)fr.ms);
+    for (int c = 0; c < ANALOG_CHANNEL_COUNT; c++) {
+      printf(",%.4f,%.2f", filters.volts(c), filters.value(c, tempC));
+    }
+    printf("\n");
+  }
+  fprintf(stderr, "%u frames", (unsigned)adc.trace.size());
+  for (int c = 0; c < ANALOG_CHANNEL_COUNT; c++) {
+    fprintf(stderr, ", %s %lu rail hits", analogKey(c), filters.rejected(c));
+  }
+  fprintf(stderr, "\n");
+  return 0;
+}
+
+int main(int argc, char** argv) {
+  if (argc == 3 && strcmp(argv[1], "--synth") == 0) return writeSynthetic(atol(argv[2]));
+  if (argc != 2) {
+    fprintf(stderr, "usage: %s <trace.csv | -> | --synth <frames>\n", argv[0]);
+    return 2;
+  }
+  if (strcmp(argv[1], "-") == 0) return replay(stdin);
+  FILE* f = fopen(argv[1], "r");
+  if (f == NULL) {
+    perror(argv[1]);
+    return 1;
+  }
+  int rc = replay(f);
+  fclose(f);
+  return rc;
+}
@@ -0,0 +1,303 @@
+// Host checks of sensor_pipeline.h and the channel table against known
+// answers: the filter, calibration curves, conversions, the compact batch
+// format (decoded here the way lib/compact-readings.ts does it), upload
+// batching and backoff. Prints each failed check and exits non-zero if any
+// failed.
+#include "host_channels.h"
+#include "mocks.h"
+#include <string>
+#include <vector>
+
+int checks = 0;
+int failures = 0;
+
+// Count a check, and report it if it failed
+#define CHECK(cond) check((cond), __FILE__, __LINE__, #cond)
+#define CHECK_NEAR(a, b, eps) checkNear((a), (b), (eps), __FILE__, __LINE__, #a)
+
+void check(bool ok, const char* file, int line, const char* what) {
+  checks++;
+  if (ok) return;
+  fprintf(stderr, "%s:%d: check failed: %s\n", file, line, what);
+  failures++;
+}
+void checkNear(double got, double want, double eps, const char* file, int line, const char* what) {
+  checks++;
+  if (fabs(got - want) <= eps) return;
+  fprintf(stderr, "%s:%d: check failed: %s = %g, expected %g\n", file, line, what, got, want);
+  failures++;
+}
+
+void testFilter() {
+  // The EMA follows the window's median: 1, then median(1, 2) = 2, then median(1, 2, 3) = 2
+  ChannelFilter<5> ramp(0.5);
+  CHECK(!ramp.hasValue());
+  ramp.push(1.0f);
+  CHECK_NEAR(ramp.value(), 1.0, 1e-6);
+  ramp.push(2.0f);
+  CHECK_NEAR(ramp.value(), 1.5, 1e-6);
+  ramp.push(3.0f);
+  CHECK_NEAR(ramp.value(), 1.75, 1e-6);
+  CHECK(!ramp.warmedUp());
+
+  // A lone spike never reaches the output
+  ChannelFilter<5> flat(0.3);
+  for (int i = 0; i < 5; i++) flat.push(1.2f);
+  CHECK(flat.warmedUp());
+  flat.push(2.9f);
+  CHECK_NEAR(flat.value(), 1.2, 1e-6);
+
+  // Rail hits are counted and dropped, missing samples ignored
+  CHECK(filterAdcSample(0, 0.0f, flat));
+  CHECK(filterAdcSample(4095, 3.1f, flat));
+  CHECK(!filterAdcSample(-1, -1.0f, flat));
+  CHECK(flat.rejected == 2);
+  CHECK(flat.accepted == 6);
+  CHECK_NEAR(flat.value(), 1.2, 1e-6);
+}
+
+void testCalCurves() {
+  CalCurve k;
+  // Two points: one line, extended past both ends
+  const float v2[] = { 1.0f, 2.0f };
+  const float y2[] = { 7.0f, 4.0f };
+  CHECK(fitCalCurve(v2, y2, 2, CURVE_QUADRATIC, k));
+  CHECK(k.model == CURVE_PIECEWISE && k.segments == 1);
+  CHECK_NEAR(evalCalCurve(k, 1.5f), 5.5, 1e-5);
+  CHECK_NEAR(evalCalCurve(k, 3.0f), 1.0, 1e-5);
+
+  // Three points in capture order (not sorted): two segments meeting at 1 V
+  const float v3[] = { 1.0f, 0.5f, 2.0f };
+  const float y3[] = { 7.0f, 10.0f, 4.0f };
+  CHECK(fitCalCurve(v3, y3, 3, CURVE_PIECEWISE, k));
+  CHECK(k.model == CURVE_PIECEWISE && k.segments == 2);
+  CHECK_NEAR(evalCalCurve(k, 0.5f), 10.0, 1e-5);
+  CHECK_NEAR(evalCalCurve(k, 0.75f), 8.5, 1e-5);
+  CHECK_NEAR(evalCalCurve(k, 1.0f), 7.0, 1e-5);
+  CHECK_NEAR(evalCalCurve(k, 1.5f), 5.5, 1e-5);
+  CHECK_NEAR(evalCalCurve(k, 0.0f), 13.0, 1e-5);
+
+  // Quadratic through points on 1 + v^2
+  const float vq[] = { 1.0f, 2.0f, 3.0f };
+  const float yq[] = { 2.0f, 5.0f, 10.0f };
+  CHECK(fitCalCurve(vq, yq, 3, CURVE_QUADRATIC, k));
+  CHECK(k.model == CURVE_QUADRATIC);
+  CHECK_NEAR(evalCalCurve(k, 2.0f), 5.0, 1e-4);
+  CHECK_NEAR(evalCalCurve(k, 2.5f), 7.25, 1e-4);
+
+  // Rejected: points too close together, a parabola that turns round, too few points
+  const float vClose[] = { 1.0f, 1.01f };
+  CHECK(!fitCalCurve(vClose, y2, 2, CURVE_PIECEWISE, k));
+  const float yPeak[] = { 0.0f, 1.0f, 0.0f };
+  CHECK(!fitCalCurve(vq, yPeak, 3, CURVE_QUADRATIC, k));
+  CHECK(!fitCalCurve(v2, y2, 1, CURVE_PIECEWISE, k));
+}
+
+void testConversions() {
+  CHECK_NEAR(phCompensate(7.0f, 25.0f), 7.0, 1e-5);
+  CHECK_NEAR(phCompensate(phUncompensate(8.2f, 12.0f), 12.0f), 8.2, 1e-4);
+  CHECK_NEAR(turbidityFromVolts(1.0f, turb_slope, turb_intercept), 50.0, 1e-4);
+  CHECK_NEAR(turbidityFromVolts(3.0f, turb_slope, turb_intercept), 0.0, 1e-6);  // Clamped
+  // With no curve fitted the channels use the default slope and intercept
+  CHECK_NEAR(analogValue<0>(2.0f, 25.0f), ph_slope * 2.0f + ph_intercept, 1e-4);
+  CHECK(analogValue<0>(-1.0f, 25.0f) == -1.0f);
+
+  SensorSnapshot s = {};
+  for (int c = 0; c < RECORD_VALUES; c++) s.value[c] = 100.0f + c;
+  deriveChannels(s);
+  for (int c = RECORD_VALUES; c < CHANNEL_COUNT; c++) {
+    const ValueFormat& f = SENSOR_CHANNELS[c].format;
+    CHECK_NEAR(s.value[c], f.factor * s.value[f.from], 1e-3);
+  }
+}
+
+void testAlertLayout() {
+  AlertMask seen = 0;
+  for (int c = 0; c < CHANNEL_COUNT; c++) {
+    CHECK((LIMIT_ALERT[c] != 0) == (SENSOR_CHANNELS[c].limitKey != NULL));
+    CHECK((seen & LIMIT_ALERT[c]) == 0);
+    seen |= LIMIT_ALERT[c];
+  }
+  for (int c = 0; c < RECORD_VALUES; c++) {
+    CHECK(ZSCORE_ALERT[c] != 0 && (seen & ZSCORE_ALERT[c]) == 0);
+    seen |= ZSCORE_ALERT[c];
+  }
+  CHECK(seen == (AlertMask)(((uint64_t)1 << ALERT_BITS) - 1));
+}
+
+// A decoder for the compact batch format, independent of the encoder
+struct CompactReader {
+  std::vector<uint8_t> bytes;
+  size_t pos = 0;
+  bool truncated = false;
+
+  uint8_t byte() {
+    if (pos >= bytes.size()) {
+      truncated = true;
+      return 0;
+    }
+    return bytes[pos++];
+  }
+  int64_t varint() {
+    uint64_t z = 0;
+    for (int shift = 0;; shift += 7) {
+      uint8_t b = byte();
+      z |= (uint64_t)(b & 0x7F) << shift;
+      if (!(b & 0x80) || truncated) break;
+    }
+    return (int64_t)(z >> 1) ^ -(int64_t)(z & 1);
+  }
+};
+std::vector<uint8_t> fromBase64(const std::string& s) {
+  static const std::string alphabet = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+  std::vector<uint8_t> out;
+  uint32_t v = 0;
+  int bits = 0;
+  for (char c : s) {
+    size_t i = alphabet.find(c);
+    if (i == std::string::npos) break;
+    v = (v << 6) | (uint32_t)i;
+    bits += 6;
+    if (bits >= 8) {
+      bits -= 8;
+      out.push_back((v >> bits) & 0xFF);
+    }
+  }
+  return out;
+}
+// The text between the first occurrence of before and the next quote
+std::string field(const std::string& body, const std::string& before) {
+  size_t start = body.find(before);
+  if (start == std::string::npos) return "";
+  start += before.size();
+  return body.substr(start, body.find('"', start) - start);
+}
+
+void testCompact() {
+  const int N = 4;
+  const uint64_t t0 = 1760000000000ULL;
+  const uint32_t gaps[N] = { 0, 15000, 15000, 60000 };
+  LogRecord records[N];
+  uint64_t t = t0;
+  for (int i = 0; i < N; i++) {
+    LogRecord& r = records[i];
+    memset(&r, 0, sizeof(r));
+    t += gaps[i];
+    r.timestampMs = t;
+    for (int c = 0; c < RECORD_VALUES; c++) r.value[c] = 10.0f * (c + 1) + 1.37f * i - (i == 2 ? 5.0f : 0.0f);
+    r.alerts = i == 3 ? (AlertMask)(LIMIT_ALERT[ANALOG_INDEX[0]] | ZSCORE_ALERT[RECORD_VALUES - 1]) : 0;
+  }
+
+  char buf[2048];
+  BufWriter w(buf, sizeof(buf));
+  CHECK(encodeRecordsCompact<8>(records, N, VALUE_FORMATS.data(), CHANNEL_COUNT, w));
+  CHECK(!w.overflow && MockFirebase::wellFormed(w.buf, w.len));
+  std::string body(w.buf, w.len);
+  CHECK(field(body, "{\"") == std::to_string(t0));
+
+  CompactReader rd;
+  rd.bytes = fromBase64(field(body, "\"b\":\""));
+  CHECK(rd.byte() == COMPACT_VERSION);
+  CHECK(rd.byte() == N);
+  CHECK(rd.byte() == CHANNEL_COUNT);
+  for (int f = 0; f < CHANNEL_COUNT; f++) {
+    const ValueFormat& want = VALUE_FORMATS[f];
+    std::string key;
+    for (int len = rd.byte(); len > 0; len--) key += (char)rd.byte();
+    CHECK(key == want.key);
+    uint8_t from = rd.byte();
+    if (want.from < 0) {
+      CHECK(from == 0xFF);
+      CHECK(rd.varint() == lroundf(want.scale));
+    } else {
+      CHECK(from == want.from);
+      uint32_t bits = 0;
+      for (int b = 0; b < 4; b++) bits |= (uint32_t)rd.byte() << (8 * b);
+      float factor;
+      memcpy(&factor, &bits, sizeof(factor));
+      CHECK(factor == want.factor);
+    }
+  }
+  int64_t fixed[RECORD_VALUES] = {};
+  t = t0;
+  for (int i = 0; i < N; i++) {
+    t += rd.varint();
+    CHECK(t == records[i].timestampMs);
+    for (int c = 0; c < RECORD_VALUES; c++) {
+      fixed[c] += rd.varint();
+      CHECK_NEAR(fixed[c] / VALUE_FORMATS[c].scale, records[i].value[c], 0.5 / VALUE_FORMATS[c].scale + 1e-6);
+    }
+    CHECK(rd.varint() == records[i].alerts);
+  }
+  CHECK(!rd.truncated && rd.pos == rd.bytes.size());
+
+  // An undated reading sends the batch as JSON instead
+  records[1].flags = LOG_FLAG_UNSYNCED;
+  BufWriter json(buf, sizeof(buf));
+  bool packed = encodeUploadBody<8, true>(records, N, VALUE_FORMATS.data(), CHANNEL_COUNT, json);
+  CHECK(!packed);
+  std::string jsonBody(json.buf, json.len);
+  CHECK(MockFirebase::wellFormed(json.buf, json.len));
+  CHECK(jsonBody.find("\"u0-" + std::to_string(records[1].timestampMs) + "\"") != std::string::npos);
+  CHECK(jsonBody.find("\"" + std::to_string(records[3].timestampMs) + "\"") != std::string::npos);
+}
+
+void testBatcher() {
+  const int BATCH = 3;
+  const unsigned long MAX_AGE_MS = 1000;
+  UploadBatcher<LogRecord, 4> batch;
+  std::vector<int> sent;
+  auto send = [&](const LogRecord*, int n) { sent.push_back(n); };
+  LogRecord r = {};
+
+  CHECK(!batch.due(5000, BATCH, MAX_AGE_MS, false));
+  batch.add(r, 100, BATCH, send);
+  CHECK(!batch.due(1099, BATCH, MAX_AGE_MS, false));
+  CHECK(batch.due(1100, BATCH, MAX_AGE_MS, false));  // First reading is MAX_AGE_MS old
+  CHECK(!batch.due(1100, BATCH, MAX_AGE_MS, true));  // Not while backing off
+  batch.add(r, 200, BATCH, send);
+  batch.add(r, 300, BATCH, send);
+  CHECK(batch.due(300, BATCH, MAX_AGE_MS, true));    // Full
+  batch.add(r, 400, BATCH, send);                    // Flushes the full batch first
+  CHECK(sent.size() == 1 && sent[0] == BATCH);
+  CHECK(batch.count == 1 && batch.startedAt == 400);
+
+  batch.flushRequested = true;
+  CHECK(batch.due(400, BATCH, MAX_AGE_MS, false));
+  batch.flush(send);
+  CHECK(sent.size() == 2 && sent[1] == 1);
+  CHECK(batch.count == 0 && !batch.flushRequested);
+  CHECK(!batch.due(400, BATCH, MAX_AGE_MS, false));
+}
+
+void testBackoff() {
+  CHECK(httpOk(200) && httpOk(204) && !httpOk(301) && !httpOk(-1));
+  CHECK(uploadRetryable(-1) && uploadRetryable(401) && uploadRetryable(429) && uploadRetryable(503));
+  CHECK(!uploadRetryable(400) && !uploadRetryable(404));
+
+  UploadBackoff b;
+  CHECK(!b.active(0));
+  // The wait is half the backoff plus random % (half + 1)
+  CHECK(b.failed(1000, 0, 2000, 9000) == 1000);
+  CHECK(b.active(1999) && !b.active(2000));
+  CHECK(b.failed(2000, 2000, 2000, 9000) == 4000);  // 4000: 2000 + 2000 % 2001
+  CHECK(b.backoffMs == 4000 && b.retryAt == 6000);
+  CHECK(b.failed(6000, 0, 2000, 9000) == 4000);     // 8000
+  CHECK(b.failed(10000, 0, 2000, 9000) == 4500);    // Capped at 9000
+  CHECK(b.backoffMs == 9000);
+  b.succeeded();
+  CHECK(!b.active(10001));
+  CHECK(b.failed(20000, 0, 2000, 9000) == 1000);    // Starts over from minMs
+}
+
+int main() {
+  testFilter();
+  testCalCurves();
+  testConversions();
+  testAlertLayout();
+  testCompact();
+  testBatcher();
+  testBackoff();
+  printf("test: %d checks, %d failed\n", checks, failures);
+  return failures ? 1 : 0;
+}
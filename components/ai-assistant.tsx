@@ -29,7 +29,7 @@ import {
   Star,
   RefreshCw,
 } from "lucide-react"
-import { ref, onValue, query, limitToLast } from "firebase/database"
+import { deviceReadingsQuery, onDeviceReadings } from "@/lib/device-readings"
 import { db } from "@/lib/firebase"
 import { format } from "date-fns"
 import { generateAIResponse, checkAPIAvailability as checkAPIAvailabilityAction } from "@/lib/ai-actions"
@@ -209,12 +209,11 @@ Ask me about any parameter and I'll analyze YOUR actual readings! 🌊`,
     }
 
     try {
-      // Create reference to sensor_readings node - LAST 50 READINGS (same as dashboard)
-      const sensorRef = ref(db, "sensor_readings")
-      const recentReadingsQuery = query(sensorRef, limitToLast(50))
+      // Newest readings of the configured device (see lib/device-readings.ts)
+      const recentReadingsQuery = deviceReadingsQuery(db, 50)
 
       // Set up real-time listener
-      const unsubscribe = onValue(
+      const unsubscribe = onDeviceReadings(
         recentReadingsQuery,
         (snapshot) => {
           if (!mountedRef.current) return
@@ -9,7 +9,7 @@ import { Card, CardContent, CardDescription, CardFooter, CardHeader, CardTitle }
 import { Button } from "@/components/ui/button"
 import { Badge } from "@/components/ui/badge"
 import { RefreshCw, AlertTriangle, Activity, Wifi, WifiOff, Zap } from "lucide-react"
-import { ref, onValue, query, limitToLast } from "firebase/database"
+import { deviceReadingsQuery, onDeviceReadings } from "@/lib/device-readings"
 import { db } from "@/lib/firebase"
 
 const Dashboard = () => {
@@ -76,10 +76,9 @@ const Dashboard = () => {
     }
 
     try {
-      const sensorRef = ref(db, "sensor_readings")
-      const recentReadingsQuery = query(sensorRef, limitToLast(50))
+      const recentReadingsQuery = deviceReadingsQuery(db, 50)
 
-      const unsubscribe = onValue(
+      const unsubscribe = onDeviceReadings(
         recentReadingsQuery,
         (snapshot) => {
           if (!mountedRef.current) return
@@ -19,7 +19,7 @@ import { CircularGauge } from "./circular-gauge"
 import { waterQualityEngine, type WaterQualityReading } from "@/lib/water-quality-lstm"
 
 // Firebase imports - use existing setup
-import { ref, onValue, query, limitToLast } from "firebase/database"
+import { deviceReadingsQuery, onDeviceReadings } from "@/lib/device-readings"
 import { db } from "@/lib/firebase"
 
 // Sensor type definitions
@@ -280,11 +280,10 @@ export default function EnhancedSensorDetail({ type }: { type: string }) {
     }
 
     try {
-      // Use EXACT same Firebase setup as working dashboard
-      const sensorRef = ref(db, "sensor_readings")
-      const recentReadingsQuery = query(sensorRef, limitToLast(50)) // Same as dashboard
+      // Use EXACT same Firebase setup as working dashboard (see lib/device-readings.ts)
+      const recentReadingsQuery = deviceReadingsQuery(db, 50)
 
-      const unsubscribe = onValue(
+      const unsubscribe = onDeviceReadings(
         recentReadingsQuery,
         (snapshot) => {
           console.log(`📡 ${sensorType} update - using DASHBOARD logic`)
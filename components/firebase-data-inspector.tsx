@@ -5,6 +5,7 @@ import { Card, CardContent, CardHeader, CardTitle } from "@/components/ui/card"
 import { Badge } from "@/components/ui/badge"
 import { Database, CheckCircle, AlertTriangle, Clock } from "lucide-react"
 import { initializeFirebaseRealtime } from "@/lib/firebase-realtime"
+import { deviceConfig } from "@/lib/config"
 import { ref, onValue, query, limitToLast, orderByKey } from "firebase/database"
 
 export function FirebaseDataInspector() {
@@ -28,8 +29,8 @@ export function FirebaseDataInspector() {
     setConnectionStatus("Connecting...")
 
     try {
-      const sensorRef = ref(db, "sensor_readings")
-      // Order by key (timestamp) and get the most recent entries
+      const sensorRef = ref(db, `devices/${deviceConfig.deviceId}/readings`)
+      // Order by key (sample time) and get the most recent entries
       const recentReadingsQuery = query(sensorRef, orderByKey(), limitToLast(10))
 
       const unsubscribe = onValue(
@@ -175,22 +176,22 @@ export function FirebaseDataInspector() {
                           <strong>Timestamp Key:</strong> {latestTimestamp}
                         </div>
                         <div>
-                          <strong>Entry ID:</strong> {latestData.entry_id || "N/A"}
+                          <strong>Alert bits:</strong> {latestData.a ?? "N/A"}
                         </div>
                         <div>
-                          <strong>pH:</strong> {latestData.ph || "N/A"}
+                          <strong>pH:</strong> {latestData.p ?? "N/A"}
                         </div>
                         <div>
-                          <strong>TDS:</strong> {latestData.tds || "N/A"}
+                          <strong>TDS:</strong> {latestData.d ?? "N/A"}
                         </div>
                         <div>
-                          <strong>Temperature:</strong> {latestData.temperature || "N/A"}
+                          <strong>Temperature:</strong> {latestData.t ?? "N/A"}
                         </div>
                         <div>
-                          <strong>EC:</strong> {latestData.ec || "N/A"}
+                          <strong>EC:</strong> {latestData.ec ?? "N/A"}
                         </div>
                         <div>
-                          <strong>Turbidity:</strong> {latestData.turbidity || "N/A"}
+                          <strong>Turbidity:</strong> {latestData.n ?? "N/A"}
                         </div>
                         <div>
                           <strong>Data Timestamp:</strong> {latestData.timestamp || "N/A"}
@@ -202,15 +203,19 @@ export function FirebaseDataInspector() {
                         </div>
                         <pre className="text-xs mt-1 text-gray-700">
                           {`{
-  "sensor_readings": {
-    "${latestTimestamp}": {
-      "entry_id": "${latestTimestamp}",
-      "temperature": "${latestData.temperature || "25.50"}",
-      "ph": "${latestData.ph || "7.20"}",
-      "tds": "${latestData.tds || "350.00"}",
-      "ec": "${latestData.ec || "700.00"}",
-      "turbidity": "${latestData.turbidity || "5.00"}",
-      "timestamp": "${latestTimestamp}"
+  "devices": {
+    "${deviceConfig.deviceId || "<device id>"}": {
+      "readings": {
+        "${latestTimestamp}": {
+          "t": ${latestData.t ?? 25.5},
+          "p": ${latestData.p ?? 7.2},
+          "n": ${latestData.n ?? 5.0},
+          "d": ${latestData.d ?? 350.0},
+          "ec": ${latestData.ec ?? 700.0},
+          "a": ${latestData.a ?? 0},
+          "timestamp": ${latestData.timestamp || latestTimestamp}
+        }
+      }
     }
   }
 }`}
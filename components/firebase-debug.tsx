@@ -3,6 +3,7 @@
 import { useEffect, useState } from "react"
 import { getDatabase, ref, onValue, query, limitToLast } from "firebase/database"
 import { initializeApp, getApps, getApp } from "firebase/app"
+import { deviceConfig } from "@/lib/config"
 import { Card, CardContent, CardHeader, CardTitle } from "@/components/ui/card"
 import { Badge } from "@/components/ui/badge"
 import { Button } from "@/components/ui/button"
@@ -57,7 +58,8 @@ export function FirebaseDebug() {
 
       // Try different paths to find where your data is stored
       const paths = [
-        "sensor_readings", // Current path
+        `devices/${deviceConfig.deviceId}/readings`, // Current firmware (JSON uploads)
+        "sensor_readings", // Before per-device subtrees
         "/sensor_readings", // With leading slash
         "sensorReadings", // Camel case
         "readings", // Simple name
@@ -151,7 +153,7 @@ export function FirebaseDebug() {
 
     try {
       const db = getDatabase(app)
-      const dataRef = ref(db, "sensor_readings")
+      const dataRef = ref(db, `devices/${deviceConfig.deviceId}/readings`)
       const dataQuery = query(dataRef, limitToLast(10))
 
       onValue(
@@ -4,7 +4,7 @@ import { useState, useEffect } from "react"
 import { Card, CardContent, CardHeader, CardTitle } from "@/components/ui/card"
 import { Button } from "@/components/ui/button"
 import { Droplets, Thermometer, Zap, Eye, TestTube, Clock } from "lucide-react"
-import { ref, onValue, query, limitToLast } from "firebase/database"
+import { deviceReadingsQuery, onDeviceReadings } from "@/lib/device-readings"
 import { db } from "@/lib/firebase"
 
 interface SensorCardProps {
@@ -70,10 +70,9 @@ export function IndividualSensorCard({ type, unit }: SensorCardProps) {
     }
 
     try {
-      const sensorRef = ref(db, "sensor_readings")
-      const recentReadingsQuery = query(sensorRef, limitToLast(50))
+      const recentReadingsQuery = deviceReadingsQuery(db, 50)
 
-      const unsubscribe = onValue(
+      const unsubscribe = onDeviceReadings(
         recentReadingsQuery,
         (snapshot) => {
           console.log(`📡 DIRECT Firebase update for ${type}`)
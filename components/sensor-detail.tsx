@@ -21,7 +21,7 @@ import { Sheet, SheetContent, SheetDescription, SheetHeader, SheetTitle, SheetTr
 import { waterQualityEngine, type WaterQualityReading } from "@/lib/water-quality-lstm"
 
 // Firebase imports
-import { ref, onValue, query, limitToLast } from "firebase/database"
+import { deviceReadingsQuery, onDeviceReadings } from "@/lib/device-readings"
 import { useFirebase } from "@/components/firebase-provider"
 
 // Sensor type definitions
@@ -259,16 +259,12 @@ export default function SensorDetail({ type }: { type: string }) {
     }
 
     try {
-      // Create reference to sensor_readings node
-      const sensorRef = ref(db, "sensor_readings")
-      console.log("Database reference created:", sensorRef.toString())
-
-      // Create query for the most recent readings
-      const recentReadingsQuery = query(sensorRef, limitToLast(100))
+      // Newest readings of the configured device (see lib/device-readings.ts)
+      const recentReadingsQuery = deviceReadingsQuery(db, 100)
       console.log("Query created for last 100 readings")
 
       // Set up real-time listener with error handling
-      const unsubscribe = onValue(
+      const unsubscribe = onDeviceReadings(
         recentReadingsQuery,
         (snapshot) => {
           console.log("Real-time update received for sensor detail")
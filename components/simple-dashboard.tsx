@@ -1,7 +1,8 @@
 "use client"
 
 import { useEffect, useState, useRef } from "react"
-import { getDatabase, ref, onValue, query, limitToLast } from "firebase/database"
+import { getDatabase } from "firebase/database"
+import { deviceReadingsQuery, onDeviceReadings } from "@/lib/device-readings"
 import { initializeApp, getApps, getApp } from "firebase/app"
 import { Card, CardContent, CardHeader, CardTitle } from "@/components/ui/card"
 import { Badge } from "@/components/ui/badge"
@@ -62,12 +63,11 @@ export function SimpleDashboard() {
         unsubscribeRef.current()
       }
 
-      // Create reference to sensor_readings node
-      const sensorRef = ref(db, "sensor_readings")
-      const recentReadingsQuery = query(sensorRef, limitToLast(20))
+      // Newest readings of the configured device (see lib/device-readings.ts)
+      const recentReadingsQuery = deviceReadingsQuery(db, 20)
 
       // Set up real-time listener
-      const unsubscribe = onValue(
+      const unsubscribe = onDeviceReadings(
         recentReadingsQuery,
         (snapshot) => {
           console.log("📊 Real-time update received:", snapshot.exists())
@@ -0,0 +1,224 @@
+// Decoder for the compact batch format written by the firmware (UPLOAD_COMPACT)
+// Each entry under /devices/<id>/packed is keyed by the first reading's epoch ms:
+//   { "<epoch ms>": { "b": "<base64>", "timestamp": <server time> } }
+// Version 3 bytes are a version byte, a count byte and a format count byte, then per format its key
+// (length byte + characters), the index of the stored value it is derived from (0xFF if stored) and
+// either a zigzag varint fixed-point scale (stored) or a float32 LE factor (derived). Each reading
+// follows as a zigzag varint time delta (ms), one zigzag varint fixed-point delta per stored value
+// and a zigzag varint of alert bits. The header carries everything the firmware's SENSOR_CHANNELS
+// table knows about the values, so a new channel decodes without changes here.
+// Versions 1 and 2 predate the header: four stored values (version 2 adds a count byte) in the
+// fixed layout LEGACY_FORMATS describes, and one byte of alert bits.
+
+export interface DeviceReading {
+  timestamp: number // Epoch ms when the sample was taken
+  values: Record<string, number> // Every value by its upload key ("t", "p", "n", "d", "ec", ...)
+  temperature: number // °C
+  ph: number
+  turbidity: number // NTU
+  tds: number // ppm
+  ec: number // µS/cm, derived as 2 * TDS
+  alerts: number // Alert bits, same as the "a" field of JSON readings
+}
+
+interface ValueFormat {
+  key: string
+  from: number // -1 if stored, else the stored value it is derived from
+  scale: number // Stored: fixed-point steps per unit
+  factor: number // Derived: multiple of the stored value
+}
+
+const COMPACT_VERSION = 3
+// The channels of versions 1 and 2, which did not describe them
+const LEGACY_FORMATS: ValueFormat[] = [
+  { key: "t", from: -1, scale: 100, factor: 0 },
+  { key: "p", from: -1, scale: 100, factor: 0 },
+  { key: "n", from: -1, scale: 10, factor: 0 },
+  { key: "d", from: -1, scale: 10, factor: 0 },
+  { key: "ec", from: 3, scale: 1, factor: 2 },
+]
+
+// The named fields the components read, from the values by key
+function toReading(timestamp: number, values: Record<string, number>, alerts: number): DeviceReading {
+  return {
+    timestamp,
+    values,
+    temperature: values.t,
+    ph: values.p,
+    turbidity: values.n,
+    tds: values.d,
+    ec: values.ec ?? values.d * 2,
+    alerts,
+  }
+}
+
+function base64ToBytes(b64: string): Uint8Array {
+  const binary = atob(b64)
+  const bytes = new Uint8Array(binary.length)
+  for (let i = 0; i < binary.length; i++) {
+    bytes[i] = binary.charCodeAt(i)
+  }
+  return bytes
+}
+
+// Read one zigzag varint; arithmetic rather than bitwise ops so time deltas beyond 32 bits survive
+function readVarint(bytes: Uint8Array, state: { pos: number }): number {
+  let value = 0
+  let scale = 1
+  for (;;) {
+    if (state.pos >= bytes.length) throw new Error("Truncated compact batch")
+    const b = bytes[state.pos++]
+    value += (b & 0x7f) * scale
+    scale *= 128
+    if (!(b & 0x80)) break
+  }
+  return value % 2 === 0 ? value / 2 : -(value + 1) / 2
+}
+
+function readByte(bytes: Uint8Array, state: { pos: number }): number {
+  if (state.pos >= bytes.length) throw new Error("Truncated compact batch")
+  return bytes[state.pos++]
+}
+
+// The version 3 header's formats
+function readFormats(bytes: Uint8Array, state: { pos: number }): ValueFormat[] {
+  const count = readByte(bytes, state)
+  const formats: ValueFormat[] = []
+  for (let f = 0; f < count; f++) {
+    const keyLength = readByte(bytes, state)
+    let key = ""
+    for (let i = 0; i < keyLength; i++) key += String.fromCharCode(readByte(bytes, state))
+    const fromByte = readByte(bytes, state)
+    if (fromByte === 0xff) {
+      formats.push({ key, from: -1, scale: readVarint(bytes, state), factor: 0 })
+    } else {
+      if (state.pos + 4 > bytes.length) throw new Error("Truncated compact batch")
+      const factor = new DataView(bytes.buffer, bytes.byteOffset + state.pos, 4).getFloat32(0, true)
+      state.pos += 4
+      formats.push({ key, from: fromByte, scale: 1, factor })
+    }
+  }
+  return formats
+}
+
+// Expand one packed entry into its readings
+export function decodeCompactBatch(key: string, packed: string): DeviceReading[] {
+  const bytes = base64ToBytes(packed)
+  const version = bytes[0]
+  if (bytes.length < 2 || version < 1 || version > COMPACT_VERSION) {
+    throw new Error(`Unsupported compact batch version ${version}`)
+  }
+  const count = bytes[1]
+  const state = { pos: 2 }
+  let formats = LEGACY_FORMATS
+  let values = 4
+  if (version === 2) {
+    values = readByte(bytes, state) // Values past the first four are skipped
+    if (values < 4) throw new Error("Compact batch is missing channels")
+  } else if (version >= 3) {
+    formats = readFormats(bytes, state)
+    values = formats.filter((f) => f.from < 0).length
+  }
+  const stored = formats.filter((f) => f.from < 0)
+  if (formats.some((f) => f.from >= stored.length)) throw new Error("Compact batch derives from a missing value")
+  const readings: DeviceReading[] = []
+  const fixed = new Array<number>(values).fill(0)
+  let time = Number.parseInt(key, 10)
+
+  for (let i = 0; i < count; i++) {
+    time += readVarint(bytes, state)
+    for (let c = 0; c < values; c++) {
+      fixed[c] += readVarint(bytes, state)
+    }
+    const alerts = version >= 3 ? readVarint(bytes, state) : readByte(bytes, state)
+    const byKey: Record<string, number> = {}
+    stored.forEach((f, c) => (byKey[f.key] = fixed[c] / f.scale))
+    formats.forEach((f) => {
+      if (f.from >= 0) byKey[f.key] = byKey[stored[f.from].key] * f.factor
+    })
+    readings.push(toReading(time, byKey, alerts))
+  }
+  return readings
+}
+
+// Merge a device's "readings" (JSON) and "packed" (compact) nodes into one list, oldest first
+export function expandDeviceReadings(readingsNode: any, packedNode: any): DeviceReading[] {
+  const result: DeviceReading[] = []
+
+  for (const [key, value] of Object.entries<any>(readingsNode || {})) {
+    const timestamp = Number.parseInt(key, 10)
+    if (Number.isNaN(timestamp)) continue // Undated reading (u<session>-<ms>)
+    const values: Record<string, number> = {}
+    for (const [field, v] of Object.entries<any>(value || {})) {
+      if (field !== "a" && field !== "timestamp" && typeof v === "number") values[field] = v
+    }
+    result.push(toReading(timestamp, values, Number(value.a ?? 0)))
+  }
+
+  for (const [key, value] of Object.entries<any>(packedNode || {})) {
+    try {
+      result.push(...decodeCompactBatch(key, value.b))
+    } catch (error) {
+      console.error(`❌ Could not decode packed batch ${key}:`, error)
+    }
+  }
+
+  return result.sort((a, b) => a.timestamp - b.timestamp)
+}
+
+// Burst captures (see BURST CAPTURE in main.cpp) live under /devices/<id>/bursts/<start epoch ms>:
+//   { hz, frames, window_frames, chunks, trigger, t, keys: ["p", "n", "d"], scale: { p, n, d },
+//     windows: { p: [[min, max, mean, sd], ...], n: [...], d: [...] }, trace: ["<base64>", ...] }
+// Each trace chunk is a version byte, a channel count byte, a zigzag varint frame count, then per
+// frame and channel a zigzag varint fixed-point delta against the previous frame (the first against 0).
+// keys gives the channel order; captures from before it was added always hold pH, turbidity and TDS.
+const TRACE_VERSION = 1
+const LEGACY_TRACE_KEYS = ["p", "n", "d"]
+
+export interface BurstCapture {
+  start: number // Epoch ms of the first frame
+  hz: number
+  trigger: string // "command" or "alert"
+  series: Record<string, number[]> // Full-resolution values per channel key
+  windows: Record<string, [number, number, number, number][]> // [min, max, mean, sd] per sub-window
+}
+
+// Decode one trace chunk into frames of integer fixed-point values
+export function decodeTraceChunk(packed: string): number[][] {
+  const bytes = base64ToBytes(packed)
+  if (bytes.length < 2 || bytes[0] !== TRACE_VERSION) {
+    throw new Error(`Unsupported trace version ${bytes[0]}`)
+  }
+  const channels = bytes[1]
+  const state = { pos: 2 }
+  const count = readVarint(bytes, state)
+  const frames: number[][] = []
+  let prev = new Array<number>(channels).fill(0)
+  for (let i = 0; i < count; i++) {
+    const frame = prev.map((v) => v + readVarint(bytes, state))
+    frames.push(frame)
+    prev = frame
+  }
+  return frames
+}
+
+// Expand a burst node; returns null while its trace is still being uploaded
+export function decodeBurstCapture(key: string, node: any): BurstCapture | null {
+  const trace: string[] = Array.isArray(node?.trace) ? node.trace : Object.values(node?.trace || {})
+  if (!node?.chunks || trace.length < node.chunks) return null
+  const keys: string[] = Array.isArray(node.keys) ? node.keys : LEGACY_TRACE_KEYS
+  const series: Record<string, number[]> = {}
+  keys.forEach((k) => (series[k] = []))
+  for (const chunk of trace.slice(0, node.chunks)) {
+    for (const frame of decodeTraceChunk(chunk)) {
+      keys.forEach((k, c) => series[k].push(frame[c] / Number(node.scale?.[k] ?? 1)))
+    }
+  }
+  return {
+    start: Number.parseInt(key, 10),
+    hz: Number(node.hz),
+    trigger: String(node.trigger ?? ""),
+    series,
+    windows: node.windows ?? {},
+  }
+}
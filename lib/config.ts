@@ -9,6 +9,12 @@ export const firebaseConfig = {
   measurementId: process.env.NEXT_PUBLIC_FIREBASE_MEASUREMENT_ID,
 }
 
+// Device shown by the dashboard: its ID is the ESP32's factory MAC in hex, as printed on Serial
+// and used in /devices/<id> (see lib/device-readings.ts)
+export const deviceConfig = {
+  deviceId: process.env.NEXT_PUBLIC_DEVICE_ID || "",
+}
+
 // Supabase configuration
 export const supabaseConfig = {
   url: process.env.NEXT_PUBLIC_SUPABASE_URL || "",
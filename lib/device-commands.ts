@@ -0,0 +1,55 @@
+// Send commands to a device over its /devices/<id>/command node (see REMOTE COMMANDS in main.cpp)
+// The device holds a stream on the node, runs each new command within about a second of
+// it being written and reports the outcome under /devices/<id>/command_ack.
+import { ref, set, onValue, serverTimestamp } from "firebase/database"
+import { initializeFirebaseRealtime } from "./firebase-realtime"
+
+export type DeviceCommand =
+  | { cmd: "sample" } // Take and upload a reading now
+  | { cmd: "live"; minutes: number; interval_s?: number } // Upload every reading for a while (1 Hz by default)
+  | { cmd: "stop" } // End live mode
+  | { cmd: "flush" } // Send batched and buffered readings now
+  | { cmd: "config" } // Re-read the remote config
+  | { cmd: "burst"; seconds?: number; hz?: number; window_s?: number } // High-rate capture (default 30 s at 100 Hz)
+
+export interface CommandAck {
+  ts: number // Server time the command was written; identifies it
+  cmd: string
+  status: "ok" | "asleep" | "bad_args" | "unknown" | "busy" | "no_clock" | "no_memory" | "unsupported"
+  at: number // Server time the device acknowledged it
+}
+
+// Write a command, resolving with its ack or null if none arrives within timeoutMs
+export async function sendDeviceCommand(
+  deviceId: string,
+  command: DeviceCommand,
+  timeoutMs = 10000,
+): Promise<CommandAck | null> {
+  const { db } = initializeFirebaseRealtime()
+  if (!db) throw new Error("Firebase database not initialized")
+
+  const sentAt = Date.now()
+  await set(ref(db, `devices/${deviceId}/command`), { ...command, ts: serverTimestamp() })
+
+  return new Promise((resolve) => {
+    let done = false
+    let unsubscribe: (() => void) | null = null
+    const finish = (ack: CommandAck | null) => {
+      done = true
+      clearTimeout(timer)
+      resolve(ack)
+    }
+    const timer = setTimeout(() => {
+      unsubscribe?.()
+      finish(null)
+    }, timeoutMs)
+    unsubscribe = onValue(ref(db, `devices/${deviceId}/command_ack`), (snapshot) => {
+      const ack = snapshot.val() as CommandAck | null
+      // Skip the previous command's ack; server and local clocks agree to well within this margin
+      if (done || !ack || ack.cmd !== command.cmd || ack.ts < sentAt - 5000) return
+      finish(ack)
+      unsubscribe?.() // Null when onValue answers synchronously from cache; handled below
+    })
+    if (done) unsubscribe()
+  })
+}
@@ -0,0 +1,94 @@
+// Live and one-off reads of the device the dashboard shows (NEXT_PUBLIC_DEVICE_ID, see lib/config.ts).
+// The firmware writes each reading under /devices/<id>/readings/<epoch ms> (JSON) or, with
+// UPLOAD_COMPACT, a whole batch under /devices/<id>/packed/<epoch ms>. These helpers merge both
+// nodes and hand back a snapshot-like list of readings, oldest first, with the field names the
+// components read: ph, tds, temperature, ec, turbidity, timestamp (epoch ms) and alerts, plus
+// values, every channel by its upload key (including any the named fields do not cover).
+import { ref, query, orderByKey, limitToLast, onValue, get, type Database } from "firebase/database"
+import { deviceConfig } from "./config"
+import { expandDeviceReadings, type DeviceReading } from "./compact-readings"
+
+export interface ReadingsQuery {
+  db: Database
+  deviceId: string
+  limit: number // Newest readings to return
+}
+
+export interface ReadingChild {
+  key: string // Epoch ms of the sample
+  val(): any // As DataSnapshot.val(); the fields listed above
+}
+
+// The subset of a DataSnapshot the components use
+export interface ReadingsSnapshot {
+  size: number
+  exists(): boolean
+  forEach(action: (child: ReadingChild) => void): void
+}
+
+// The newest limit readings of a device (the configured one by default)
+export function deviceReadingsQuery(db: Database, limit: number, deviceId = deviceConfig.deviceId): ReadingsQuery {
+  return { db, deviceId, limit }
+}
+
+function toSnapshot(readings: DeviceReading[]): ReadingsSnapshot {
+  const children: ReadingChild[] = readings.map((r) => {
+    const value = {
+      temperature: r.temperature,
+      ph: r.ph,
+      turbidity: r.turbidity,
+      tds: r.tds,
+      ec: r.ec,
+      alerts: r.alerts,
+      timestamp: r.timestamp,
+      values: r.values,
+    }
+    return { key: String(r.timestamp), val: () => value }
+  })
+  return {
+    size: children.length,
+    exists: () => children.length > 0,
+    forEach: (action) => children.forEach(action),
+  }
+}
+
+// A packed entry holds a whole upload batch, so limit entries of each node always cover the newest
+// limit readings
+function nodeQueries(q: ReadingsQuery) {
+  if (!q.deviceId) throw new Error("NEXT_PUBLIC_DEVICE_ID is not set")
+  const base = `devices/${q.deviceId}`
+  return [
+    query(ref(q.db, `${base}/readings`), orderByKey(), limitToLast(q.limit)),
+    query(ref(q.db, `${base}/packed`), orderByKey(), limitToLast(q.limit)),
+  ]
+}
+
+function merge(q: ReadingsQuery, readingsNode: any, packedNode: any): ReadingsSnapshot {
+  return toSnapshot(expandDeviceReadings(readingsNode, packedNode).slice(-q.limit))
+}
+
+// Listen to both nodes; onData runs once both have loaded and again on every change
+export function onDeviceReadings(
+  q: ReadingsQuery,
+  onData: (snapshot: ReadingsSnapshot) => void,
+  onError?: (error: Error) => void,
+): () => void {
+  const [readingsQuery, packedQuery] = nodeQueries(q)
+  const nodes: [any, any] = [undefined, undefined]
+  const update = (i: number, value: any) => {
+    nodes[i] = value ?? null
+    if (nodes[0] !== undefined && nodes[1] !== undefined) onData(merge(q, nodes[0], nodes[1]))
+  }
+  const unsubscribers = [
+    onValue(readingsQuery, (snapshot) => update(0, snapshot.val()), onError),
+    onValue(packedQuery, (snapshot) => update(1, snapshot.val()), onError),
+  ]
+  return () => unsubscribers.forEach((unsubscribe) => unsubscribe())
+}
+
+// Read both nodes once
+export async function getDeviceReadings(q: ReadingsQuery): Promise<ReadingsSnapshot> {
+  const [readingsQuery, packedQuery] = nodeQueries(q)
+  const [readings, packed] = await Promise.all([get(readingsQuery), get(packedQuery)])
+  return merge(q, readings.val(), packed.val())
+}
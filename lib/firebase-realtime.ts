@@ -1,6 +1,7 @@
 // Simplified Firebase real-time connection with timestamp-based keys
 import { initializeApp, getApps, getApp } from "firebase/app"
-import { getDatabase, ref, onValue, query, limitToLast, orderByKey, type Database } from "firebase/database"
+import { getDatabase, type Database } from "firebase/database"
+import { deviceReadingsQuery, onDeviceReadings } from "./device-readings"
 
 // Firebase configuration - only use client-safe environment variables
 const firebaseConfig = {
@@ -87,16 +88,15 @@ export function setupRealtimeListener(
   }
 
   try {
-    // Create reference to sensor_readings with ordering by key (timestamp)
-    const sensorRef = ref(db, "sensor_readings")
-    const recentReadingsQuery = query(sensorRef, orderByKey(), limitToLast(100)) // Increased to 100 for more data
+    // Newest readings of the configured device (see lib/device-readings.ts)
+    const recentReadingsQuery = deviceReadingsQuery(db, 100)
 
-    console.log("📍 Setting up listener on path: sensor_readings (FIXED)")
+    console.log("📍 Setting up listener on the device readings (FIXED)")
 
     // Set up the real-time listener with immediate connection feedback
     onConnectionChange(true) // Assume connected initially
 
-    const unsubscribe = onValue(
+    const unsubscribe = onDeviceReadings(
       recentReadingsQuery,
       (snapshot) => {
         const timestamp = new Date()
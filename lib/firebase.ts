@@ -1,6 +1,7 @@
 // Firebase configuration and helper functions with public read access
 import { initializeApp, getApps, getApp } from "firebase/app"
 import { getDatabase, ref, query, limitToLast, onValue, push, serverTimestamp, get } from "firebase/database"
+import { deviceReadingsQuery, onDeviceReadings, getDeviceReadings } from "./device-readings"
 import { getAuth, signInAnonymously, onAuthStateChanged, type User } from "firebase/auth"
 
 // Firebase configuration
@@ -224,14 +225,11 @@ export function subscribeToSensorData(
 
       try {
         // Query Firebase Realtime Database for sensor readings
-        const sensorRef = ref(db, "sensor_readings")
-        console.log("📍 Database reference created:", sensorRef.toString())
-
-        const recentReadingsQuery = query(sensorRef, limitToLast(100))
+        const recentReadingsQuery = deviceReadingsQuery(db, 100)
         console.log("📊 Query created for last 100 readings")
 
         // Set up real-time listener
-        const unsubscribe = onValue(
+        const unsubscribe = onDeviceReadings(
           recentReadingsQuery,
           (snapshot) => {
             console.log("📊 Real-time update received from Firebase")
@@ -380,10 +378,9 @@ export function subscribeToSensorDataByDateRange(
       console.log("Setting up Firebase date range listener (public read access)...")
 
       try {
-        const sensorRef = ref(db, "sensor_readings")
-        const dateRangeQuery = query(sensorRef, limitToLast(100))
+        const dateRangeQuery = deviceReadingsQuery(db, 100)
 
-        const unsubscribe = onValue(
+        const unsubscribe = onDeviceReadings(
           dateRangeQuery,
           (snapshot) => {
             console.log("Real-time update received from Firebase for date range")
@@ -527,10 +524,9 @@ export async function fetchSensorData(hours: string): Promise<SensorData> {
     console.log("Fetching from Firebase with public read access")
 
     try {
-      const sensorRef = ref(db, "sensor_readings")
-      const recentReadingsQuery = query(sensorRef, limitToLast(100))
+      const recentReadingsQuery = deviceReadingsQuery(db, 100)
 
-      const snapshot = await get(recentReadingsQuery)
+      const snapshot = await getDeviceReadings(recentReadingsQuery)
 
       if (!snapshot.exists()) {
         console.log("No data found in Firebase, using mock data")
@@ -599,10 +595,9 @@ export async function fetchSensorDataByDateRange(startDate: string, endDate: str
     console.log("Fetching date range from Firebase with public read access")
 
     try {
-      const sensorRef = ref(db, "sensor_readings")
-      const dateRangeQuery = query(sensorRef, limitToLast(100))
+      const dateRangeQuery = deviceReadingsQuery(db, 100)
 
-      const snapshot = await get(dateRangeQuery)
+      const snapshot = await getDeviceReadings(dateRangeQuery)
 
       if (!snapshot.exists()) {
         console.log("No data found in Firebase for date range, using mock data")
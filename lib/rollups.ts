@@ -0,0 +1,98 @@
+// Reader for the rollups the firmware writes under /rollups/<device id> (see ROLLUPS in main.cpp)
+//   /rollups/<id>/1m/<bucket start epoch ms> and /rollups/<id>/1h/<bucket start epoch ms>:
+//   { count, t: [min, max, sum, sumSq], p: [...], n: [...], d: [...] }
+// with one array per stored channel by its upload key, so points carry whatever channels the
+// device's SENSOR_CHANNELS table has.
+// Buckets merge by adding counts and sums, so a chart over a long range reads one entry per
+// minute or hour instead of every reading.
+import { ref, query, orderByKey, startAt, endAt, get } from "firebase/database"
+import { initializeFirebaseRealtime } from "./firebase-realtime"
+
+export type RollupResolution = "1m" | "1h"
+
+export interface ChannelStats {
+  min: number
+  max: number
+  mean: number
+  stddev: number
+}
+
+export interface RollupPoint {
+  start: number // Epoch ms of the first bucket merged into this point
+  count: number
+  channels: Record<string, ChannelStats> // By upload key: t, p, n, d, ...
+}
+
+interface RawBucket {
+  start: number
+  count: number
+  sums: Record<string, [number, number, number, number]>
+}
+
+// Merge consecutive buckets into points spanning spanMs (one point per bucket if spanMs is 0)
+function mergeBuckets(buckets: RawBucket[], spanMs: number): RollupPoint[] {
+  const points: RollupPoint[] = []
+  let group: RawBucket[] = []
+
+  const flush = () => {
+    if (group.length === 0) return
+    const count = group.reduce((n, b) => n + b.count, 0)
+    const channels: Record<string, ChannelStats> = {}
+    const keys = new Set(group.flatMap((b) => Object.keys(b.sums)))
+    for (const key of keys) {
+      let min = Number.POSITIVE_INFINITY
+      let max = Number.NEGATIVE_INFINITY
+      let sum = 0
+      let sumSq = 0
+      for (const b of group) {
+        const [bMin, bMax, bSum, bSumSq] = b.sums[key] ?? [Number.NaN, Number.NaN, 0, 0]
+        min = Math.min(min, bMin)
+        max = Math.max(max, bMax)
+        sum += bSum
+        sumSq += bSumSq
+      }
+      const mean = count > 0 ? sum / count : Number.NaN
+      channels[key] = { min, max, mean, stddev: count > 0 ? Math.sqrt(Math.max(0, sumSq / count - mean * mean)) : 0 }
+    }
+    points.push({ start: group[0].start, count, channels })
+    group = []
+  }
+
+  for (const b of buckets) {
+    if (group.length > 0 && (spanMs <= 0 || b.start - group[0].start >= spanMs)) flush()
+    group.push(b)
+  }
+  flush()
+  return points
+}
+
+// Load a device's buckets in [startMs, endMs], optionally merged into points of spanMs each
+export async function fetchRollups(
+  deviceId: string,
+  resolution: RollupResolution,
+  startMs: number,
+  endMs: number,
+  spanMs = 0,
+): Promise<RollupPoint[]> {
+  const { db } = initializeFirebaseRealtime()
+  if (!db) throw new Error("Firebase database not initialized")
+
+  // Keys are 13-digit epoch ms, so key order is time order
+  const rollupQuery = query(
+    ref(db, `rollups/${deviceId}/${resolution}`),
+    orderByKey(),
+    startAt(String(startMs)),
+    endAt(String(endMs)),
+  )
+  const snapshot = await get(rollupQuery)
+  const buckets: RawBucket[] = []
+  snapshot.forEach((child) => {
+    const value = child.val()
+    const sums: RawBucket["sums"] = {}
+    for (const [key, v] of Object.entries<any>(value || {})) {
+      if (Array.isArray(v) && v.length === 4) sums[key] = v as [number, number, number, number]
+    }
+    buckets.push({ start: Number.parseInt(child.key ?? "0", 10), count: Number(value.count ?? 0), sums })
+  })
+  return mergeBuckets(buckets, spanMs)
+}
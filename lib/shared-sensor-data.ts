@@ -1,5 +1,5 @@
 // Shared sensor data processing to ensure dashboard and individual pages show identical values
-import { ref, onValue, query, limitToLast } from "firebase/database"
+import { deviceReadingsQuery, onDeviceReadings } from "@/lib/device-readings"
 import { db } from "@/lib/firebase"
 
 export interface SensorReading {
@@ -153,12 +153,11 @@ export function setupSharedSensorListener(
   }
 
   try {
-    // Create reference to sensor_readings node - LAST 50 READINGS
-    const sensorRef = ref(db, "sensor_readings")
-    const recentReadingsQuery = query(sensorRef, limitToLast(50)) // Changed from 100 to 50
+    // Newest readings of the configured device (see lib/device-readings.ts)
+    const recentReadingsQuery = deviceReadingsQuery(db, 50)
 
     // Set up real-time listener
-    const unsubscribe = onValue(
+    const unsubscribe = onDeviceReadings(
       recentReadingsQuery,
       (snapshot) => {
         console.log("📡 SHARED Firebase update received")
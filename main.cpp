@@ -13,6 +13,25 @@
 #include <LiquidCrystal_I2C_STEM.h>
 #include <esp_sleep.h>
 #include <Preferences.h>
+#include <esp_adc_cal.h>
+#include <esp_adc/adc_continuous.h>
+#include <esp_partition.h>
+#include <esp_rom_crc.h>
+#include <esp_tls.h>
+#include <esp_crt_bundle.h>
+#include <esp_sntp.h>
+#include <esp_mac.h>
+#include <esp_pm.h>
+#include <driver/gpio.h>
+#include <esp_cpu.h>
+#include <esp_heap_caps.h>
+#include "sensor_pipeline.h"
+#include "sensor_channels.h"  // SENSOR_CHANNELS, with the probe pins, alert limits and calibration defaults
+#include <array>
+#include <atomic>
+#include <tuple>
+#include <utility>
+#include <climits>
 
 // ===================== USER CONFIGURATION =====================
 #define WIFI_SSID "YOUR_WIFI_SSID"                 // WiFi SSID (for both WPA2 Enterprise and normal WiFi)
@@ -21,6 +40,38 @@
 #define WIFI_EAP_PASSWORD "YOUR_SCHOOL_PASSWORD"  // WPA2 Enterprise password
 #define FIREBASE_API_KEY "YOUR_FIREBASE_WEB_API_KEY"
 #define FIREBASE_PROJECT_ID "YOUR_FIREBASE_PROJECT_ID"
+#define WIFI_USE_ENTERPRISE 1                     // Default WiFi mode until changed from the menu (1 = WPA2 Enterprise, 0 = PSK)
+#define TEMP_ASYNC_MODE 1                         // 1 = non-blocking DS18B20 conversion, 0 = blocking reads
+#define ADC_CONTINUOUS_MODE 1                     // 1 = DMA-driven continuous ADC, 0 = one analogRead() per reading
+#define ADC_SAMPLE_RATE_HZ 20000                  // Total conversion rate across all channels (ESP32 minimum is 20 kHz)
+#define ADC_OVERSAMPLE 256                        // Raw samples averaged (and decimated) into one reading per channel
+#define UPLOAD_BATCH_SIZE 8                       // Readings per upload (1 = send every reading on its own); remote config may lower it
+#define SAMPLE_INTERVAL_MS 15000                  // Default time between uploaded readings while they are changing; remote config may change it
+#define HEARTBEAT_INTERVAL_MS 600000              // Default time between uploaded readings while they are stable; remote config may change it
+#define ADAPTIVE_UPLOADS 1                        // 1 = upload on change plus heartbeats, 0 = upload every SAMPLE_INTERVAL_MS
+#define ALERT_Z_THRESHOLD 4.0                     // Alert when a reading is this many standard deviations from its recent mean
+#define CONFIG_POLL_MS 60000                      // How often the remote config nodes are checked
+#define UPLOAD_BATCH_MAX_AGE_MS 120000            // Flush a partial batch once its oldest reading is this old
+#define UPLOAD_TIMEOUT_MS 10000                   // Give up on an upload request after this long
+#define DUTY_CYCLE_WAKE_S 60                      // Sleep sampling: seconds between timer wakeups (0 = sleep until SELECT)
+#define DUTY_CYCLE_FLUSH_EVERY 15                 // Sleep sampling: bring up WiFi and upload every this many wakeups
+#define DUTY_CYCLE_FLUSH_TIMEOUT_MS 30000         // Sleep sampling: give up on WiFi/upload after this long
+#define NTP_SERVER "pool.ntp.org"                 // SNTP server used to set the clock
+#define PM_LIGHT_SLEEP 1                          // 1 = frequency scaling and automatic light sleep while idle
+#define PM_MAX_FREQ_MHZ 240
+#define PM_MIN_FREQ_MHZ 40                        // CPU clock while only timers are pending
+#define POWER_MONITOR_INA219 0                    // 1 = measure supply current with an INA219 (I2C 0x40) in the supply line
+#define INA219_SHUNT_MOHM 100                     // INA219 shunt resistor in milliohms
+#define DEEP_SLEEP_CURRENT_UA 0                   // Board current in deep sleep, measured with a meter (0 = unknown)
+#define UPLOAD_COMPACT 0                          // 1 = send each batch as one packed binary entry (see encodeRecordsCompact())
+#define PERF_STATS 1                              // 1 = time hot paths and keep counters (Stats menu, diag node); 0 strips it out
+#define DIAG_PUBLISH_MS 300000                    // How often the counters are written to /devices/<id>/diag
+#define BURST_ON_ALERT_S 20                       // Burst capture this many seconds when a new alert is raised (0 = off)
+#define BURST_DEFAULT_HZ 100                      // Burst capture frame rate per channel unless the command sets one
+#define REMOTE_COMMANDS 1                         // 1 = listen for operator commands on /devices/<id>/command
+#define UPLOAD_DEBUG_ECHO 0                       // 1 = echo each encoded upload body to Serial
+#define FIREBASE_HOST FIREBASE_PROJECT_ID ".firebaseio.com"
+// Probe pins, alert limits and calibration standards: CHANNEL CONFIGURATION in sensor_channels.h
 // =============================================================
 
 // Firebase and LCD objects
@@ -32,69 +83,365 @@ OneWire oneWire(4);
 DallasTemperature sensors(&oneWire);
 Preferences preferences;
 
-// Pin assignments
-const int PH_PIN = 34;      // Analog pin for pH sensor
-const int TURB_PIN = 35;    // Analog pin for Turbidity sensor
-const int TDS_PIN = 36;     // Analog pin for TDS/EC sensor
+// Pin assignments (the probes' are in sensor_channels.h)
 const int BTN_UP = 14;      // Button: Up
 const int BTN_DOWN = 27;    // Button: Down
 const int BTN_SELECT = 26;  // Button: Select
 const int BTN_BACK = 25;    // Button: Back
 
-// Menu items
-const char* menuItems[] = { "Temperature", "pH", "Turbidity", "TDS", "EC", "Power Save", "Send Data" };
+portMUX_TYPE curveWriteMux = portMUX_INITIALIZER_UNLOCKED;  // Serializes storeCalCurve()
+
+// Settings that can be pushed from the database (see REMOTE CONFIG)
+struct RuntimeConfig {
+  volatile uint32_t sampleIntervalMs;  // Time between uploaded readings while they are changing
+  volatile uint32_t heartbeatMs;       // Time between uploaded readings while they are stable
+  volatile int batchSize;              // Readings per upload, 1..UPLOAD_BATCH_SIZE
+  std::array<float, CHANNEL_COUNT> limitMin;  // Alert limits by table entry, NAN for no bound
+  std::array<float, CHANNEL_COUNT> limitMax;
+  float zThreshold;
+};
+RuntimeConfig runtimeConfig = { SAMPLE_INTERVAL_MS, HEARTBEAT_INTERVAL_MS, UPLOAD_BATCH_SIZE,
+                                LIMIT_MIN_DEFAULTS, LIMIT_MAX_DEFAULTS, ALERT_Z_THRESHOLD };
+
+// Menu items: a live view per channel, then the actions below
+const int MENU_POWER_SAVE = CHANNEL_COUNT;
+const int MENU_SEND = CHANNEL_COUNT + 1;
+const int MENU_WIFI = CHANNEL_COUNT + 2;
+const int MENU_SLEEP = CHANNEL_COUNT + 3;
+const int MENU_STATS = CHANNEL_COUNT + 4;
+const int MENU_CALIBRATE = CHANNEL_COUNT + 5;
+const int menuItemsCount = CHANNEL_COUNT + 6;
+const char* const MENU_ACTIONS[] = { "Power Save", "Send Data", "WiFi Mode", "Sleep Sampling", "Stats", "Calibrate" };
+static_assert(sizeof(MENU_ACTIONS) / sizeof(MENU_ACTIONS[0]) == menuItemsCount - CHANNEL_COUNT, "menu out of step");
 int currentMenuItem = 0;
-const int menuItemsCount = 7;
-bool inSubMenu = false;
-unsigned long lastButtonPress = 0;
+int liveItem = -1;         // Menu item shown live, a reading, MENU_STATS or MENU_CALIBRATE (see refreshLiveView()), -1 in the menu
+int statsPage = 0;         // Page of the Stats view (see displayStats())
 unsigned long lastLCDActivity = 0;
 bool lcdBacklightOn = true;
 
-// Calibration values (will be loaded from Preferences)
-float ph_slope = -1.5;
-float ph_intercept = 7.0;
-float turb_slope = -50.0;
-float turb_intercept = 100.0;
-float tds_k = 0.5; // TDS probe constant
-
-// Buffers for sensor averaging
-unsigned long lastRead = 0;
-float phBuf[3], turbBuf[3], tdsBuf[3];
-int phPtr = 0, turbPtr = 0, tdsPtr = 0;
-bool powerSaveMode = false;
-
-// ===================== CALIBRATION STORAGE =====================
-// Load calibration values from Preferences (NVS)
-void loadCalibration() {
-  preferences.begin("calib", true); // read-only
-  ph_slope = preferences.getFloat("ph_slope", ph_slope);
-  ph_intercept = preferences.getFloat("ph_intercept", ph_intercept);
-  turb_slope = preferences.getFloat("turb_slope", turb_slope);
-  turb_intercept = preferences.getFloat("turb_intercept", turb_intercept);
-  tds_k = preferences.getFloat("tds_k", tds_k);
+// Calibration curves (read with loadCalCurve(), see sensor_channels.h)
+// Replace a calibration curve. The copy runs in a critical section, so it is
+// never preempted halfway and a reader on the other core waits at most a few
+// hundred cycles.
+void storeCalCurve(CurveSeqlock& k, const CalCurve& c) {
+  portENTER_CRITICAL(&curveWriteMux);
+  uint32_t q = k.seq.load(std::memory_order_relaxed);
+  k.seq.store(q + 1, std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_release);
+  k.curve = c;
+  k.seq.store(q + 2, std::memory_order_release);
+  portEXIT_CRITICAL(&curveWriteMux);
+}
+
+ChannelFilters channelFilters = makeChannelFilters(std::make_index_sequence<ANALOG_CHANNEL_COUNT>());
+volatile float channelVolts[ANALOG_CHANNEL_COUNT]; // Filtered volts behind the latest snapshot (-1 on error)
+
+volatile unsigned long lastRead = 0;             // millis() of the last reading chosen for upload
+volatile bool powerSaveMode = false;
+
+// DS18B20 asynchronous conversion state (see serviceTemperature())
+const unsigned long TEMP_INTERVAL_MS = 2000;    // Start a new conversion this often
+const unsigned long TEMP_STALE_MS = 30000;      // Cached value older than this is treated as an error
+enum TempState { TEMP_IDLE, TEMP_CONVERTING };
+TempState tempState = TEMP_IDLE;
+unsigned long tempConvStart = 0;
+unsigned long tempConvTime = 750;               // Updated from the sensor resolution in setup()
+float lastTempC = 25.0;                         // Last good reading
+unsigned long lastTempAt = 0;                   // millis() of the last good reading
+bool tempValid = false;
+
+// Continuous ADC state (see serviceAdc())
+const int ADC_CHANNEL_COUNT = ANALOG_CHANNEL_COUNT; // adcAccum[i] belongs to SENSOR_CHANNELS[ANALOG_INDEX[i]]
+struct AdcAccumulator {
+  uint8_t channel;     // ADC1 channel number of the pin
+  uint32_t sum;        // Sum of raw samples in the current block
+  uint16_t count;      // Samples in the current block
+  uint16_t raw;        // Mean of the last complete block
+  bool ready;          // A complete block has been produced since boot
+};
+AdcAccumulator adcAccum[ADC_CHANNEL_COUNT];
+adc_continuous_handle_t adcHandle = NULL;
+bool adcContinuousActive = false;
+bool adcRunning = false;           // DMA engine started (see adcPause())
+// Burst capture handshake (see BURST CAPTURE). Only the acquisition task
+// writes the frame buffer, and only while the state is CAPTURE_RUNNING. A
+// capture is ended by moving it to CAPTURE_STOPPING: the network task does
+// that when it stalls, captureAdcSample() when the buffer is full. At the
+// end of the serviceAdc() pass that sees CAPTURE_STOPPING the acquisition
+// task is past its last write, so it moves the state to CAPTURE_STOPPED and
+// notifies the network task, which only then reads or frees the buffer.
+enum CaptureState : uint8_t { CAPTURE_STOPPED, CAPTURE_RUNNING, CAPTURE_STOPPING };
+std::atomic<uint8_t> captureState(CAPTURE_STOPPED);
+esp_adc_cal_characteristics_t adcChars;
+
+// Sleep sampling state, kept in RTC memory across deep sleep (see dutyCycleWake())
+const int RTC_SAMPLE_CAPACITY = 64;
+RTC_DATA_ATTR bool dutyCycleActive = false;
+RTC_DATA_ATTR uint32_t dutyWakeCount = 0;
+volatile bool sleepRequested = false;   // Set by the UI, handled by the network task
+TaskHandle_t acqTaskHandle = NULL;      // See TASKS
+TaskHandle_t netTaskHandle = NULL;
+const uint32_t ACQ_WAKE_SAMPLE = 0x01;  // Acquisition task notification bits: take and send a reading now
+const uint32_t ACQ_WAKE_CAPTURE = 0x02; // A burst capture started, run the ADC
+
+// ===================== SETTINGS STORAGE =====================
+// Calibration and runtime config live in one NVS blob that is read once at
+// boot. Edits only mark it dirty; serviceSettings() writes it after a quiet
+// period, so a burst of menu edits or a config push costs one flash write,
+// and none at all when the values end up unchanged. Bump SETTINGS_VERSION
+// whenever StoredSettings (or CalCurve) changes layout.
+const uint16_t SETTINGS_VERSION = 2;
+const unsigned long SETTINGS_COMMIT_DELAY_MS = 5000;   // Quiet time before a write
+const unsigned long SETTINGS_COMMIT_MAX_MS = 30000;    // Longest a change waits during continuous edits
+struct StoredSettings {
+  uint16_t version;
+  uint16_t size;          // sizeof(StoredSettings) when written
+  float phSlope;
+  float phIntercept;
+  float turbSlope;
+  float turbIntercept;
+  float tdsK;
+  CalCurve phCurve;
+  CalCurve turbCurve;
+  uint32_t sampleIntervalMs;
+  uint32_t heartbeatMs;
+  uint32_t batchSize;
+  float limitMin[CHANNEL_COUNT];  // RuntimeConfig's alert limits
+  float limitMax[CHANNEL_COUNT];
+  float zThreshold;
+  uint32_t crc;           // CRC32 of everything above
+};
+// commitSettings() compares blobs with memcmp, so they must not have padding
+static_assert(sizeof(StoredSettings) == 2 * sizeof(uint16_t) + (6 + 2 * CHANNEL_COUNT) * sizeof(float) +
+                                        2 * sizeof(CalCurve) + 4 * sizeof(uint32_t), "StoredSettings has padding");
+// The version 1 blob, which had fixed pH, turbidity and TDS limits; migrated
+// on the first boot after an update (see loadSettings())
+struct StoredSettingsV1 {
+  uint16_t version;
+  uint16_t size;
+  float phSlope;
+  float phIntercept;
+  float turbSlope;
+  float turbIntercept;
+  float tdsK;
+  CalCurve phCurve;
+  CalCurve turbCurve;
+  uint32_t sampleIntervalMs;
+  uint32_t heartbeatMs;
+  uint32_t batchSize;
+  float phMin;
+  float phMax;
+  float turbMax;
+  float tdsMax;
+  float zThreshold;
+  uint32_t crc;
+};
+StoredSettings storedSettings;           // Copy last read from or written to NVS
+volatile bool settingsDirty = false;
+volatile unsigned long settingsFirstChange = 0;
+volatile unsigned long settingsLastChange = 0;
+
+uint32_t settingsCrc(const StoredSettings& s) {
+  return esp_rom_crc32_le(0, (const uint8_t*)&s, offsetof(StoredSettings, crc));
+}
+// Gather the current values into a blob. It is zeroed first and the curves'
+// reserved bytes cleared, so equal settings always give equal bytes.
+void captureSettings(StoredSettings& s) {
+  memset(&s, 0, sizeof(s));
+  s.version = SETTINGS_VERSION;
+  s.size = sizeof(StoredSettings);
+  s.phSlope = ph_slope;
+  s.phIntercept = ph_intercept;
+  s.turbSlope = turb_slope;
+  s.turbIntercept = turb_intercept;
+  s.tdsK = tds_k;
+  s.phCurve = loadCalCurve(phCurve);
+  s.turbCurve = loadCalCurve(turbCurve);
+  memset(s.phCurve.reserved, 0, sizeof(s.phCurve.reserved));
+  memset(s.turbCurve.reserved, 0, sizeof(s.turbCurve.reserved));
+  s.sampleIntervalMs = runtimeConfig.sampleIntervalMs;
+  s.heartbeatMs = runtimeConfig.heartbeatMs;
+  s.batchSize = runtimeConfig.batchSize;
+  for (int c = 0; c < CHANNEL_COUNT; c++) {
+    s.limitMin[c] = runtimeConfig.limitMin[c];
+    s.limitMax[c] = runtimeConfig.limitMax[c];
+  }
+  s.zThreshold = runtimeConfig.zThreshold;
+  s.crc = settingsCrc(s);
+}
+void applySettings(const StoredSettings& s) {
+  ph_slope = s.phSlope;
+  ph_intercept = s.phIntercept;
+  turb_slope = s.turbSlope;
+  turb_intercept = s.turbIntercept;
+  tds_k = s.tdsK;
+  storeCalCurve(phCurve, s.phCurve);
+  storeCalCurve(turbCurve, s.turbCurve);
+  runtimeConfig.sampleIntervalMs = s.sampleIntervalMs;
+  runtimeConfig.heartbeatMs = s.heartbeatMs;
+  runtimeConfig.batchSize = constrain((int)s.batchSize, 1, UPLOAD_BATCH_SIZE);
+  for (int c = 0; c < CHANNEL_COUNT; c++) {
+    runtimeConfig.limitMin[c] = s.limitMin[c];
+    runtimeConfig.limitMax[c] = s.limitMax[c];
+  }
+  runtimeConfig.zThreshold = s.zThreshold;
+}
+
+// Write the blob now if it differs from what NVS holds. A failed write leaves
+// the settings dirty, so the next serviceSettings() tick tries again.
+void commitSettings() {
+  settingsDirty = false;
+  StoredSettings s;
+  captureSettings(s);
+  if (memcmp(&s, &storedSettings, sizeof(s)) == 0) return;
+  preferences.begin("settings", false);
+  bool ok = preferences.putBytes("blob", &s, sizeof(s)) == sizeof(s);
+  preferences.end();
+  if (ok) {
+    storedSettings = s;
+  } else {
+    Serial.println("Settings write failed, will retry");
+    saveSettings();
+  }
+}
+// Note a change to the calibration or runtime config; the write follows later
+void saveSettings() {
+  unsigned long now = millis();
+  if (!settingsDirty) settingsFirstChange = now;
+  settingsLastChange = now;
+  settingsDirty = true;
+}
+// Called from the network task loop
+void serviceSettings() {
+  if (!settingsDirty) return;
+  unsigned long now = millis();
+  if (now - settingsLastChange >= SETTINGS_COMMIT_DELAY_MS || now - settingsFirstChange >= SETTINGS_COMMIT_MAX_MS) {
+    commitSettings();
+  }
+}
+
+// The remote config (and old NVS) key of entry c's limit, e.g. "ph_min";
+// false if the entry has no limits
+bool limitConfigKey(int c, const char* suffix, char* out, size_t cap) {
+  if (SENSOR_CHANNELS[c].limitKey == NULL) return false;
+  BufWriter w(out, cap);
+  w.put(SENSOR_CHANNELS[c].limitKey);
+  w.put(suffix);
+  return !w.overflow;
+}
+// Entry c's limits from an older layout that stored them by key
+void migrateLimit(const char* limitKey, float min, float max) {
+  for (int c = 0; c < CHANNEL_COUNT; c++) {
+    const char* k = SENSOR_CHANNELS[c].limitKey;
+    if (k == NULL || strcmp(k, limitKey) != 0) continue;
+    if (!isnan(min)) runtimeConfig.limitMin[c] = min;
+    if (!isnan(max)) runtimeConfig.limitMax[c] = max;
+  }
+}
+// Read a version 1 blob into the current settings
+bool loadSettingsV1(const StoredSettingsV1& o, size_t len) {
+  if (len != sizeof(o) || o.version != 1 || o.size != sizeof(o) ||
+      o.crc != esp_rom_crc32_le(0, (const uint8_t*)&o, offsetof(StoredSettingsV1, crc))) {
+    return false;
+  }
+  ph_slope = o.phSlope;
+  ph_intercept = o.phIntercept;
+  turb_slope = o.turbSlope;
+  turb_intercept = o.turbIntercept;
+  tds_k = o.tdsK;
+  storeCalCurve(phCurve, o.phCurve);
+  storeCalCurve(turbCurve, o.turbCurve);
+  runtimeConfig.sampleIntervalMs = o.sampleIntervalMs;
+  runtimeConfig.heartbeatMs = o.heartbeatMs;
+  runtimeConfig.batchSize = constrain((int)o.batchSize, 1, UPLOAD_BATCH_SIZE);
+  migrateLimit("ph", o.phMin, o.phMax);
+  migrateLimit("turb", NAN, o.turbMax);
+  migrateLimit("tds", NAN, o.tdsMax);
+  runtimeConfig.zThreshold = o.zThreshold;
+  return true;
+}
+
+// Read the per-key layout used before the settings blob existed
+bool loadLegacySettings() {
+  bool found = false;
+  preferences.begin("calib", true);
+  if (preferences.isKey("ph_slope")) {
+    found = true;
+    ph_slope = preferences.getFloat("ph_slope", ph_slope);
+    ph_intercept = preferences.getFloat("ph_intercept", ph_intercept);
+    turb_slope = preferences.getFloat("turb_slope", turb_slope);
+    turb_intercept = preferences.getFloat("turb_intercept", turb_intercept);
+    tds_k = preferences.getFloat("tds_k", tds_k);
+    struct {
+      uint8_t version;
+      CalCurve ph;
+      CalCurve turbidity;
+    } curves;
+    if (preferences.getBytes("curves", &curves, sizeof(curves)) == sizeof(curves) && curves.version == 1) {
+      storeCalCurve(phCurve, curves.ph);
+      storeCalCurve(turbCurve, curves.turbidity);
+    }
+  }
   preferences.end();
+  preferences.begin("rcfg", true);
+  if (preferences.isKey("interval")) {
+    found = true;
+    runtimeConfig.sampleIntervalMs = preferences.getUInt("interval", runtimeConfig.sampleIntervalMs);
+    runtimeConfig.heartbeatMs = preferences.getUInt("heartbeat", runtimeConfig.heartbeatMs);
+    runtimeConfig.batchSize = constrain(preferences.getUChar("batch", runtimeConfig.batchSize), 1, UPLOAD_BATCH_SIZE);
+    for (int c = 0; c < CHANNEL_COUNT; c++) {
+      char key[16];  // NVS keys are at most 15 characters
+      if (!limitConfigKey(c, "_min", key, sizeof(key))) continue;
+      runtimeConfig.limitMin[c] = preferences.getFloat(key, runtimeConfig.limitMin[c]);
+      limitConfigKey(c, "_max", key, sizeof(key));
+      runtimeConfig.limitMax[c] = preferences.getFloat(key, runtimeConfig.limitMax[c]);
+    }
+    runtimeConfig.zThreshold = preferences.getFloat("z", runtimeConfig.zThreshold);
+  }
+  preferences.end();
+  return found;
 }
-// Save calibration values to Preferences (NVS)
-void saveCalibration() {
-  preferences.begin("calib", false); // read-write
-  preferences.putFloat("ph_slope", ph_slope);
-  preferences.putFloat("ph_intercept", ph_intercept);
-  preferences.putFloat("turb_slope", turb_slope);
-  preferences.putFloat("turb_intercept", turb_intercept);
-  preferences.putFloat("tds_k", tds_k);
+// Load calibration and runtime config: one read of the blob, or a one-time
+// migration of the old keys into it. Defaults stay when neither is valid.
+void loadSettings() {
+  union {
+    StoredSettings s;
+    StoredSettingsV1 v1;
+  } blob;
+  StoredSettings& s = blob.s;
+  preferences.begin("settings", true);
+  size_t len = preferences.getBytes("blob", &blob, sizeof(blob));
   preferences.end();
+  if (len == sizeof(s) && s.version == SETTINGS_VERSION && s.size == sizeof(s) && s.crc == settingsCrc(s)) {
+    applySettings(s);
+    storedSettings = s;
+    return;
+  }
+  memset(&storedSettings, 0, sizeof(storedSettings));
+  if (len > 0 && loadSettingsV1(blob.v1, len)) {
+    commitSettings();
+    Serial.println("Settings migrated to version 2");
+    return;
+  }
+  if (len > 0) Serial.println("Stored settings invalid, using defaults");
+  if (loadLegacySettings()) {
+    commitSettings();
+    if (storedSettings.version == SETTINGS_VERSION) {
+      // Migrated; drop the old keys so they cannot shadow later changes
+      preferences.begin("calib", false);
+      preferences.clear();
+      preferences.end();
+      preferences.begin("rcfg", false);
+      preferences.clear();
+      preferences.end();
+      Serial.println("Settings migrated to a single NVS blob");
+    }
+  }
 }
 // ==============================================================
 
 void setup() {
   Serial.begin(115200);
-  Wire.begin(21, 22); // I2C for LCD
-  lcd.begin(16, 2);
-  lcd.backlight();
-  lcd.print("System Starting");
-  lcd.setCursor(0, 1);
-  lcd.print("Please wait...");
-  delay(1000);
 
   // Initialize buttons
   pinMode(BTN_UP, INPUT_PULLUP);
@@ -104,79 +451,281 @@ void setup() {
 
   // Initialize sensors
   sensors.begin();
-  analogSetPinAttenuation(PH_PIN, ADC_11db);
-  analogSetPinAttenuation(TURB_PIN, ADC_11db);
-  analogSetPinAttenuation(TDS_PIN, ADC_11db);
-  analogReadResolution(12);
+#if TEMP_ASYNC_MODE
+  sensors.setWaitForConversion(false);
+  tempConvTime = sensors.millisToWaitForConversion(sensors.getResolution());
+  serviceTemperature(); // Kick off the first conversion while WiFi connects
+#endif
+  esp_adc_cal_value_t calSource = esp_adc_cal_characterize(ADC_UNIT_1, ADC_ATTEN_DB_11, ADC_WIDTH_BIT_12, 1100, &adcChars);
+  Serial.printf("ADC calibration: %s\n", calSource == ESP_ADC_CAL_VAL_EFUSE_TP ? "eFuse Two Point"
+                                         : calSource == ESP_ADC_CAL_VAL_EFUSE_VREF ? "eFuse Vref" : "default Vref");
+#if ADC_CONTINUOUS_MODE
+  adcContinuousActive = initAdcContinuous();
+#endif
+  if (!adcContinuousActive) {
+    for (int c : ANALOG_INDEX) {
+      analogSetPinAttenuation(SENSOR_CHANNELS[c].pin, ADC_11db);
+    }
+    analogReadResolution(12);
+  }
 
-  // Load calibration values from NVS
-  loadCalibration();
+  // Load calibration and runtime config from NVS
+  loadSettings();
+  initTime();
+  initPowerManagement();
+  initPowerMonitor();
+  initOfflineLog();
 
-  // ===================== WIFI CONNECTION =====================
-  // Choose ONE of the following WiFi connection methods:
-  // 1. WPA2 Enterprise (Eduroam, school WiFi)
-  // 2. Standard WiFi (home, office, hotspot)
+  // A timer wakeup in sleep sampling mode takes one reading and goes straight
+  // back to sleep. Any other boot (power on, SELECT press) is interactive.
+  if (esp_sleep_get_wakeup_cause() == ESP_SLEEP_WAKEUP_TIMER && dutyCycleActive) {
+    dutyCycleWake(); // Does not return
+  }
+  dutyCycleActive = false;
+  spillRtcSamplesToLog(); // Readings left over from sleep sampling
 
-  bool useEnterprise = true; // Set to false to use standard WiFi
+  Wire.begin(21, 22); // I2C for LCD
+  lcd.begin(16, 2);
+  lcd.backlight();
+  lcdResetShadow();
+  if (esp_sleep_get_wakeup_cause() == ESP_SLEEP_WAKEUP_UNDEFINED) {
+    // Splash only on a cold boot; a SELECT wake goes straight to the menu
+    lcdShow("System Starting", "Please wait...");
+    delay(1000);
+  }
 
-  Serial.println("Connecting to WiFi...");
-  WiFi.mode(WIFI_STA);
+  // WiFi and Firebase come up in the background (see serviceWifi()), so
+  // sampling and offline buffering start immediately after boot.
+  beginWifi();
 
-  if (useEnterprise) {
-    // --- WPA2 Enterprise Connection ---
-    // Uncomment and fill in your credentials above
-    esp_wifi_sta_wpa2_ent_set_identity((uint8_t*)WIFI_IDENTITY, strlen(WIFI_IDENTITY));
-    esp_wifi_sta_wpa2_ent_set_username((uint8_t*)WIFI_IDENTITY, strlen(WIFI_IDENTITY));
-    esp_wifi_sta_wpa2_ent_set_password((uint8_t*)WIFI_EAP_PASSWORD, strlen(WIFI_EAP_PASSWORD));
-    WiFi.begin(WIFI_SSID);
-    esp_wifi_sta_wpa2_ent_enable();
-  } else {
-    // --- Standard WiFi Connection ---
-    // Uncomment and fill in your credentials above
-    WiFi.begin(WIFI_SSID, WIFI_PASSWORD);
-  }
-
-  // Display WiFi connection status
-  lcd.clear();
-  lcd.setCursor(0, 0);
-  lcd.print("Connecting WiFi");
-  while (WiFi.status() != WL_CONNECTED) {
-    Serial.print(".");
-    lcd.setCursor(0, 1);
-    lcd.print("Status: ");
-    lcd.print(WiFi.status());
-    delay(500);
-  }
-  Serial.println("\nWiFi Connected!");
-  Serial.print("IP Address: ");
-  Serial.println(WiFi.localIP());
-  lcd.clear();
-  lcd.setCursor(0, 0);
-  lcd.print("WiFi Connected!");
-  lcd.setCursor(0, 1);
-  lcd.print(WiFi.localIP());
-  delay(2000);
-  // ==========================================================
-
-  // ===================== FIREBASE SETUP =====================
-  config.api_key = FIREBASE_API_KEY;
-  config.database_url = "https://" + String(FIREBASE_PROJECT_ID) + ".firebaseio.com";
-  Firebase.begin(&config, &auth);
-  Firebase.reconnectWiFi(true);
-  Serial.println("Signing in anonymously to Firebase...");
-  if (Firebase.Auth.signInAnonymously(&auth, &config)) {
-    Serial.println("Signed in successfully.");
-  } else {
-    Serial.printf("Firebase Auth Error: %s\n", auth.error.message.c_str());
+  displayMenu(); // Show initial menu
+  startTasks();  // Hand over to the acquisition, UI and network tasks
+}
+
+// ===================== PERFORMANCE COUNTERS =====================
+// PERF_SCOPE(stage) at the top of a block times it until the block exits,
+// in CPU cycles (esp_cpu_get_cycle_count()) and wall time (esp_timer). Wall
+// times go into a fixed decade-bucket histogram per stage, so recording is a
+// few adds with no allocation or locking. Each stage is only recorded from
+// one task; readers (Stats menu, diag node) may see a sample half-applied,
+// which is fine for statistics. With PERF_STATS 0 the macros compile away.
+enum PerfStage { PERF_TEMP, PERF_ADC, PERF_SNAPSHOT, PERF_LCD, PERF_TLS, PERF_REQUEST, PERF_ENCODE, PERF_STAGE_COUNT };
+const char* perfStageNames[PERF_STAGE_COUNT] = { "temp", "adc", "snap", "lcd", "tls", "req", "encode" };
+const int PERF_BUCKETS = 8;
+const uint32_t perfBucketLimitUs[PERF_BUCKETS - 1] = { 10, 100, 1000, 10000, 100000, 1000000, 10000000 };
+
+struct PerfHistogram {
+  uint32_t count;
+  uint32_t maxUs;
+  uint64_t totalUs;
+  uint64_t totalCycles;    // CPU clock cycles; includes time other tasks ran on the core
+  uint32_t buckets[PERF_BUCKETS]; // buckets[i] counts samples below perfBucketLimitUs[i], the last one the rest
+};
+struct PerfCounters {
+  volatile uint32_t reads;           // Snapshots taken
+  volatile uint32_t sensorErrors;    // Snapshots with a channel in error
+  volatile uint32_t uploads;         // Successful reading uploads
+  volatile uint32_t uploadFailures;
+  volatile uint32_t retries;         // Requests repeated on a fresh connection, WiFi reconnect attempts
+};
+PerfHistogram perfStages[PERF_STAGE_COUNT] = {};
+PerfCounters perfCounters = {};
+
+#if PERF_STATS
+void perfRecord(PerfStage stage, uint32_t cycles, uint32_t us) {
+  PerfHistogram& h = perfStages[stage];
+  int b = 0;
+  while (b < PERF_BUCKETS - 1 && us >= perfBucketLimitUs[b]) b++;
+  h.buckets[b]++;
+  h.count++;
+  h.totalUs += us;
+  h.totalCycles += cycles;
+  if (us > h.maxUs) h.maxUs = us;
+}
+struct PerfScope {
+  PerfStage stage;
+  uint32_t startCycles;
+  int64_t startUs;
+  explicit PerfScope(PerfStage s) : stage(s), startCycles(esp_cpu_get_cycle_count()), startUs(esp_timer_get_time()) {}
+  ~PerfScope() { perfRecord(stage, esp_cpu_get_cycle_count() - startCycles, esp_timer_get_time() - startUs); }
+};
+#define PERF_SCOPE(stage) PerfScope perfScope_(stage)
+#define PERF_COUNT(counter) (perfCounters.counter++)
+#else
+#define PERF_SCOPE(stage)
+#define PERF_COUNT(counter)
+#endif
+
+// Upper bound of the bucket holding the given fraction of a stage's samples
+uint32_t perfPercentileUs(const PerfHistogram& h, float fraction) {
+  uint32_t want = (uint32_t)(h.count * fraction);
+  uint32_t seen = 0;
+  for (int b = 0; b < PERF_BUCKETS - 1; b++) {
+    seen += h.buckets[b];
+    if (seen > want) return perfBucketLimitUs[b];
   }
-  Firebase.setReadTimeout(fbdo, 1000 * 60);
-  Firebase.setwriteSizeLimit(fbdo, "tiny");
-  // ==========================================================
+  return h.maxUs;
+}
+// ADC and filter rejects, summed over the channel filters
+uint32_t perfRejects() {
+  return std::apply([](const auto&... f) { return (f.rejected + ...); }, channelFilters);
+}
+// ============================================================
 
-  displayMenu(); // Show initial menu
+// ===================== POWER MONITOR =====================
+// Time spent in each power mode is always tracked. Current is only reported
+// where it is measured: with POWER_MONITOR_INA219 the acquisition task reads
+// an INA219 in the supply line every POWER_SAMPLE_MS and averages it per mode.
+// The chip cannot measure itself in deep sleep, so the overall sleep sampling
+// average is only given if DEEP_SLEEP_CURRENT_UA has been filled in from a
+// meter reading. The totals live in RTC memory, so sleep sampling wakes add up.
+enum PowerMode { POWER_MODE_NORMAL, POWER_MODE_SAVE, POWER_MODE_SLEEP_WAKE, POWER_MODE_COUNT };
+const char* powerModeNames[POWER_MODE_COUNT] = { "normal", "power save", "sleep wake" };
+const uint8_t INA219_ADDR = 0x40;
+const unsigned long POWER_SAMPLE_MS = 100;        // INA219 averages 128 conversions (~68 ms) per reading
+const unsigned long POWER_REPORT_MS = 60000;
+
+struct PowerModeStats {
+  uint64_t residencyMs;  // Time spent in the mode
+  double currentSumMa;   // Sum of current samples taken in the mode
+  uint32_t samples;
+};
+RTC_DATA_ATTR PowerModeStats powerStats[POWER_MODE_COUNT];
+RTC_DATA_ATTR uint64_t deepSleepMs = 0;          // Time spent in deep sleep
+RTC_DATA_ATTR uint64_t sleepStartedMs = 0;       // clockMs() when deep sleep began
+unsigned long lastPowerAccount = 0;
+unsigned long lastPowerSample = 0;
+unsigned long lastPowerReport = 0;
+bool powerMonitorPresent = false;
+
+PowerMode currentPowerMode() {
+  return (powerSaveMode && !lcdBacklightOn) ? POWER_MODE_SAVE : POWER_MODE_NORMAL;
+}
+// Probe the INA219 and count the sleep sampling deep sleep that just ended
+void initPowerMonitor() {
+  if (dutyCycleActive && sleepStartedMs != 0 && esp_sleep_get_wakeup_cause() != ESP_SLEEP_WAKEUP_UNDEFINED) {
+    deepSleepMs += clockMs() - sleepStartedMs;
+  }
+  sleepStartedMs = 0;
+#if POWER_MONITOR_INA219
+  Wire.begin(21, 22);
+  Wire.beginTransmission(INA219_ADDR);
+  Wire.write(0x00);  // Configuration: 32 V, +-320 mV, 128-sample averaging, continuous
+  Wire.write(0x3F);
+  Wire.write(0xFF);
+  powerMonitorPresent = Wire.endTransmission() == 0;
+  if (!powerMonitorPresent) Serial.println("WARNING: INA219 not found, current will not be reported.");
+#endif
+}
+// Supply current in mA from the INA219 shunt voltage (10 uV per LSB)
+bool readSupplyCurrent(float& mA) {
+  Wire.beginTransmission(INA219_ADDR);
+  Wire.write(0x01);
+  if (Wire.endTransmission(false) != 0 || Wire.requestFrom(INA219_ADDR, (uint8_t)2) != 2) return false;
+  int16_t raw = (int16_t)((Wire.read() << 8) | Wire.read());
+  mA = raw * 10.0f / INA219_SHUNT_MOHM;
+  return true;
+}
+// Charge the time since the last call to mode, and sample the current if due
+void powerAccount(PowerMode mode) {
+  unsigned long now = millis();
+  powerStats[mode].residencyMs += now - lastPowerAccount;
+  lastPowerAccount = now;
+  float mA;
+  if (powerMonitorPresent && now - lastPowerSample >= POWER_SAMPLE_MS) {
+    lastPowerSample = now;
+    if (readSupplyCurrent(mA)) {
+      powerStats[mode].currentSumMa += mA;
+      powerStats[mode].samples++;
+    }
+  }
+}
+void printPowerReport() {
+  for (int m = 0; m < POWER_MODE_COUNT; m++) {
+    const PowerModeStats& p = powerStats[m];
+    if (p.residencyMs == 0) continue;
+    if (p.samples > 0) {
+      Serial.printf("Power %s: %llu s, %.1f mA average (%u samples)\n", powerModeNames[m], p.residencyMs / 1000,
+                    p.currentSumMa / p.samples, (unsigned)p.samples);
+    } else {
+      Serial.printf("Power %s: %llu s, current not measured\n", powerModeNames[m], p.residencyMs / 1000);
+    }
+  }
+  if (deepSleepMs > 0) {
+    const PowerModeStats& wake = powerStats[POWER_MODE_SLEEP_WAKE];
+    Serial.printf("Power deep sleep: %llu s, awake %.1f%% of sleep sampling\n", deepSleepMs / 1000,
+                  100.0 * wake.residencyMs / (wake.residencyMs + deepSleepMs));
+    if (DEEP_SLEEP_CURRENT_UA > 0 && wake.samples > 0) {
+      double charge = wake.currentSumMa / wake.samples * wake.residencyMs + DEEP_SLEEP_CURRENT_UA / 1000.0 * deepSleepMs;
+      Serial.printf("Power sleep sampling: %.3f mA overall average\n", charge / (wake.residencyMs + deepSleepMs));
+    }
+  }
+}
+// Acquisition task tick: account the current mode and report once a minute
+void servicePowerMonitor() {
+  powerAccount(currentPowerMode());
+  if (millis() - lastPowerReport >= POWER_REPORT_MS) {
+    lastPowerReport = millis();
+    printPowerReport();
+  }
+}
+// How long servicePowerMonitor() can go uncalled without missing a sample or report
+unsigned long powerMonitorWaitMs() {
+  unsigned long now = millis();
+  unsigned long wait = POWER_REPORT_MS - min(now - lastPowerReport, POWER_REPORT_MS);
+  if (powerMonitorPresent) wait = min(wait, POWER_SAMPLE_MS - min(now - lastPowerSample, POWER_SAMPLE_MS));
+  return wait;
 }
+// ============================================================
 
 // ===================== POWER MANAGEMENT =====================
+// With PM_LIGHT_SLEEP the CPU clock drops to PM_MIN_FREQ_MHZ and the chip
+// light-sleeps whenever every task is blocked. The tasks only wake for
+// timers and button interrupts, and WiFi uses DTIM-aligned modem sleep.
+// The network and UI tasks hold a CpuBoost for each pass, so TLS, encoding
+// and LCD updates run at PM_MAX_FREQ_MHZ; only the acquisition task's short
+// steps run at the low clock.
+// This needs CONFIG_PM_ENABLE and tickless idle in the core's sdkconfig;
+// without them the chip just stays awake as before.
+bool pmLightSleep = false;   // Automatic light sleep is active
+esp_pm_lock_handle_t pmCpuLock = NULL;  // ESP_PM_CPU_FREQ_MAX, see CpuBoost
+
+// Keep the CPU at PM_MAX_FREQ_MHZ for the enclosing scope. The lock counts
+// its holders, so tasks and nested scopes can take it independently.
+struct CpuBoost {
+  CpuBoost() {
+    if (pmCpuLock != NULL) esp_pm_lock_acquire(pmCpuLock);
+  }
+  ~CpuBoost() {
+    if (pmCpuLock != NULL) esp_pm_lock_release(pmCpuLock);
+  }
+};
+
+void initPowerManagement() {
+#if PM_LIGHT_SLEEP && CONFIG_PM_ENABLE
+  esp_pm_config_t pm = {};
+  pm.max_freq_mhz = PM_MAX_FREQ_MHZ;
+  pm.min_freq_mhz = PM_MIN_FREQ_MHZ;
+#if CONFIG_FREERTOS_USE_TICKLESS_IDLE
+  pm.light_sleep_enable = true;
+#endif
+  esp_err_t err = esp_pm_configure(&pm);
+  if (err != ESP_OK) {
+    Serial.printf("WARNING: Power management unavailable (%s).\n", esp_err_to_name(err));
+    return;
+  }
+  if (esp_pm_lock_create(ESP_PM_CPU_FREQ_MAX, 0, "busy", &pmCpuLock) != ESP_OK) {
+    pmCpuLock = NULL;
+    Serial.println("WARNING: No CPU frequency lock, uploads will run at the low clock.");
+  }
+#if CONFIG_FREERTOS_USE_TICKLESS_IDLE
+  esp_sleep_enable_gpio_wakeup(); // Buttons wake the chip (see armButton())
+  pmLightSleep = true;
+#endif
+  Serial.printf("Power management: %d-%d MHz, light sleep %s\n", PM_MIN_FREQ_MHZ, PM_MAX_FREQ_MHZ,
+                pmLightSleep ? "on" : "off (no tickless idle)");
+#endif
+}
 void managePower() {
   if (powerSaveMode) {
     // Turn off LCD backlight after 30 seconds of inactivity
@@ -190,13 +739,30 @@ void managePower() {
     }
   }
 }
+// Called from the UI task. Unless DUTY_CYCLE_WAKE_S is 0 the device keeps
+// sampling on a timer while asleep. The network task saves any batched
+// readings and then powers down (see deepSleepNow()).
 void enterDeepSleep() {
-  lcd.clear();
-  lcd.print("Sleeping...");
-  lcd.setCursor(0, 1);
-  lcd.print("Press SELECT to wake");
-  delay(1000);
+  dutyCycleActive = DUTY_CYCLE_WAKE_S > 0;
+  liveItem = -1;
+  lcdShow("Sleeping...", "SELECT to wake");
+  sleepRequested = true;
+  for (;;) {
+    vTaskDelay(portMAX_DELAY);
+  }
+}
+void deepSleepNow() {
+  if (settingsDirty) commitSettings();  // RAM does not survive deep sleep
+  powerAccount(dutyCycleActive && esp_sleep_get_wakeup_cause() == ESP_SLEEP_WAKEUP_TIMER ? POWER_MODE_SLEEP_WAKE
+                                                                                            : currentPowerMode());
+  sleepStartedMs = clockMs();
   esp_sleep_enable_ext0_wakeup((gpio_num_t)BTN_SELECT, 0);
+  if (dutyCycleActive) {
+    // Subtract the time spent awake so wakeups stay on a fixed period
+    uint64_t periodUs = (uint64_t)DUTY_CYCLE_WAKE_S * 1000000ULL;
+    uint64_t awakeUs = (uint64_t)millis() * 1000ULL;
+    esp_sleep_enable_timer_wakeup(awakeUs + 1000000ULL < periodUs ? periodUs - awakeUs : 1000000ULL);
+  }
   esp_deep_sleep_start();
 }
 void wakeLCD() {
@@ -208,202 +774,2926 @@ void wakeLCD() {
 }
 // ============================================================
 
+// ===================== ADC ACQUISITION =====================
+// Start the ADC1 DMA engine scanning every sensor pin. Returns false (and the
+// caller falls back to analogRead()) if the driver cannot be brought up.
+bool initAdcContinuous() {
+  adc_continuous_handle_cfg_t handleCfg = {};
+  handleCfg.max_store_buf_size = 4096;
+  handleCfg.conv_frame_size = 256;
+  if (adc_continuous_new_handle(&handleCfg, &adcHandle) != ESP_OK) {
+    Serial.println("WARNING: Continuous ADC unavailable, using analogRead().");
+    return false;
+  }
+  adc_digi_pattern_config_t pattern[ADC_CHANNEL_COUNT] = {};
+  for (int i = 0; i < ADC_CHANNEL_COUNT; i++) {
+    adcAccum[i] = {};
+    adcAccum[i].channel = digitalPinToAnalogChannel(SENSOR_CHANNELS[ANALOG_INDEX[i]].pin);
+    pattern[i].atten = ADC_ATTEN_DB_11;
+    pattern[i].channel = adcAccum[i].channel;
+    pattern[i].unit = ADC_UNIT_1;
+    pattern[i].bit_width = ADC_BITWIDTH_12;
+  }
+  adc_continuous_config_t digCfg = {};
+  digCfg.pattern_num = ADC_CHANNEL_COUNT;
+  digCfg.adc_pattern = pattern;
+  digCfg.sample_freq_hz = ADC_SAMPLE_RATE_HZ;
+  digCfg.conv_mode = ADC_CONV_SINGLE_UNIT_1;
+  digCfg.format = ADC_DIGI_OUTPUT_FORMAT_TYPE1;
+  if (adc_continuous_config(adcHandle, &digCfg) != ESP_OK || adc_continuous_start(adcHandle) != ESP_OK) {
+    Serial.println("WARNING: Continuous ADC config failed, using analogRead().");
+    adc_continuous_deinit(adcHandle);
+    adcHandle = NULL;
+    return false;
+  }
+  adcRunning = true;
+  return true;
+}
+// Drain whatever the DMA engine has produced since the last call and fold it
+// into the per-channel block averages. Never blocks.
+void serviceAdc() {
+  if (!adcContinuousActive) return;
+  PERF_SCOPE(PERF_ADC);
+  uint8_t frame[256];
+  uint32_t len = 0;
+  while (adc_continuous_read(adcHandle, frame, sizeof(frame), &len, 0) == ESP_OK) {
+    for (uint32_t i = 0; i + SOC_ADC_DIGI_RESULT_BYTES <= len; i += SOC_ADC_DIGI_RESULT_BYTES) {
+      adc_digi_output_data_t* out = (adc_digi_output_data_t*)&frame[i];
+      for (int c = 0; c < ADC_CHANNEL_COUNT; c++) {
+        AdcAccumulator& a = adcAccum[c];
+        if (out->type1.channel != a.channel) continue;
+        if (captureState.load(std::memory_order_acquire) == CAPTURE_RUNNING) captureAdcSample(c, out->type1.data);
+        a.sum += out->type1.data;
+        if (++a.count >= ADC_OVERSAMPLE) {
+          a.raw = a.sum / a.count;
+          a.ready = true;
+          a.sum = 0;
+          a.count = 0;
+        }
+        break;
+      }
+    }
+  }
+  uint8_t stopping = CAPTURE_STOPPING;
+  if (captureState.compare_exchange_strong(stopping, CAPTURE_STOPPED, std::memory_order_acq_rel)) {
+    xTaskNotifyGive(netTaskHandle); // The capture buffer is the network task's now
+  }
+}
+// Get a raw 12-bit ADC value for analog channel c: the latest oversampled
+// block in continuous mode, otherwise a single analogRead(). Returns -1 if
+// continuous mode has not produced a block for the channel yet.
+int readRawAdc(int c) {
+  if (adcContinuousActive) return adcAccum[c].ready ? adcAccum[c].raw : -1;
+  return analogRead(SENSOR_CHANNELS[ANALOG_INDEX[c]].pin);
+}
+// True once every channel can produce a reading
+bool adcChannelsReady() {
+  if (!adcContinuousActive) return true;
+  for (int c = 0; c < ADC_CHANNEL_COUNT; c++) {
+    if (!adcAccum[c].ready) return false;
+  }
+  return true;
+}
+// Stop and restart the DMA engine. While it runs the driver holds a power
+// management lock that keeps the chip out of light sleep, so with light sleep
+// enabled the acquisition task only runs it in a short burst before each
+// snapshot. Pausing drops the blocks already collected, so every snapshot
+// sees fresh samples.
+void adcPause() {
+  if (!adcContinuousActive || !adcRunning) return;
+  adc_continuous_stop(adcHandle);
+  adcRunning = false;
+  for (int c = 0; c < ADC_CHANNEL_COUNT; c++) {
+    adcAccum[c].sum = 0;
+    adcAccum[c].count = 0;
+    adcAccum[c].ready = false;
+  }
+}
+void adcResume() {
+  if (!adcContinuousActive || adcRunning) return;
+  adcRunning = adc_continuous_start(adcHandle) == ESP_OK;
+}
+// Convert a raw ADC value to volts using the eFuse calibration
+float adcRawToVolts(int raw) {
+  return esp_adc_cal_raw_to_voltage(raw, &adcChars) / 1000.0;
+}
+// ============================================================
+
+// ===================== TIME AND IDENTITY =====================
+// Readings are stamped with the system clock when they are taken. The clock
+// keeps counting through deep sleep and soft resets, and SNTP sets it to Unix
+// time once WiFi is up. Until then (after a power loss) it only counts from
+// power-on, so readings taken before the first sync are flagged and carry the
+// power session they belong to; the jump applied by the first sync is kept in
+// RTC memory and added to them before upload (see recordEpochMs()).
+const uint64_t EPOCH_VALID_MS = 1609459200000ULL;  // 2021-01-01; anything earlier is time since power-on
+const uint32_t TIME_STATE_MAGIC = 0x54494D31;      // "TIM1"
+const unsigned long TIME_SYNC_WAIT_MS = 60000;     // Upload undated readings if SNTP has not answered by then
+
+struct TimeState {
+  uint32_t magic;
+  uint16_t session;          // Counts power-ons, persisted in NVS
+  volatile bool synced;      // SNTP has set the clock during this session
+  volatile int64_t syncJumpMs;  // How far the first sync moved the clock
+};
+RTC_NOINIT_ATTR TimeState timeState;  // Survives deep sleep and soft resets
+int64_t clockBaseMs = 0;              // clockMs() minus esp_timer time, measured at boot
+bool sntpStarted = false;
+unsigned long sntpStartedAt = 0;
+uint64_t lastSampleMs = 0;
+char deviceId[13];                    // Factory MAC in hex, e.g. "a4cf12345678"
+char deviceReadingsPath[40];          // "/devices/<id>/readings"
+char deviceConfigPath[40];            // "/devices/<id>/config"
+char deviceAlertsPath[40];            // "/devices/<id>/alerts"
+char devicePackedPath[40];            // "/devices/<id>/packed" (UPLOAD_COMPACT)
+char deviceDiagPath[40];              // "/devices/<id>/diag"
+char deviceCommandPath[40];           // "/devices/<id>/command"
+char deviceCommandAckPath[40];        // "/devices/<id>/command_ack"
+char deviceBurstsPath[40];            // "/devices/<id>/bursts"
+char deviceRollupsPath[40];           // "/rollups/<id>"
+
+// Milliseconds on the system clock. Unlike millis() this keeps counting
+// through deep sleep, so readings taken on successive wakes stay in order.
+uint64_t clockMs() {
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return (uint64_t)tv.tv_sec * 1000 + tv.tv_usec / 1000;
+}
+bool timeSynced() {
+  return clockMs() >= EPOCH_VALID_MS;
+}
+// Runs in the lwIP task whenever SNTP sets the clock
+void onTimeSync(struct timeval* tv) {
+  if (!timeState.synced) {
+    timeState.syncJumpMs = (int64_t)clockMs() - esp_timer_get_time() / 1000 - clockBaseMs;
+    timeState.synced = true;
+  }
+  Serial.println("Clock synchronized via SNTP.");
+}
+// Read the device ID and pick up (or start) the power session
+void initTime() {
+  uint8_t mac[6];
+  esp_efuse_mac_get_default(mac);
+  const char* hex = "0123456789abcdef";
+  for (int i = 0; i < 6; i++) {
+    deviceId[i * 2] = hex[mac[i] >> 4];
+    deviceId[i * 2 + 1] = hex[mac[i] & 0x0F];
+  }
+  deviceId[12] = 0;
+  Serial.printf("Device ID %s\n", deviceId); // The dashboard's NEXT_PUBLIC_DEVICE_ID
+  snprintf(deviceReadingsPath, sizeof(deviceReadingsPath), "/devices/%s/readings", deviceId);
+  snprintf(deviceConfigPath, sizeof(deviceConfigPath), "/devices/%s/config", deviceId);
+  snprintf(deviceAlertsPath, sizeof(deviceAlertsPath), "/devices/%s/alerts", deviceId);
+  snprintf(devicePackedPath, sizeof(devicePackedPath), "/devices/%s/packed", deviceId);
+  snprintf(deviceDiagPath, sizeof(deviceDiagPath), "/devices/%s/diag", deviceId);
+  snprintf(deviceCommandPath, sizeof(deviceCommandPath), "/devices/%s/command", deviceId);
+  snprintf(deviceCommandAckPath, sizeof(deviceCommandAckPath), "/devices/%s/command_ack", deviceId);
+  snprintf(deviceBurstsPath, sizeof(deviceBurstsPath), "/devices/%s/bursts", deviceId);
+  snprintf(deviceRollupsPath, sizeof(deviceRollupsPath), "/rollups/%s", deviceId);
+
+  esp_reset_reason_t reason = esp_reset_reason();
+  if (timeState.magic != TIME_STATE_MAGIC || reason == ESP_RST_POWERON || reason == ESP_RST_BROWNOUT) {
+    // The clock restarted from zero along with RTC memory
+    preferences.begin("time", false);
+    uint16_t session = preferences.getUShort("session", 0) + 1;
+    preferences.putUShort("session", session);
+    preferences.end();
+    timeState.magic = TIME_STATE_MAGIC;
+    timeState.session = session;
+    timeState.synced = timeSynced();
+    timeState.syncJumpMs = 0;
+  }
+  clockBaseMs = (int64_t)clockMs() - esp_timer_get_time() / 1000;
+  sntp_set_time_sync_notification_cb(onTimeSync);
+}
+// Start SNTP the first time the link comes up. It resyncs periodically after that.
+void startTimeSync() {
+  if (sntpStarted) return;
+  configTime(0, 0, NTP_SERVER);
+  sntpStarted = true;
+  sntpStartedAt = millis();
+}
+// True once readings can be uploaded: the clock is set, or SNTP has had
+// TIME_SYNC_WAIT_MS to answer and readings are sent with undated keys instead
+bool timeReadyForUpload() {
+  return timeSynced() || (sntpStarted && millis() - sntpStartedAt >= TIME_SYNC_WAIT_MS);
+}
+// Timestamp for a new reading; strictly increasing so keys never collide
+uint64_t sampleTimestampMs() {
+  uint64_t now = clockMs();
+  if (now <= lastSampleMs) now = lastSampleMs + 1;
+  lastSampleMs = now;
+  return now;
+}
+// ============================================================
+
 // ===================== SENSOR FUNCTIONS =====================
-// Read and average voltage from an analog pin
-float readVoltage(int pin, float* buf, int* ptr) {
-  int adc = analogRead(pin);
-  if (adc == 0 || adc == 4095) {
-    Serial.printf("Warning: Raw ADC read %d for pin %d, potential sensor issue.\n", adc, pin);
-    return -1.0;
-  }
-  float v = adc * (3.3 / 4095.0);
-  buf[*ptr] = v;
-  *ptr = (*ptr + 1) % 3;
-  float sum = 0;
-  for (int i = 0; i < 3; i++) {
-    sum += buf[i];
-  }
-  return sum / 3;
+// Read a voltage from analog channel c through its filter. Rail hits (0 or
+// 4095) are counted and dropped instead of failing the reading; -1 is
+// returned only while the channel has never produced a good sample.
+template <int N>
+float readVoltage(int c, ChannelFilter<N>& filter) {
+  int adc = readRawAdc(c);
+  if (filterAdcSample(adc, adc > 0 ? adcRawToVolts(adc) : 0.0f, filter)) {
+    Serial.printf("Warning: Raw ADC read %d for pin %d rejected (%lu so far), potential sensor issue.\n",
+                  adc, SENSOR_CHANNELS[ANALOG_INDEX[c]].pin, filter.rejected);
+  }
+  return filter.hasValue() ? filter.value() : -1.0;
+}
+// Return true if a DS18B20 reading is a real temperature
+bool tempReadingValid(float t) {
+  return !(t == -127.00 || t == 85.00);
+}
+// Advance the asynchronous DS18B20 conversion. Called every loop tick: one
+// tick starts a conversion, a later tick collects the result once the
+// conversion time for the configured resolution has passed.
+void serviceTemperature() {
+#if TEMP_ASYNC_MODE
+  unsigned long now = millis();
+  if (tempState == TEMP_IDLE) {
+    if (!tempValid || now - tempConvStart >= TEMP_INTERVAL_MS) {
+      sensors.requestTemperatures(); // Returns immediately with setWaitForConversion(false)
+      tempConvStart = now;
+      tempState = TEMP_CONVERTING;
+    }
+  } else if (now - tempConvStart >= tempConvTime) {
+    PERF_SCOPE(PERF_TEMP); // Bit-banged scratchpad read
+    tempState = TEMP_IDLE;
+    float t = sensors.getTempCByIndex(0);
+    if (tempReadingValid(t)) {
+      lastTempC = t;
+      lastTempAt = now;
+      tempValid = true;
+    } else {
+      Serial.println("WARNING: DS18B20 conversion returned an error value.");
+    }
+  }
+#endif
+}
+// How long serviceTemperature() can go uncalled without delaying a step
+unsigned long temperatureWaitMs() {
+#if TEMP_ASYNC_MODE
+  unsigned long step = tempState == TEMP_IDLE ? (tempValid ? TEMP_INTERVAL_MS : 0) : tempConvTime;
+  return step - min(millis() - tempConvStart, step);
+#else
+  return ULONG_MAX;
+#endif
 }
 // Get temperature from DS18B20
 float getTemp() {
+#if TEMP_ASYNC_MODE
+  if (!tempValid || millis() - lastTempAt > TEMP_STALE_MS) {
+    Serial.println("WARNING: No recent DS18B20 reading, returning default temp 25C.");
+    return 25.0;
+  }
+  return lastTempC;
+#else
   sensors.requestTemperatures();
   float t = sensors.getTempCByIndex(0);
-  if (t == -127.00 || t == 85.00) {
+  if (!tempReadingValid(t)) {
     Serial.println("WARNING: DS18B20 sensor error, returning default temp 25C.");
     return 25.0;
   }
   return t;
+#endif
+}
+// Read analog channel I into its snapshot value (-1 on a sensor error).
+// The table entry is a constant, so its pin, filter and conversion resolve
+// at compile time.
+template <size_t I>
+void sampleChannel(SensorSnapshot& s) {
+  float v = readVoltage(I, std::get<I>(channelFilters));
+  channelVolts[I] = v;
+  s.value[ANALOG_INDEX[I]] = analogValue<I>(v, s.value[TEMP_CHANNEL]);
+}
+template <size_t... I>
+void sampleChannels(SensorSnapshot& s, std::index_sequence<I...>) {
+  (sampleChannel<I>(s), ...);
+}
+// Take one reading of every sensor. The DS18B20 conversion is the slow part
+// (up to ~750 ms at 12-bit), so it runs at most once and the result feeds the
+// temperature compensation. In async mode the cached temperature is used.
+SensorSnapshot takeSnapshot() {
+  PERF_SCOPE(PERF_SNAPSHOT);
+  SensorSnapshot s;
+  s.value[TEMP_CHANNEL] = getTemp();
+  sampleChannels(s, std::make_index_sequence<ANALOG_CHANNEL_COUNT>());
+  deriveChannels(s);
+  s.timestampMs = sampleTimestampMs();
+  s.alerts = 0;
+  PERF_COUNT(reads);
+  if (snapshotHasError(s)) PERF_COUNT(sensorErrors);
+  return s;
 }
-// Get pH value (with temperature compensation)
-float getPH() {
-  float v = readVoltage(PH_PIN, phBuf, &phPtr);
-  if (v < 0) return -1.0;
-  float ph = ph_slope * v + ph_intercept;
-  float currentTempC = getTemp();
-  ph += (0.0198 * (currentTempC - 25.0));
-  return constrain(ph, 0.0, 14.0);
-}
-// Get Turbidity value
-float getTurbidity() {
-  float v = readVoltage(TURB_PIN, turbBuf, &turbPtr);
-  if (v < 0) return -1.0;
-  float ntu = turb_slope * v + turb_intercept;
-  return constrain(ntu, 0.0, 150.0);
-}
-// Get TDS value (measured from TDS_PIN)
-float getTDS() {
-  float v = readVoltage(TDS_PIN, tdsBuf, &tdsPtr);
-  if (v < 0) return -1.0;
-  float t = getTemp();
-  float tds = v * tds_k * (1.0 + 0.02 * (t - 25.0));
-  return tds;
-}
-// Get EC value (calculated from TDS)
-float getEC() {
-  float tds = getTDS();
-  if (tds < 0) return -1.0;
-  return tds * 2.0;
+// True if any channel in the snapshot reported a sensor error
+bool snapshotHasError(const SensorSnapshot& s) {
+  for (float v : s.value) {
+    if (v < 0) return true;
+  }
+  return false;
 }
 // ============================================================
 
 // ===================== DISPLAY FUNCTIONS =====================
-// Show a value on the LCD
-void displayValue(const char* name, float val, const char* unit) {
+// Everything is drawn through a shadow copy of the 16x2 screen. lcdShow()
+// compares the new frame with what is already on the glass and only sends the
+// cells that changed, so there is no lcd.clear() (and no flicker) and the I2C
+// traffic of a live refresh is a few characters.
+const int LCD_COLS = 16;
+const int LCD_ROWS = 2;
+const unsigned long LIVE_REFRESH_MS = 500;        // Update rate of the live value view
+char lcdGlass[LCD_ROWS][LCD_COLS];                // What the display is showing
+unsigned long lastLiveRefresh = 0;
+
+// Forget the shadow after the controller has been cleared (lcd.begin())
+void lcdResetShadow() {
+  memset(lcdGlass, ' ', sizeof(lcdGlass));
+}
+// Draw two lines (truncated or space-padded to the screen width)
+void lcdShow(const char* top, const char* bottom) {
+  PERF_SCOPE(PERF_LCD);
+  const char* lines[LCD_ROWS] = { top, bottom };
+  for (int row = 0; row < LCD_ROWS; row++) {
+    char frame[LCD_COLS];
+    const char* text = lines[row];
+    for (int col = 0; col < LCD_COLS; col++) {
+      frame[col] = *text ? *text++ : ' ';
+    }
+    int col = 0;
+    while (col < LCD_COLS) {
+      if (frame[col] == lcdGlass[row][col]) {
+        col++;
+        continue;
+      }
+      lcd.setCursor(col, row); // The address then auto-increments along the run
+      while (col < LCD_COLS && frame[col] != lcdGlass[row][col]) {
+        lcd.write(frame[col]);
+        lcdGlass[row][col] = frame[col];
+        col++;
+      }
+    }
+  }
+}
+// Show a short message for a second, e.g. after a menu action
+void displayMessage(const char* top, const char* bottom) {
   wakeLCD();
-  lcd.clear();
-  lcd.home();
-  lcd.print(name);
-  lcd.setCursor(0, 1);
+  liveItem = -1;
+  lcdShow(top, bottom);
+  delay(1000);
+}
+// Show a value on the LCD, "pH: 7.1" if it has no unit
+void displayValue(const char* name, float val, const char* unit) {
+  char line[LCD_COLS + 1];
   if (val < 0) {
-    lcd.print("Error");
-    return;
+    snprintf(line, sizeof(line), "Error");
+  } else if (unit[0] == 0) {
+    snprintf(line, sizeof(line), "%s: %.1f", name, val);
+  } else {
+    snprintf(line, sizeof(line), "%.1f %s", val, unit);
+  }
+  lcdShow(name, line);
+}
+// Draw the live view of a reading menu item (one per SENSOR_CHANNELS entry)
+// from the latest snapshot
+void displayReading(int item) {
+  SensorSnapshot s;
+  float value = getLatestSnapshot(s) ? s.value[item] : -1.0f; // -1: nothing sampled yet
+  const SensorChannel& c = SENSOR_CHANNELS[item];
+  displayValue(c.name, value, c.unit);
+}
+// Format a duration in at most 5 characters, e.g. "850us", "12ms", "1.5s"
+void formatUs(uint32_t us, char* out, size_t cap) {
+  if (us < 1000) {
+    snprintf(out, cap, "%uus", (unsigned)us);
+  } else if (us < 10000) {
+    snprintf(out, cap, "%.1fms", us / 1000.0);
+  } else if (us < 1000000) {
+    snprintf(out, cap, "%ums", (unsigned)(us / 1000));
+  } else {
+    snprintf(out, cap, "%.1fs", us / 1000000.0);
+  }
+}
+const int STATS_PAGES = 2 + PERF_STAGE_COUNT;
+// One page of the Stats view: counters, heap, then one page per timed stage
+void displayStats(int page) {
+  char top[LCD_COLS + 1];
+  char bottom[LCD_COLS + 1];
+  if (page == 0) {
+    snprintf(top, sizeof(top), "Rd %u Rej %u", (unsigned)perfCounters.reads, (unsigned)perfRejects());
+    snprintf(bottom, sizeof(bottom), "UpF %u Rtry %u", (unsigned)perfCounters.uploadFailures,
+             (unsigned)perfCounters.retries);
+  } else if (page == 1) {
+    snprintf(top, sizeof(top), "Heap %u", (unsigned)ESP.getFreeHeap());
+    snprintf(bottom, sizeof(bottom), "Min  %u", (unsigned)ESP.getMinFreeHeap());
+  } else {
+#if PERF_STATS
+    const PerfHistogram& h = perfStages[page - 2];
+    char avg[8], p90[8], worst[8];
+    formatUs(h.count ? h.totalUs / h.count : 0, avg, sizeof(avg));
+    formatUs(perfPercentileUs(h, 0.9), p90, sizeof(p90));
+    formatUs(h.maxUs, worst, sizeof(worst));
+    snprintf(top, sizeof(top), "%s avg %s", perfStageNames[page - 2], avg);
+    snprintf(bottom, sizeof(bottom), "90%%:%s mx%s", p90, worst);
+#else
+    snprintf(top, sizeof(top), "%s", perfStageNames[page - 2]);
+    snprintf(bottom, sizeof(bottom), "PERF_STATS off");
+#endif
   }
-  if (strcmp(name, "pH") == 0) {
-    lcd.print("pH: ");
-    lcd.print(val, 1);
+  lcdShow(top, bottom);
+}
+void drawLiveView() {
+  if (liveItem == MENU_STATS) {
+    displayStats(statsPage);
+  } else if (liveItem == MENU_CALIBRATE) {
+    displayCalibration();
   } else {
-    lcd.print(val, 1);
-    lcd.print(" ");
-    lcd.print(unit);
+    displayReading(liveItem);
   }
 }
+// Open the live view of a reading or the Stats view; refreshLiveView() keeps it current
+void openLiveView(int item) {
+  wakeLCD();
+  liveItem = item;
+  lastLiveRefresh = millis();
+  drawLiveView();
+}
+// UI task: redraw the live view in place every LIVE_REFRESH_MS
+void refreshLiveView() {
+  if (liveItem < 0 || millis() - lastLiveRefresh < LIVE_REFRESH_MS) return;
+  lastLiveRefresh = millis();
+  drawLiveView();
+}
+// Show a new alert until the next button press
+void displayAlert(AlertMask alerts) {
+  char channels[24];
+  describeAlerts(alerts, channels, sizeof(channels));
+  wakeLCD();
+  liveItem = -1;
+  lcdShow("!! ALERT !!", channels);
+}
+// Menu item names: the channels, then MENU_ACTIONS
+const char* menuItemName(int item) {
+  return item < CHANNEL_COUNT ? SENSOR_CHANNELS[item].name : MENU_ACTIONS[item - CHANNEL_COUNT];
+}
 // Show the menu
 void displayMenu() {
   wakeLCD();
-  lcd.clear();
-  lcd.home();
-  lcd.print(">");
-  lcd.print(menuItems[currentMenuItem]);
-  lcd.setCursor(0, 1);
-  if (currentMenuItem < menuItemsCount - 1) {
-    lcd.print(" ");
-    lcd.print(menuItems[currentMenuItem + 1]);
-  } else {
-    lcd.print(" ");
-    lcd.print(menuItems[0]);
-  }
+  liveItem = -1;
+  char top[LCD_COLS + 1];
+  char bottom[LCD_COLS + 1];
+  snprintf(top, sizeof(top), ">%s", menuItemName(currentMenuItem));
+  snprintf(bottom, sizeof(bottom), " %s", menuItemName((currentMenuItem + 1) % menuItemsCount));
+  lcdShow(top, bottom);
 }
 // ============================================================
 
-// ===================== FIREBASE UPLOAD =====================
-void sendToFirebase() {
-  Serial.println("Attempting to send data to Firebase...");
-  if (WiFi.status() != WL_CONNECTED || !Firebase.ready()) {
-    Serial.println("Firebase send skipped: WiFi not connected or Firebase not ready.");
+// ===================== OFFLINE LOG =====================
+// Readings that cannot be uploaded are appended to a circular log on the raw
+// "spiffs" data partition. Each 4 KB sector starts with a header carrying a
+// sequence number, followed by fixed-size records (32 bytes with the four
+// stored channels). The head only moves
+// forward, so a sector is erased once per trip around the ring, and when the
+// ring is full the oldest sector is dropped to keep the log bounded.
+// Uploaded records are marked in place by programming their "sent" word from
+// 0xFFFF to 0, which NOR flash allows without an erase.
+// "AQL2" with the 32-byte record of four stored channels and one alert byte;
+// sectors written with another record size (more channels or alert bits) do
+// not match and are not read back
+const uint32_t LOG_SECTOR_SIZE = 4096;
+const uint32_t LOG_RECORD_SIZE = sizeof(LogRecord);
+const uint32_t LOG_MAGIC = 0x41514C32 + ((LOG_RECORD_SIZE - 32) << 8);
+const uint32_t LOG_RECORDS_PER_SECTOR = LOG_SECTOR_SIZE / LOG_RECORD_SIZE - 1; // Slot 0 holds the header
+const uint32_t LOG_MAX_SECTORS = 352;             // Ring size cap (~1.4 MB, ~7.8 days at 15 s)
+const int LOG_REPLAY_BATCH = 20;                  // Records sent per replay write
+
+struct __attribute__((packed)) LogSectorHeader {
+  uint32_t magic;
+  uint32_t seq;          // Increments every time the head moves to a new sector
+  uint8_t reserved[LOG_RECORD_SIZE - 8];
+};
+// LogRecord itself is LogRecordOf<RECORD_VALUES> from sensor_pipeline.h
+static_assert(sizeof(LogSectorHeader) == LOG_RECORD_SIZE, "log header must fill one record slot");
+
+struct LogCursor {
+  uint32_t sector;       // Physical sector in the partition
+  uint32_t seq;          // Sequence number of that sector
+  uint32_t slot;         // Record slot, LOG_RECORDS_PER_SECTOR means "sector full"
+};
+const esp_partition_t* logPartition = NULL;
+uint32_t logSectorCount = 0;
+LogCursor logHead;       // Next slot to write
+LogCursor logTail;       // Oldest record not yet uploaded
+LogCursor logReadEnd;    // Cursor just past the last batch returned by logReadBatch()
+bool logReady = false;
+
+uint32_t logAddr(const LogCursor& c) {
+  return c.sector * LOG_SECTOR_SIZE + (c.slot + 1) * LOG_RECORD_SIZE;
+}
+// Records between two cursors (b must not be behind a)
+uint32_t logDistance(const LogCursor& a, const LogCursor& b) {
+  return (b.seq - a.seq) * LOG_RECORDS_PER_SECTOR + b.slot - a.slot;
+}
+uint32_t logPending() {
+  return logReady ? logDistance(logTail, logHead) : 0;
+}
+// Move a read cursor onto the next sector once it runs off the end of one
+void logNormalize(LogCursor& c) {
+  if (c.slot >= LOG_RECORDS_PER_SECTOR && c.seq != logHead.seq) {
+    c.sector = (c.sector + 1) % logSectorCount;
+    c.seq++;
+    c.slot = 0;
+  }
+}
+uint16_t logRecordCrc(const LogRecord& r) {
+  return esp_rom_crc16_le(0, (const uint8_t*)&r, offsetof(LogRecord, crc));
+}
+bool logStartSector(uint32_t sector, uint32_t seq) {
+  LogSectorHeader h;
+  memset(&h, 0xFF, sizeof(h));
+  h.magic = LOG_MAGIC;
+  h.seq = seq;
+  return esp_partition_erase_range(logPartition, sector * LOG_SECTOR_SIZE, LOG_SECTOR_SIZE) == ESP_OK &&
+         esp_partition_write(logPartition, sector * LOG_SECTOR_SIZE, &h, sizeof(h)) == ESP_OK;
+}
+bool logReadHeader(uint32_t sector, LogSectorHeader& h) {
+  return esp_partition_read(logPartition, sector * LOG_SECTOR_SIZE, &h, sizeof(h)) == ESP_OK && h.magic == LOG_MAGIC;
+}
+bool logSlotErased(const LogCursor& c) {
+  uint64_t ts;
+  esp_partition_read(logPartition, logAddr(c), &ts, sizeof(ts));
+  return ts == UINT64_MAX;
+}
+// Find the head and tail of the ring left by the previous boot
+void initOfflineLog() {
+  logPartition = esp_partition_find_first(ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_DATA_SPIFFS, NULL);
+  if (logPartition == NULL) {
+    Serial.println("WARNING: No data partition for the offline log, readings will be dropped while offline.");
     return;
   }
-  float temperature = getTemp();
-  float ph = getPH();
-  float turbidity = getTurbidity();
-  float tds = getTDS();
-  float ec = (tds < 0) ? -1.0 : tds * 2.0;
-  if (temperature < 0 || ph < 0 || turbidity < 0 || tds < 0 || ec < 0) {
-    Serial.println("Skipping Firebase send due to sensor error values.");
+  logSectorCount = min(logPartition->size / LOG_SECTOR_SIZE, LOG_MAX_SECTORS);
+  if (logSectorCount < 2) return;
+
+  // The newest sector is the one with the highest sequence number
+  LogSectorHeader h;
+  bool found = false;
+  for (uint32_t sec = 0; sec < logSectorCount; sec++) {
+    if (logReadHeader(sec, h) && (!found || h.seq > logHead.seq)) {
+      logHead = { sec, h.seq, 0 };
+      found = true;
+    }
+  }
+  if (!found) {
+    if (!logStartSector(0, 0)) return;
+    logHead = { 0, 0, 0 };
+    logTail = logHead;
+    logReady = true;
     return;
   }
-  FirebaseJson data;
-  data.set("t", String(temperature, 1));
-  data.set("p", String(ph, 1));
-  data.set("n", String(turbidity, 1));
-  data.set("d", String(tds, 1));
-  data.set("ec", String(ec, 1));
-  data.set("timestamp", Firebase.RTDB.ServerValue.timestamp());
-  String databasePath = "/r/" + String(millis() / 1000);
-  Serial.print("Sending data to: ");
-  Serial.println(databasePath);
-  Serial.print("Data: ");
-  data.toString(Serial, true);
-  Serial.println();
-  if (Firebase.setJSON(fbdo, databasePath.c_str(), data)) {
-    Serial.println("Realtime Database write successful!");
-  } else {
-    Serial.print("Realtime Database write FAILED: ");
-    Serial.println(fbdo.errorReason());
+  while (logHead.slot < LOG_RECORDS_PER_SECTOR && !logSlotErased(logHead)) {
+    logHead.slot++;
   }
-}
-// ============================================================
 
-// ===================== MENU HANDLING =====================
-void handleMenu() {
-  // Button debounce logic
-  if (millis() - lastButtonPress < 200) {
-    return;
+  // Walk back over the contiguous run of older sectors to find the oldest
+  logTail = { logHead.sector, logHead.seq, 0 };
+  for (uint32_t n = 1; n < logSectorCount; n++) {
+    uint32_t prev = (logTail.sector + logSectorCount - 1) % logSectorCount;
+    if (!logReadHeader(prev, h) || h.seq != logTail.seq - 1) break;
+    logTail = { prev, h.seq, 0 };
   }
-  bool buttonPressed = false;
-  if (!digitalRead(BTN_UP)) {
-    currentMenuItem = (currentMenuItem > 0) ? (currentMenuItem - 1) : (menuItemsCount - 1);
-    displayMenu();
-    buttonPressed = true;
-  } else if (!digitalRead(BTN_DOWN)) {
-    currentMenuItem = (currentMenuItem < menuItemsCount - 1) ? (currentMenuItem + 1) : 0;
-    displayMenu();
-    buttonPressed = true;
-  } else if (!digitalRead(BTN_SELECT)) {
-    buttonPressed = true;
-    switch (currentMenuItem) {
-      case 0: displayValue("Temp", getTemp(), "C"); break;
-      case 1: displayValue("pH", getPH(), ""); break;
-      case 2: displayValue("Turbidity", getTurbidity(), "NTU"); break;
-      case 3: displayValue("TDS", getTDS(), "ppm"); break;
-      case 4: displayValue("EC", getEC(), "uS/cm"); break;
-      case 5:
-        powerSaveMode = !powerSaveMode;
-        lcd.clear();
-        lcd.print("Power Save: ");
-        lcd.print(powerSaveMode ? "ON" : "OFF");
-        delay(1000);
-        displayMenu();
-        break;
-      case 6:
-        lcd.clear();
-        lcd.print("Sending data...");
-        sendToFirebase();
-        lcd.clear();
-        lcd.print("Data sent!");
-        delay(1000);
-        displayMenu();
-        break;
+  logReady = true;
+
+  // Skip what earlier boots already uploaded. Records are drained in order,
+  // so a sector whose last record is sent has been drained completely.
+  LogRecord r;
+  while (logPending() > 0) {
+    logNormalize(logTail);
+    if (logTail.seq != logHead.seq) {
+      LogCursor last = { logTail.sector, logTail.seq, LOG_RECORDS_PER_SECTOR - 1 };
+      esp_partition_read(logPartition, logAddr(last), &r, sizeof(r));
+      if (r.sent == 0) {
+        logTail.slot = LOG_RECORDS_PER_SECTOR;
+        continue;
+      }
     }
-  } else if (!digitalRead(BTN_BACK)) {
-    buttonPressed = true;
-    displayMenu();
+    esp_partition_read(logPartition, logAddr(logTail), &r, sizeof(r));
+    if (r.sent != 0) break;
+    logTail.slot++;
+  }
+  Serial.printf("Offline log: %u sectors, %u readings pending upload.\n", (unsigned)logSectorCount, (unsigned)logPending());
+}
+// Append a record, dropping the oldest sector if the ring is full
+bool logAppend(LogRecord r) {
+  if (!logReady) return false;
+  if (logHead.slot >= LOG_RECORDS_PER_SECTOR) {
+    uint32_t next = (logHead.sector + 1) % logSectorCount;
+    if (next == logTail.sector && logTail.seq != logHead.seq) {
+      Serial.printf("WARNING: Offline log full, dropped %u oldest readings.\n",
+                    (unsigned)(LOG_RECORDS_PER_SECTOR - min(logTail.slot, LOG_RECORDS_PER_SECTOR)));
+      logTail = { (next + 1) % logSectorCount, logTail.seq + 1, 0 };
+    }
+    if (!logStartSector(next, logHead.seq + 1)) return false;
+    logHead = { next, logHead.seq + 1, 0 };
+  }
+  r.crc = logRecordCrc(r);
+  r.sent = 0xFFFF;
+  if (esp_partition_write(logPartition, logAddr(logHead), &r, sizeof(r)) != ESP_OK) return false;
+  logHead.slot++;
+  return true;
+}
+// Copy up to max unsent records from the tail. Corrupt records (e.g. torn by
+// a power loss mid-write) are skipped. where[] receives each record's cursor.
+int logReadBatch(LogRecord* out, LogCursor* where, int max) {
+  LogCursor c = logTail;
+  int n = 0;
+  while (n < max && logDistance(c, logHead) > 0) {
+    logNormalize(c);
+    if (logDistance(c, logHead) == 0) break;
+    esp_partition_read(logPartition, logAddr(c), &out[n], sizeof(LogRecord));
+    if (out[n].sent != 0 && out[n].crc == logRecordCrc(out[n])) {
+      where[n++] = c;
+    }
+    c.slot++;
   }
-  if (buttonPressed) {
-    lastButtonPress = millis();
+  logReadEnd = c;
+  return n;
+}
+// Mark a batch returned by logReadBatch() as uploaded and release it
+void logMarkSent(const LogCursor* where, int n) {
+  const uint16_t zero = 0;
+  for (int i = 0; i < n; i++) {
+    esp_partition_write(logPartition, logAddr(where[i]) + offsetof(LogRecord, sent), &zero, sizeof(zero));
   }
+  logTail = logReadEnd;
+}
+LogRecord recordFromSnapshot(const SensorSnapshot& s) {
+  LogRecord r;
+  memset(&r, 0xFF, sizeof(r));
+  r.timestampMs = s.timestampMs;
+  for (int c = 0; c < RECORD_VALUES; c++) r.value[c] = s.value[c];
+  r.session = timeState.session;
+  r.flags = (s.timestampMs < EPOCH_VALID_MS) ? LOG_FLAG_UNSYNCED : 0;
+  r.alerts = s.alerts;
+  return r;
 }
 // ============================================================
 
-void loop() {
-  handleMenu();   // Check and handle button presses for the menu
-  managePower();  // Handle power saving features (LCD backlight, deep sleep)
-  // Automatic data sending every 15 seconds (if not in power save mode)
-  if (millis() - lastRead >= 15000) {
-    lastRead = millis();
-    if (!powerSaveMode) {
-      sendToFirebase();
+// ===================== PAYLOAD ENCODING =====================
+// Upload requests are written into fixed static buffers, with values emitted
+// as JSON numbers. Nothing on the upload path touches String or the heap.
+// BufWriter and both encoders live in sensor_pipeline.h and take their keys
+// and scales from VALUE_FORMATS; this section supplies the buffers and the
+// clock-dependent recordEpochMs() they call.
+const int UPLOAD_MAX_RECORDS = UPLOAD_BATCH_SIZE > LOG_REPLAY_BATCH ? UPLOAD_BATCH_SIZE : LOG_REPLAY_BATCH;
+char uploadBody[RECORD_JSON_MAX * UPLOAD_MAX_RECORDS + 4];
+char uploadHead[1536];               // Request line and headers (the auth token alone is ~1 KB)
+
+// Unix time in ms at which a record was sampled. Readings taken before the
+// first SNTP sync are shifted by the sync's jump if they come from the current
+// power session; older ones cannot be dated and return false.
+bool recordEpochMs(const LogRecord& r, uint64_t& epochMs) {
+  if (!(r.flags & LOG_FLAG_UNSYNCED)) {
+    epochMs = r.timestampMs;
+    return true;
+  }
+  if (r.session != timeState.session || !timeState.synced) return false;
+  epochMs = r.timestampMs + timeState.syncJumpMs;
+  return true;
+}
+// ============================================================
+
+// ===================== RTDB CONNECTION =====================
+// One HTTPS connection to the database is kept open between uploads (HTTP/1.1
+// keep-alive). When it has been dropped, the next request reconnects and
+// offers the TLS session saved from the previous handshake, so the server can
+// resume it instead of doing a full key exchange. rtdbStats records how often
+// a session is offered and what the handshakes cost; whether the server took
+// the offer is not reported by esp-tls, but shows as a much shorter handshake.
+// Sessions need CONFIG_ESP_TLS_CLIENT_SESSION_TICKETS in the core's sdkconfig;
+// without it the first handshake says so on Serial and the diag node reports
+// "tls_session_tickets":false.
+#ifdef CONFIG_ESP_TLS_CLIENT_SESSION_TICKETS
+const bool RTDB_SESSION_TICKETS = true;
+#else
+const bool RTDB_SESSION_TICKETS = false;
+#endif
+const unsigned long RTDB_IDLE_CLOSE_MS = 240000;  // Drop our end after this long unused
+struct RtdbStats {
+  uint32_t requests;
+  uint32_t reused;            // Requests sent on an already open connection
+  uint32_t handshakes;
+  uint32_t sessionOffers;     // Handshakes that offered a saved session (accepted or not)
+  uint32_t handshakeFailures;
+  uint32_t lastHandshakeMs;
+  uint32_t totalHandshakeMs;
+};
+RtdbStats rtdbStats = {};
+esp_tls_t* rtdbTls = NULL;
+esp_tls_client_session_t* rtdbSession = NULL;
+unsigned long rtdbLastUsed = 0;
+uint8_t rtdbRx[256];         // Receive buffer for response headers
+size_t rtdbRxLen = 0;
+size_t rtdbRxPos = 0;
+char rtdbEtag[48];           // ETag header of the last response, if any
+unsigned long rtdbExchangeStart = 0;  // Bounds a whole response, not just each read
+
+void rtdbClose() {
+  if (rtdbTls != NULL) {
+    esp_tls_conn_destroy(rtdbTls);
+    rtdbTls = NULL;
+  }
+  rtdbRxLen = rtdbRxPos = 0;
+}
+bool rtdbConnect() {
+  esp_tls_cfg_t cfg = {};
+  cfg.crt_bundle_attach = esp_crt_bundle_attach;
+  cfg.timeout_ms = UPLOAD_TIMEOUT_MS; // Bounds the handshake and every socket read/write
+  tls_keep_alive_cfg_t keepAlive = {};
+  keepAlive.keep_alive_enable = true;
+  keepAlive.keep_alive_idle = 30;
+  keepAlive.keep_alive_interval = 10;
+  keepAlive.keep_alive_count = 3;
+  cfg.keep_alive_cfg = &keepAlive;
+#ifdef CONFIG_ESP_TLS_CLIENT_SESSION_TICKETS
+  cfg.client_session = rtdbSession;
+#endif
+  rtdbTls = esp_tls_init();
+  if (rtdbTls == NULL) return false;
+  int64_t start = esp_timer_get_time();
+  int ret;
+  {
+    PERF_SCOPE(PERF_TLS);
+    ret = esp_tls_conn_new_sync(FIREBASE_HOST, strlen(FIREBASE_HOST), 443, &cfg, rtdbTls);
+  }
+  uint32_t ms = (esp_timer_get_time() - start) / 1000;
+  if (ret != 1) {
+    rtdbStats.handshakeFailures++;
+    Serial.printf("TLS connect to " FIREBASE_HOST " FAILED after %u ms\n", (unsigned)ms);
+    rtdbClose();
+    return false;
+  }
+  rtdbStats.handshakes++;
+  rtdbStats.lastHandshakeMs = ms;
+  rtdbStats.totalHandshakeMs += ms;
+  bool offered = false;
+#ifdef CONFIG_ESP_TLS_CLIENT_SESSION_TICKETS
+  if (rtdbSession != NULL) {
+    offered = true;
+    rtdbStats.sessionOffers++;
+    esp_tls_free_client_session(rtdbSession);
+  }
+  rtdbSession = esp_tls_get_client_session(rtdbTls);
+#endif
+  if (!RTDB_SESSION_TICKETS && rtdbStats.handshakes == 1) {
+    Serial.println("CONFIG_ESP_TLS_CLIENT_SESSION_TICKETS is off: every database reconnect does a full TLS handshake");
+  }
+  Serial.printf("TLS handshake %u ms (%s), %u handshakes avg %u ms\n", (unsigned)ms, offered ? "session offered" : "full",
+                (unsigned)rtdbStats.handshakes, (unsigned)(rtdbStats.totalHandshakeMs / rtdbStats.handshakes));
+  return true;
+}
+bool rtdbWriteAll(const char* data, size_t len) {
+  while (len > 0) {
+    ssize_t n = esp_tls_conn_write(rtdbTls, data, len);
+    if (n <= 0) return false;
+    data += n;
+    len -= n;
+  }
+  return true;
+}
+int rtdbReadByte() {
+  if (rtdbRxPos == rtdbRxLen) {
+    if (millis() - rtdbExchangeStart >= UPLOAD_TIMEOUT_MS) return -1; // A slow trickle counts as a timeout
+    ssize_t n = esp_tls_conn_read(rtdbTls, rtdbRx, sizeof(rtdbRx));
+    if (n <= 0) return -1;
+    rtdbRxLen = n;
+    rtdbRxPos = 0;
+  }
+  return rtdbRx[rtdbRxPos++];
+}
+// Read one header line into line (without the CRLF). Returns false if the
+// connection closed or timed out.
+bool rtdbReadLine(char* line, size_t cap) {
+  size_t n = 0;
+  for (;;) {
+    int c = rtdbReadByte();
+    if (c < 0) return false;
+    if (c == '\n') break;
+    if (c != '\r' && n + 1 < cap) line[n++] = c;
+  }
+  line[n] = 0;
+  return true;
+}
+// Copy n body bytes into response (if given). False if the connection
+// dropped or timed out first.
+bool rtdbReadBody(long n, BufWriter* response) {
+  for (long i = 0; i < n; i++) {
+    int c = rtdbReadByte();
+    if (c < 0) return false;
+    if (response != NULL) response->put((char)c);
+  }
+  return true;
+}
+// A Transfer-Encoding: chunked body: hex size lines, each followed by that
+// many bytes and a CRLF, ending with a zero size and optional trailer lines
+bool rtdbReadChunked(BufWriter* response) {
+  char line[64];
+  for (;;) {
+    if (!rtdbReadLine(line, sizeof(line))) return false;
+    char* end;
+    long size = strtol(line, &end, 16);
+    if (end == line || size < 0) return false;
+    if (size == 0) break;
+    if (!rtdbReadBody(size, response) || !rtdbReadLine(line, sizeof(line)) || line[0] != 0) return false;
+  }
+  do {
+    if (!rtdbReadLine(line, sizeof(line))) return false;
+  } while (line[0] != 0);
+  return true;
+}
+// Send one request on the open connection and consume the response, leaving
+// the connection ready for the next one. The body is framed by Content-Length
+// or chunked encoding; a body with neither runs until the server closes, so
+// it is read to the end and the connection dropped, as it is after
+// Connection: close. The body is copied into response if given (and
+// discarded otherwise). Returns the HTTP status or -1.
+int rtdbExchange(const BufWriter& head, const char* body, size_t len, BufWriter* response) {
+  rtdbExchangeStart = millis();
+  if (!rtdbWriteAll(head.buf, head.len) || !rtdbWriteAll(body, len)) return -1;
+  char line[96];
+  if (!rtdbReadLine(line, sizeof(line)) || strncmp(line, "HTTP/1.", 7) != 0) return -1;
+  int status = atoi(line + 9);
+  long contentLength = -1;
+  bool chunked = false;
+  bool serverCloses = false;
+  rtdbEtag[0] = 0;
+  while (rtdbReadLine(line, sizeof(line))) {
+    if (line[0] == 0) {
+      bool noBody = status == 204 || status == 304 || (status >= 100 && status < 200);
+      if (chunked) {
+        if (!rtdbReadChunked(response)) return -1;
+      } else if (contentLength >= 0) {
+        if (!rtdbReadBody(contentLength, response)) return -1;
+      } else if (!noBody) {
+        // Close-delimited: whatever arrives until the connection ends
+        for (int c; (c = rtdbReadByte()) >= 0;) {
+          if (response != NULL) response->put((char)c);
+        }
+        serverCloses = true;
+      }
+      if (serverCloses) rtdbClose();
+      return status;
+    }
+    if (strncasecmp(line, "Content-Length:", 15) == 0) contentLength = atol(line + 15);
+    if (strncasecmp(line, "Transfer-Encoding:", 18) == 0 && strcasestr(line + 18, "chunked") != NULL) chunked = true;
+    if (strncasecmp(line, "Connection:", 11) == 0 && strcasestr(line + 11, "close") != NULL) serverCloses = true;
+    if (strncasecmp(line, "ETag:", 5) == 0) {
+      const char* v = line + 5;
+      while (*v == ' ') v++;
+      strlcpy(rtdbEtag, v, sizeof(rtdbEtag));
+    }
+  }
+  return -1;
+}
+// Issue one REST request for <path>.json. A request that fails on a reused
+// connection (the server may have closed it while idle) is retried once on a
+// fresh one. Returns the HTTP status, or -1 if no response arrived.
+int rtdbRequest(const char* method, const char* path, const char* query, const char* body, size_t len,
+                BufWriter* response, const char* ifNoneMatch = NULL) {
+  BufWriter head(uploadHead, sizeof(uploadHead));
+  head.put(method);
+  head.put(' ');
+  head.put(path);
+  head.put(".json?");
+  head.put(query);
+  const char* token = config.signer.tokens.id_token.c_str();
+  if (token[0]) {
+    head.put(query[0] ? "&auth=" : "auth=");
+    head.put(token);
+  }
+  head.put(" HTTP/1.1\r\nHost: " FIREBASE_HOST "\r\n");
+  if (len > 0) {
+    head.put("Content-Type: application/json\r\nContent-Length: ");
+    head.putUInt(len);
+    head.put("\r\n");
+  }
+  if (response != NULL) head.put("X-Firebase-ETag: true\r\n");
+  if (ifNoneMatch != NULL && ifNoneMatch[0]) {
+    head.put("If-None-Match: ");
+    head.put(ifNoneMatch);
+    head.put("\r\n");
+  }
+  head.put("Connection: keep-alive\r\n\r\n");
+  if (head.overflow) return -1;
+
+  if (rtdbTls != NULL && millis() - rtdbLastUsed > RTDB_IDLE_CLOSE_MS) {
+    rtdbClose();
+  }
+  PERF_SCOPE(PERF_REQUEST); // Includes any reconnect
+  for (int attempt = 0; attempt < 2; attempt++) {
+    if (attempt > 0) PERF_COUNT(retries);
+    bool reused = rtdbTls != NULL;
+    if (!reused && !rtdbConnect()) return -1;
+    if (response != NULL) {
+      response->len = 0;
+      response->buf[0] = 0;
+      response->overflow = false;
+    }
+    int status = rtdbExchange(head, body, len, response);
+    if (status > 0) {
+      rtdbStats.requests++;
+      if (reused) rtdbStats.reused++;
+      rtdbLastUsed = millis();
+      return status;
     }
+    rtdbClose();
+    if (!reused) break;
   }
-  delay(100);  // Small delay to prevent CPU hogging
-} 
\ No newline at end of file
+  return -1;
+}
+// PATCH a JSON body to <path>.json (a multi-path update), without echoing it back
+int rtdbPatch(const char* path, const char* body, size_t len) {
+  return rtdbRequest("PATCH", path, "print=silent", body, len, NULL);
+}
+// GET <path>.json into response. rtdbEtag receives the value's ETag. Given
+// the ETag of a copy already held, an unchanged value answers 304 and no body.
+int rtdbGet(const char* path, BufWriter& response, const char* ifNoneMatch = NULL) {
+  return rtdbRequest("GET", path, "", "", 0, &response, ifNoneMatch);
+}
+// ============================================================
+
+// ===================== WIFI CONNECTION =====================
+// The link is managed in the background by serviceWifi(), which the network
+// task calls every wakeup. WiFi events only set flags; failed attempts back
+// off exponentially up to WIFI_BACKOFF_MAX_MS. Enterprise (EAP) or PSK is
+// chosen at runtime from the "WiFi Mode" menu and kept in NVS. A new attempt
+// first tears down the old station and waits (WIFI_STOPPING) for its
+// DISCONNECTED event, so that event cannot land after the flags are cleared
+// and fail the new attempt as soon as it starts.
+const unsigned long WIFI_BACKOFF_MIN_MS = 2000;
+const unsigned long WIFI_BACKOFF_MAX_MS = 300000;
+const unsigned long WIFI_ATTEMPT_TIMEOUT_MS = 20000; // Association + EAP + DHCP
+const unsigned long WIFI_FAST_ATTEMPT_TIMEOUT_MS = 5000;
+const unsigned long WIFI_STOP_TIMEOUT_MS = 1000;     // Longest wait for the old station's DISCONNECTED
+enum WifiState { WIFI_IDLE, WIFI_STOPPING, WIFI_CONNECTING, WIFI_UP, WIFI_BACKOFF };
+WifiState wifiState = WIFI_IDLE;
+unsigned long wifiStateSince = 0;
+unsigned long wifiBackoffMs = WIFI_BACKOFF_MIN_MS;
+volatile bool wifiGotIp = false;          // Set from the WiFi event task
+volatile bool wifiDisconnected = false;   // Set from the WiFi event task
+volatile bool wifiStaActive = false;      // WiFi.begin() called and no STA_DISCONNECTED since
+volatile bool wifiRestartRequested = false;
+volatile bool wifiUseEnterprise = WIFI_USE_ENTERPRISE;
+bool firebaseStarted = false;
+
+// After a deep-sleep wake the first attempt skips the channel scan and DHCP by
+// reusing the AP and lease from the last session. If that fails the next
+// attempt falls back to a normal scan and DHCP.
+struct WifiCache {
+  bool valid;
+  uint8_t bssid[6];
+  uint8_t channel;
+  uint32_t ip, gateway, mask, dns;
+};
+RTC_DATA_ATTR WifiCache wifiCache = {};
+bool wifiFastAttempt = false;     // Next attempt may use wifiCache
+bool wifiAttemptWasFast = false;  // The attempt in progress is using it
+
+void loadNetworkMode() {
+  preferences.begin("net", true);
+  wifiUseEnterprise = preferences.getBool("enterprise", wifiUseEnterprise);
+  preferences.end();
+}
+void saveNetworkMode() {
+  preferences.begin("net", false);
+  preferences.putBool("enterprise", wifiUseEnterprise);
+  preferences.end();
+}
+void onWifiEvent(arduino_event_id_t event, arduino_event_info_t info) {
+  if (event == ARDUINO_EVENT_WIFI_STA_GOT_IP) {
+    wifiGotIp = true;
+  } else if (event == ARDUINO_EVENT_WIFI_STA_DISCONNECTED || event == ARDUINO_EVENT_WIFI_STA_LOST_IP) {
+    if (event == ARDUINO_EVENT_WIFI_STA_DISCONNECTED) wifiStaActive = false;
+    wifiDisconnected = true;
+    if (netTaskHandle != NULL) xTaskNotifyGive(netTaskHandle); // An attempt may be waiting in WIFI_STOPPING
+  }
+}
+void wifiStartAttempt() {
+  if (wifiStaActive) {
+    // Leave the old AP first; serviceWifi() comes back once it has gone
+    wifiState = WIFI_STOPPING;
+    wifiStateSince = millis();
+    WiFi.disconnect();
+    return;
+  }
+  wifiGotIp = false;
+  wifiDisconnected = false;
+  wifiStaActive = true; // Before begin(): a failure event may arrive at once
+  wifiAttemptWasFast = wifiFastAttempt && wifiCache.valid;
+  wifiFastAttempt = false;
+  const uint8_t* bssid = NULL;
+  int32_t channel = 0;
+  if (wifiAttemptWasFast) {
+    WiFi.config(IPAddress(wifiCache.ip), IPAddress(wifiCache.gateway), IPAddress(wifiCache.mask),
+                IPAddress(wifiCache.dns));
+    bssid = wifiCache.bssid;
+    channel = wifiCache.channel;
+  } else {
+    WiFi.config(INADDR_NONE, INADDR_NONE, INADDR_NONE); // DHCP
+  }
+  if (wifiUseEnterprise) {
+    // --- WPA2 Enterprise Connection ---
+    Serial.printf("Connecting to WiFi (WPA2 Enterprise%s)...\n", wifiAttemptWasFast ? ", cached AP" : "");
+    esp_wifi_sta_wpa2_ent_set_identity((uint8_t*)WIFI_IDENTITY, strlen(WIFI_IDENTITY));
+    esp_wifi_sta_wpa2_ent_set_username((uint8_t*)WIFI_IDENTITY, strlen(WIFI_IDENTITY));
+    esp_wifi_sta_wpa2_ent_set_password((uint8_t*)WIFI_EAP_PASSWORD, strlen(WIFI_EAP_PASSWORD));
+    esp_wifi_sta_wpa2_ent_enable();
+    WiFi.begin(WIFI_SSID, NULL, channel, bssid);
+  } else {
+    // --- Standard WiFi Connection ---
+    Serial.printf("Connecting to WiFi (PSK%s)...\n", wifiAttemptWasFast ? ", cached AP" : "");
+    esp_wifi_sta_wpa2_ent_disable();
+    WiFi.begin(WIFI_SSID, WIFI_PASSWORD, channel, bssid);
+  }
+  wifiState = WIFI_CONNECTING;
+  wifiStateSince = millis();
+}
+// Set up WiFi in station mode; serviceWifi() does the connecting
+void beginWifi() {
+  loadNetworkMode();
+  wifiFastAttempt = esp_sleep_get_wakeup_cause() != ESP_SLEEP_WAKEUP_UNDEFINED;
+  WiFi.mode(WIFI_STA);
+  WiFi.setAutoReconnect(false); // Reconnects are paced by serviceWifi()'s backoff
+  WiFi.setSleep(WIFI_PS_MIN_MODEM); // Modem sleeps between DTIM beacons
+  WiFi.onEvent(onWifiEvent);
+}
+void cacheWifiSession() {
+  memcpy(wifiCache.bssid, WiFi.BSSID(), sizeof(wifiCache.bssid));
+  wifiCache.channel = WiFi.channel();
+  wifiCache.ip = WiFi.localIP();
+  wifiCache.gateway = WiFi.gatewayIP();
+  wifiCache.mask = WiFi.subnetMask();
+  wifiCache.dns = WiFi.dnsIP();
+  wifiCache.valid = true;
+}
+
+// The Firebase ID and refresh tokens are kept in NVS so a wake does not have
+// to sign in again. They are rewritten only when the library refreshes them.
+const uint32_t FIREBASE_TOKEN_LIFETIME_S = 3600;
+uint32_t savedTokenCrc = 0;
+unsigned long lastTokenCheck = 0;
+
+// Restore saved tokens into the library config. Returns false if there are none.
+bool restoreFirebaseToken() {
+  static char idToken[1280];
+  static char refreshToken[512];
+  preferences.begin("fbauth", true);
+  size_t idLen = preferences.getString("id", idToken, sizeof(idToken));
+  size_t refreshLen = preferences.getString("refresh", refreshToken, sizeof(refreshToken));
+  uint32_t savedAt = preferences.getUInt("saved", 0);
+  preferences.end();
+  if (idLen == 0 || refreshLen == 0) return false;
+  // The clock keeps running through deep sleep but restarts on power loss; in
+  // that case the ID token's age is unknown, so let the refresh token renew it
+  uint32_t now = clockMs() / 1000;
+  uint32_t age = (now >= savedAt) ? now - savedAt : FIREBASE_TOKEN_LIFETIME_S;
+  size_t remaining = (age < FIREBASE_TOKEN_LIFETIME_S) ? FIREBASE_TOKEN_LIFETIME_S - age : 1;
+  Firebase.setIdToken(&config, idToken, remaining, refreshToken);
+  savedTokenCrc = esp_rom_crc32_le(0, (const uint8_t*)idToken, strlen(idToken));
+  return true;
+}
+// Write the current tokens to NVS if the library has refreshed them
+void persistFirebaseToken() {
+  if (lastTokenCheck != 0 && millis() - lastTokenCheck < 10000) return;
+  lastTokenCheck = millis();
+  const char* idToken = config.signer.tokens.id_token.c_str();
+  const char* refreshToken = config.signer.tokens.refresh_token.c_str();
+  if (idToken[0] == 0 || refreshToken[0] == 0) return;
+  uint32_t crc = esp_rom_crc32_le(0, (const uint8_t*)idToken, strlen(idToken));
+  if (crc == savedTokenCrc) return;
+  preferences.begin("fbauth", false);
+  preferences.putString("id", idToken);
+  preferences.putString("refresh", refreshToken);
+  preferences.putUInt("saved", clockMs() / 1000);
+  preferences.end();
+  savedTokenCrc = crc;
+}
+// First time the link comes up: configure the Firebase library and sign in,
+// or pick up the session saved by an earlier boot
+void startFirebase() {
+  config.api_key = FIREBASE_API_KEY;
+  config.database_url = "https://" + String(FIREBASE_PROJECT_ID) + ".firebaseio.com";
+  if (restoreFirebaseToken()) {
+    Serial.println("Reusing saved Firebase session.");
+    Firebase.begin(&config, &auth);
+  } else {
+    Firebase.begin(&config, &auth);
+    Serial.println("Signing in anonymously to Firebase...");
+    if (Firebase.Auth.signInAnonymously(&auth, &config)) {
+      Serial.println("Signed in successfully.");
+    } else {
+      Serial.printf("Firebase Auth Error: %s\n", auth.error.message.c_str());
+    }
+  }
+  firebaseStarted = true;
+}
+// Advance the connection state machine. Never blocks.
+void serviceWifi() {
+  unsigned long now = millis();
+  if (wifiRestartRequested) {
+    wifiRestartRequested = false;
+    rtdbClose();
+    wifiBackoffMs = WIFI_BACKOFF_MIN_MS;
+    wifiStartAttempt();
+    return;
+  }
+  switch (wifiState) {
+    case WIFI_IDLE:
+      wifiStartAttempt();
+      break;
+    case WIFI_STOPPING:
+      if (!wifiStaActive || now - wifiStateSince >= WIFI_STOP_TIMEOUT_MS) {
+        wifiStaActive = false;
+        wifiStartAttempt();
+      }
+      break;
+    case WIFI_CONNECTING:
+      if (wifiGotIp) {
+        wifiState = WIFI_UP;
+        wifiBackoffMs = WIFI_BACKOFF_MIN_MS;
+        Serial.printf("WiFi Connected in %lu ms! IP Address: ", now - wifiStateSince);
+        Serial.println(WiFi.localIP());
+        cacheWifiSession();
+        if (!firebaseStarted) startFirebase();
+        startTimeSync();
+      } else if (wifiAttemptWasFast && (wifiDisconnected || now - wifiStateSince >= WIFI_FAST_ATTEMPT_TIMEOUT_MS)) {
+        Serial.println("Cached AP/lease did not work, scanning instead.");
+        wifiCache.valid = false;
+        wifiStartAttempt();
+      } else if (wifiDisconnected || now - wifiStateSince >= WIFI_ATTEMPT_TIMEOUT_MS) {
+        WiFi.disconnect();
+        wifiState = WIFI_BACKOFF;
+        wifiStateSince = now;
+        Serial.printf("WiFi connect failed, retrying in %lu s\n", wifiBackoffMs / 1000);
+        PERF_COUNT(retries);
+      }
+      break;
+    case WIFI_UP:
+      persistFirebaseToken();
+      if (wifiDisconnected) {
+        Serial.println("WiFi link lost.");
+        rtdbClose();
+        wifiBackoffMs = WIFI_BACKOFF_MIN_MS;
+        wifiState = WIFI_BACKOFF;
+        wifiStateSince = now;
+      }
+      break;
+    case WIFI_BACKOFF:
+      if (now - wifiStateSince >= wifiBackoffMs) {
+        wifiBackoffMs = min(wifiBackoffMs * 2, WIFI_BACKOFF_MAX_MS);
+        wifiStartAttempt();
+      }
+      break;
+  }
+}
+// ============================================================
+
+// ===================== UPLOAD SCHEDULER =====================
+// All uploads share one connection and go out in three lanes, highest first:
+// alerts, then offline log replay, then routine batches. A request that fails
+// in a way worth retrying (no response, timeout, 408/429, 5xx) pauses every
+// lane with exponential backoff. The backoff is jittered so devices that
+// failed together do not retry together, and the lanes resume in priority
+// order once it expires. A 401/403 usually means the ID token has expired or
+// been revoked, so the first one forces a token refresh and the request is
+// retried without a backoff; only if that does not help is it backed off
+// like any other failure. A body too large for the encode buffer or the
+// server (413) is split in halves and the halves sent on their own (see
+// uploadRecordsSplit()). A request the server rejects outright (another 4xx)
+// is dropped rather than retried forever. During a backoff, routine batches
+// collect until full and then move to the offline log.
+// Replay is rate-limited to one batch per LOG_REPLAY_INTERVAL_MS, and only
+// starts a random 0-LOG_REPLAY_JITTER_MS after the link comes up, so a fleet
+// recovering from an outage does not stampede the database with its backlog.
+enum UploadLane { LANE_ALERT, LANE_REPLAY, LANE_ROUTINE, LANE_COUNT };
+const char* LANE_NAMES[LANE_COUNT] = { "Alert", "Replay", "Routine" };
+const unsigned long UPLOAD_BACKOFF_MIN_MS = 2000;
+const unsigned long UPLOAD_BACKOFF_MAX_MS = 300000;
+const unsigned long LOG_REPLAY_INTERVAL_MS = 2000;   // With LOG_REPLAY_BATCH, at most 10 readings/s
+const unsigned long LOG_REPLAY_JITTER_MS = 30000;
+const int ALERT_PENDING_MAX = 8;
+UploadBackoff uploadBackoff;              // Shared by every lane
+uint32_t laneFailures[LANE_COUNT] = {};
+LogRecord pendingAlerts[ALERT_PENDING_MAX];  // Oldest first
+int pendingAlertCount = 0;
+unsigned long replayNextAt = 0;
+bool uploadsWereOnline = false;
+bool tokenRefreshTried = false;           // A 401/403 already forced a refresh since the last success
+
+bool uploadBackingOff() {
+  return uploadBackoff.active(millis());
+}
+// Account for one request of a lane. Returns true if its item is finished
+// with (sent, or rejected for good), false if it should be retried after the
+// backoff this starts.
+bool uploadResult(UploadLane lane, int status) {
+  if (httpOk(status)) {
+    uploadBackoff.succeeded();
+    tokenRefreshTried = false;
+    return true;
+  }
+  laneFailures[lane]++;
+  if ((status == 401 || status == 403) && !tokenRefreshTried) {
+    // Firebase.ready() (see firebaseOnline()) fetches the new token before
+    // the next request goes out
+    tokenRefreshTried = true;
+    Firebase.refreshToken(&config);
+    Serial.printf("%s upload failed: HTTP %d, refreshing the auth token\n", LANE_NAMES[lane], status);
+    return false;
+  }
+  if (!uploadRetryable(status)) {
+    Serial.printf("%s upload rejected: HTTP %d, dropped.\n", LANE_NAMES[lane], status);
+    return true;
+  }
+  unsigned long wait = uploadBackoff.failed(millis(), esp_random(), UPLOAD_BACKOFF_MIN_MS, UPLOAD_BACKOFF_MAX_MS);
+  Serial.printf("%s upload failed: HTTP %d, uploads paused for %lu ms\n", LANE_NAMES[lane], status, wait);
+  return false;
+}
+// Hold a new alert until it can be sent; the oldest goes if too many wait
+void queueAlert(const LogRecord& r) {
+  if (pendingAlertCount == ALERT_PENDING_MAX) {
+    Serial.printf("WARNING: Alert 0x%02lx not delivered, dropped for a newer one.\n",
+                  (unsigned long)pendingAlerts[0].alerts);
+    memmove(pendingAlerts, pendingAlerts + 1, (ALERT_PENDING_MAX - 1) * sizeof(LogRecord));
+    pendingAlertCount--;
+  }
+  pendingAlerts[pendingAlertCount++] = r;
+}
+// One pass over the lanes. Called from the network task loop.
+void serviceUploads() {
+  bool online = firebaseOnline();
+  if (online && !uploadsWereOnline) {
+    replayNextAt = millis() + esp_random() % LOG_REPLAY_JITTER_MS;
+  }
+  uploadsWereOnline = online;
+  bool clear = online && !uploadBackingOff();
+
+  while (clear && pendingAlertCount > 0) {
+    clear = uploadResult(LANE_ALERT, sendAlert(pendingAlerts[0]));
+    if (clear) {
+      memmove(pendingAlerts, pendingAlerts + 1, (pendingAlertCount - 1) * sizeof(LogRecord));
+      pendingAlertCount--;
+    }
+  }
+  if (clear && logPending() > 0 && (long)(millis() - replayNextAt) >= 0) {
+    int status = replayOfflineLog();
+    replayNextAt = millis() + LOG_REPLAY_INTERVAL_MS;
+    if (status != 0) clear = uploadResult(LANE_REPLAY, status);
+  }
+  // Also runs offline or while backing off: a due batch then goes to the log
+  if (uploadBatchDue()) {
+    flushUploadBatch();
+  }
+}
+// ============================================================
+
+// ===================== FIREBASE UPLOAD =====================
+// Live readings are collected into a batch and written together as one
+// multi-path update, so the TLS/HTTP/radio cost is paid once per batch rather
+// than once per sample. A batch is flushed when it holds runtimeConfig.batchSize
+// readings, when its oldest reading is UPLOAD_BATCH_MAX_AGE_MS old, or right
+// away when "Send Data" is chosen from the menu (UploadBatcher in
+// sensor_pipeline.h).
+UploadBatcher<LogRecord, UPLOAD_BATCH_SIZE> uploadBatch;
+
+// Ready to upload: link up, signed in and readings can be keyed by sample time
+bool firebaseOnline() {
+  return wifiState == WIFI_UP && firebaseStarted && Firebase.ready() && timeReadyForUpload();
+}
+// Write a set of readings under this device's readings node in a single
+// multi-path update, keyed by the time each one was taken. Returns the HTTP
+// status, or -1 if no response arrived.
+int uploadRecords(const LogRecord* records, int n) {
+  BufWriter body(uploadBody, sizeof(uploadBody));
+  const char* path = deviceReadingsPath;
+  {
+    PERF_SCOPE(PERF_ENCODE);
+    if (encodeUploadBody<UPLOAD_MAX_RECORDS, UPLOAD_COMPACT>(records, n, VALUE_FORMATS.data(), CHANNEL_COUNT, body)) {
+      path = devicePackedPath;
+    }
+  }
+  if (body.overflow) {
+    Serial.println("ERROR: Upload payload does not fit the encode buffer.");
+    PERF_COUNT(uploadFailures);
+    return 413; // Split by uploadRecordsSplit(); a single reading never fits, so is not retried
+  }
+  Serial.printf("Sending %d reading(s) to %s (%u bytes)\n", n, path, (unsigned)body.len);
+#if UPLOAD_DEBUG_ECHO
+  Serial.print("Data: ");
+  Serial.write((const uint8_t*)body.buf, body.len);
+  Serial.println();
+#endif
+  int status = rtdbPatch(path, body.buf, body.len);
+  if (httpOk(status)) {
+    Serial.println("Realtime Database write successful!");
+    PERF_COUNT(uploads);
+  } else {
+    Serial.printf("Realtime Database write FAILED: HTTP %d\n", status);
+    PERF_COUNT(uploadFailures);
+  }
+  return status;
+}
+// uploadRecords(), halving the readings while the body is too large (413
+// from the encoder or the server). Returns the first failure, or the last
+// status if every part was sent. Readings are keyed by sample time, so when
+// a later part fails and the caller keeps or replays the whole set, the parts
+// already sent are just written again with the same values.
+int uploadRecordsSplit(const LogRecord* records, int n) {
+  int status = uploadRecords(records, n);
+  if (status != 413 || n == 1) return status;
+  int half = n / 2;
+  Serial.printf("Upload of %d readings too large, sending it as %d + %d\n", n, half, n - half);
+  status = uploadRecordsSplit(records, half);
+  if (!httpOk(status)) return status;
+  return uploadRecordsSplit(records + half, n - half);
+}
+bool uploadBatchDue() {
+  return uploadBatch.due(millis(), runtimeConfig.batchSize, UPLOAD_BATCH_MAX_AGE_MS, uploadBackingOff());
+}
+// Send a batch taken from uploadBatch. If it cannot be delivered now its
+// readings go to the offline log instead, for the replay lane to retry.
+void sendUploadBatch(const LogRecord* records, int n) {
+  Serial.println("Attempting to send data to Firebase...");
+  bool keep = true;
+  if (!firebaseOnline()) {
+    Serial.println("Firebase send skipped: WiFi not connected, Firebase not ready or clock not set.");
+  } else if (uploadBackingOff()) {
+    Serial.println("Firebase send skipped: backing off after a failed upload.");
+  } else {
+    int status = uploadRecordsSplit(records, n);
+    keep = !uploadResult(LANE_ROUTINE, status);
+  }
+  if (keep) {
+    for (int i = 0; i < n; i++) {
+      logAppend(records[i]);
+    }
+  }
+}
+// Send the pending batch
+void flushUploadBatch() {
+  uploadBatch.flush(sendUploadBatch);
+}
+// Add a reading to the pending batch
+void batchReading(const SensorSnapshot& s) {
+  uploadBatch.add(recordFromSnapshot(s), millis(), runtimeConfig.batchSize, sendUploadBatch);
+}
+// Send the oldest batch from the offline log as one multi-path update.
+// Returns the HTTP status, or 0 if no request was made.
+int replayOfflineLog() {
+  if (logPending() == 0 || !firebaseOnline()) return 0;
+  LogRecord batch[LOG_REPLAY_BATCH];
+  LogCursor where[LOG_REPLAY_BATCH];
+  int n = logReadBatch(batch, where, LOG_REPLAY_BATCH);
+  if (n == 0) {
+    logMarkSent(where, 0); // Only corrupt records in range, skip past them
+    return 0;
+  }
+  int status = uploadRecordsSplit(batch, n);
+  if (httpOk(status) || !uploadRetryable(status)) {
+    logMarkSent(where, n);
+    Serial.printf("Replayed %d buffered readings, %u still pending.\n", n, (unsigned)logPending());
+  }
+  return status;
+}
+unsigned long lastDiagPublish = 0;
+bool diagPublished = false;
+
+// Overwrite /devices/<id>/diag with the counters and stage timings every DIAG_PUBLISH_MS
+void publishDiagnostics() {
+  if (!firebaseOnline() || uploadBackingOff()) return;
+  if (diagPublished && millis() - lastDiagPublish < DIAG_PUBLISH_MS) return;
+  lastDiagPublish = millis();
+  diagPublished = true;
+
+  BufWriter body(uploadBody, sizeof(uploadBody));
+  body.put("{\"uptime_s\":");
+  body.putUInt(millis() / 1000);
+  body.put(",\"heap\":");
+  body.putUInt(ESP.getFreeHeap());
+  body.put(",\"min_heap\":");
+  body.putUInt(ESP.getMinFreeHeap());
+  body.put(",\"reads\":");
+  body.putUInt(perfCounters.reads);
+  body.put(",\"rejects\":");
+  body.putUInt(perfRejects());
+  body.put(",\"sensor_errors\":");
+  body.putUInt(perfCounters.sensorErrors);
+  body.put(",\"uploads\":");
+  body.putUInt(perfCounters.uploads);
+  body.put(",\"upload_failures\":");
+  body.putUInt(perfCounters.uploadFailures);
+  body.put(",\"retries\":");
+  body.putUInt(perfCounters.retries);
+  body.put(",\"log_pending\":");
+  body.putUInt(logPending());
+  body.put(",\"alerts_pending\":");
+  body.putUInt(pendingAlertCount);
+  body.put(",\"upload_backoff_ms\":");
+  body.putUInt(uploadBackoff.backoffMs);
+  body.put(",\"lane_failures\":[");
+  for (int i = 0; i < LANE_COUNT; i++) {
+    if (i > 0) body.put(',');
+    body.putUInt(laneFailures[i]);
+  }
+  body.put(']');
+  body.put(",\"tls_handshakes\":");
+  body.putUInt(rtdbStats.handshakes);
+  body.put(",\"tls_session_tickets\":");
+  body.put(RTDB_SESSION_TICKETS ? "true" : "false");
+#if PERF_STATS
+  body.put(",\"stages\":{");
+  for (int i = 0; i < PERF_STAGE_COUNT; i++) {
+    const PerfHistogram& h = perfStages[i];
+    if (i > 0) body.put(',');
+    body.put('"');
+    body.put(perfStageNames[i]);
+    body.put("\":{\"n\":");
+    body.putUInt(h.count);
+    body.put(",\"avg_us\":");
+    body.putUInt(h.count ? h.totalUs / h.count : 0);
+    body.put(",\"p90_us\":");
+    body.putUInt(perfPercentileUs(h, 0.9));
+    body.put(",\"max_us\":");
+    body.putUInt(h.maxUs);
+    body.put(",\"avg_cycles\":");
+    body.putUInt(h.count ? h.totalCycles / h.count : 0);
+    body.put(",\"buckets\":[");
+    for (int b = 0; b < PERF_BUCKETS; b++) {
+      if (b > 0) body.put(',');
+      body.putUInt(h.buckets[b]);
+    }
+    body.put("]}");
+  }
+  body.put('}');
+#endif
+  body.put(",\"timestamp\":{\".sv\":\"timestamp\"}}");
+  if (body.overflow) return;
+  int status = rtdbRequest("PUT", deviceDiagPath, "print=silent", body.buf, body.len, NULL);
+  if (status < 200 || status >= 300) Serial.printf("Diagnostics upload FAILED: HTTP %d\n", status);
+}
+// ============================================================
+
+// ===================== REMOTE CONFIG =====================
+// Settings can be pushed to the whole fleet without reflashing. Every
+// CONFIG_POLL_MS the network task reads /fleet/config and then this device's
+// own /devices/<id>/config, whose keys win, e.g.
+//   {"sample_interval_s":30,"heartbeat_s":900,"batch_size":4,"ph_slope":-1.52,"tds_k":0.48}
+// Both are small GETs on the kept-alive connection, each sent with the ETag
+// last applied in If-None-Match, so an unchanged node answers 304 without a
+// body and is not applied again. A changed fleet node is applied under the
+// device node as last applied (deviceConfigApplied): keys the device node
+// sets are skipped, so they still win. Absent keys leave the current value
+// alone. Applied values are saved to NVS, so they hold across reboots.
+const char* FLEET_CONFIG_PATH = "/fleet/config";
+const size_t CONFIG_BODY_MAX = 384;
+char configBody[2][CONFIG_BODY_MAX];       // Responses of the fleet and device node (scratch)
+char deviceConfigApplied[CONFIG_BODY_MAX]; // Device node as last applied
+char configEtag[2][sizeof(rtdbEtag)];      // ETags of the two nodes last applied
+unsigned long lastConfigPoll = 0;
+bool configPolled = false;
+
+// Find "key": in a flat JSON object and return the start of its value, or NULL
+const char* jsonValue(const char* json, const char* key) {
+  char pattern[32];
+  snprintf(pattern, sizeof(pattern), "\"%s\":", key);
+  const char* p = strstr(json, pattern);
+  if (p == NULL) return NULL;
+  p += strlen(pattern);
+  while (*p == ' ') p++;
+  return p;
+}
+// Find "key":<number> in a flat JSON object
+bool jsonNumber(const char* json, const char* key, float& out) {
+  const char* p = jsonValue(json, key);
+  if (p == NULL) return false;
+  char* end;
+  float v = strtof(p, &end);
+  if (end == p || isnan(v) || isinf(v)) return false;
+  out = v;
+  return true;
+}
+// A number from the config unless shadow (a node that takes precedence, or
+// NULL) sets the same key
+bool configNumber(const char* json, const char* shadow, const char* key, float& out) {
+  return (shadow == NULL || jsonValue(shadow, key) == NULL) && jsonNumber(json, key, out);
+}
+// Set a float setting from the config if present. Returns true if it changed.
+bool configFloat(const char* json, const char* shadow, const char* key, float& field, bool positive) {
+  float v;
+  if (!configNumber(json, shadow, key, v) || (positive && v <= 0) || v == field) return false;
+  field = v;
+  return true;
+}
+// Apply one config object, except the keys shadow sets. Sets the flags for
+// whatever it changed.
+void applyConfigJson(const char* json, const char* shadow, bool& runtimeChanged, bool& calibrationChanged) {
+  float v;
+  if (configNumber(json, shadow, "sample_interval_s", v) && v >= 1 && v <= 3600) {
+    uint32_t ms = (uint32_t)(v * 1000);
+    if (ms != runtimeConfig.sampleIntervalMs) {
+      runtimeConfig.sampleIntervalMs = ms;
+      runtimeChanged = true;
+    }
+  }
+  if (configNumber(json, shadow, "heartbeat_s", v) && v >= 10 && v <= 86400) {
+    uint32_t ms = (uint32_t)(v * 1000);
+    if (ms != runtimeConfig.heartbeatMs) {
+      runtimeConfig.heartbeatMs = ms;
+      runtimeChanged = true;
+    }
+  }
+  if (configNumber(json, shadow, "batch_size", v) && v >= 1 && v <= UPLOAD_BATCH_SIZE && (int)v != runtimeConfig.batchSize) {
+    runtimeConfig.batchSize = (int)v;
+    runtimeChanged = true;
+  }
+  // Alert limits, <limitKey>_min and _max per channel (see SENSOR CHANNELS).
+  // A pair that would leave no valid reading is ignored.
+  for (int c = 0; c < CHANNEL_COUNT; c++) {
+    char key[16];
+    if (!limitConfigKey(c, "_min", key, sizeof(key))) continue;
+    float lo = runtimeConfig.limitMin[c];
+    float hi = runtimeConfig.limitMax[c];
+    bool set = false;
+    if (configNumber(json, shadow, key, v) && v != lo) {
+      lo = v;
+      set = true;
+    }
+    limitConfigKey(c, "_max", key, sizeof(key));
+    if (configNumber(json, shadow, key, v) && v > 0 && v != hi) {
+      hi = v;
+      set = true;
+    }
+    if (!set || lo >= hi) continue;
+    runtimeConfig.limitMin[c] = lo;
+    runtimeConfig.limitMax[c] = hi;
+    runtimeChanged = true;
+  }
+  runtimeChanged |= configFloat(json, shadow, "z_threshold", runtimeConfig.zThreshold, true);
+  // A new slope/intercept replaces a multi-point calibration of that probe
+  bool phLinear = configFloat(json, shadow, "ph_slope", ph_slope, false);
+  phLinear |= configFloat(json, shadow, "ph_intercept", ph_intercept, false);
+  const CalCurve linear = {};
+  if (phLinear) storeCalCurve(phCurve, linear);
+  bool turbLinear = configFloat(json, shadow, "turb_slope", turb_slope, false);
+  turbLinear |= configFloat(json, shadow, "turb_intercept", turb_intercept, false);
+  if (turbLinear) storeCalCurve(turbCurve, linear);
+  calibrationChanged |= phLinear || turbLinear;
+  calibrationChanged |= configFloat(json, shadow, "tds_k", tds_k, true);
+}
+// Check the config nodes if a poll is due and apply them if either changed
+void pollRemoteConfig() {
+  if (!firebaseOnline() || uploadBackingOff()) return;
+  if (configPolled && millis() - lastConfigPoll < CONFIG_POLL_MS) return;
+  lastConfigPoll = millis();
+  configPolled = true;
+
+  const char* paths[2] = { FLEET_CONFIG_PATH, deviceConfigPath };
+  bool changed[2];
+  for (int i = 0; i < 2; i++) {
+    BufWriter body(configBody[i], CONFIG_BODY_MAX);
+    int status = rtdbGet(paths[i], body, configEtag[i]);
+    if (status != 200 && status != 304) {
+      Serial.printf("Remote config poll FAILED: HTTP %d\n", status);
+      return;
+    }
+    if (status == 200 && body.overflow) {
+      Serial.println("WARNING: Remote config too large, ignored.");
+      return;
+    }
+    changed[i] = status == 200 && (rtdbEtag[0] == 0 || strcmp(rtdbEtag, configEtag[i]) != 0);
+    if (changed[i]) strlcpy(configEtag[i], rtdbEtag, sizeof(configEtag[i]));
+  }
+  if (!changed[0] && !changed[1]) return;
+
+  bool runtimeChanged = false;
+  bool calibrationChanged = false;
+  if (changed[1]) strlcpy(deviceConfigApplied, configBody[1], sizeof(deviceConfigApplied));
+  if (changed[0]) applyConfigJson(configBody[0], deviceConfigApplied, runtimeChanged, calibrationChanged);
+  if (changed[1]) applyConfigJson(deviceConfigApplied, NULL, runtimeChanged, calibrationChanged);
+  if (runtimeChanged || calibrationChanged) saveSettings();
+  if (runtimeChanged || calibrationChanged) {
+    Serial.printf("Remote config applied: sample every %u s, heartbeat %u s, batch %d, pH %.3f/%.3f, turb %.3f/%.3f, tds_k %.3f\n",
+                  (unsigned)(runtimeConfig.sampleIntervalMs / 1000), (unsigned)(runtimeConfig.heartbeatMs / 1000), runtimeConfig.batchSize, ph_slope, ph_intercept,
+                  turb_slope, turb_intercept, tds_k);
+  }
+}
+// ============================================================
+
+// ===================== BURST CAPTURE =====================
+// For contamination events one filtered reading a second is too coarse. A
+// burst capture decimates the continuous ADC stream to 10-500 frames a second
+// for up to a minute, straight into a frame buffer (PSRAM when the board has
+// it), bypassing the median/EMA filters so the trace shows what the probes
+// actually did. Once it is full the network task uploads it under
+// /devices/<id>/bursts/<start ms>: the packed trace in chunks at trace/<i>
+// (see BURST TRACES in sensor_pipeline.h), then the summary with min, max,
+// mean and standard deviation per channel for every window_s sub-window.
+// Captures start from the "burst" remote command, and on a new alert when
+// BURST_ON_ALERT_S is set. There is one capture at a time; its buffer is
+// freed once uploaded.
+const float CAPTURE_MIN_HZ = 10;
+const float CAPTURE_MAX_HZ = 500;
+const float CAPTURE_MAX_S = 60;
+const uint32_t CAPTURE_MAX_WINDOWS = 60;           // Bounds the summary size
+const size_t CAPTURE_INTERNAL_MAX_BYTES = 24576;   // Largest buffer taken from internal RAM without PSRAM
+const int CAPTURE_CHUNK_FRAMES = 400;              // Frames per uploaded trace chunk
+const size_t CAPTURE_BODY_MAX = 8192;              // Request body for a chunk or the summary
+const unsigned long CAPTURE_STALL_MS = 5000;       // Grace past the expected end before a capture is cut short
+const unsigned long CAPTURE_RETRY_MS = 30000;
+const int CAPTURE_MAX_ATTEMPTS = 5;
+struct CaptureAccum {
+  uint32_t sum;       // Raw samples in the current frame
+  uint16_t count;
+  uint32_t frames;    // Frames completed for the channel
+};
+CaptureAccum captureAccum[ADC_CHANNEL_COUNT];
+int16_t* captureBuf = NULL;        // captureFrames x ADC_CHANNEL_COUNT; non-NULL from start until uploaded
+uint32_t captureFrames = 0;
+uint32_t captureWindowFrames = 0;
+uint16_t captureDecimate = 1;      // Raw samples averaged into one frame of a channel
+float captureHz = 0;               // Actual frame rate after rounding the decimation
+float captureTempC = 25.0;         // Compensation temperature for the whole capture
+uint64_t captureStartMs = 0;       // Epoch ms of the first frame
+unsigned long captureStartedAt = 0;
+const char* captureTrigger = "";
+bool captureInPsram = false;
+int captureAttempts = 0;
+unsigned long lastCaptureAttempt = 0;
+volatile bool captureAlertRequested = false;  // Set by the acquisition task on a new alert
+
+// Called by serviceAdc() for every raw sample of channel c while a capture runs
+void captureAdcSample(int c, uint16_t raw) {
+  CaptureAccum& a = captureAccum[c];
+  if (a.frames >= captureFrames) return;
+  a.sum += raw;
+  if (++a.count < captureDecimate) return;
+  const SensorChannel& ch = SENSOR_CHANNELS[ANALOG_INDEX[c]];
+  float value = ch.convert(adcRawToVolts(a.sum / a.count), captureTempC);
+  captureBuf[a.frames * ADC_CHANNEL_COUNT + c] = toFixed16(value, ch.format.scale);
+  a.sum = 0;
+  a.count = 0;
+  if (++a.frames < captureFrames) return;
+  for (int i = 0; i < ADC_CHANNEL_COUNT; i++) {
+    if (captureAccum[i].frames < captureFrames) return;
+  }
+  captureState.store(CAPTURE_STOPPING, std::memory_order_release); // Handed over at the end of this pass
+}
+// Frames every channel has filled
+uint32_t captureFramesDone() {
+  uint32_t n = captureFrames;
+  for (int c = 0; c < ADC_CHANNEL_COUNT; c++) {
+    n = min(n, captureAccum[c].frames);
+  }
+  return n;
+}
+void freeCapture() {
+  heap_caps_free(captureBuf);
+  captureBuf = NULL;
+}
+// Start a capture of seconds at hz frames a second. Network task only.
+// Returns the status reported to a remote command.
+const char* startCapture(float seconds, float hz, float windowS, const char* trigger) {
+  if (!adcContinuousActive) return "unsupported";
+  if (captureBuf != NULL) return "busy";
+  if (!timeSynced()) return "no_clock";
+  if (seconds <= 0 || seconds > CAPTURE_MAX_S || hz < CAPTURE_MIN_HZ || hz > CAPTURE_MAX_HZ || windowS <= 0 ||
+      windowS > seconds) {
+    return "bad_args";
+  }
+  float channelHz = (float)ADC_SAMPLE_RATE_HZ / ADC_CHANNEL_COUNT;
+  captureDecimate = max(1L, lroundf(channelHz / hz));
+  captureHz = channelHz / captureDecimate;
+  captureFrames = max(1UL, (unsigned long)(seconds * captureHz));
+  captureWindowFrames = max(1L, lroundf(windowS * captureHz));
+  if ((captureFrames + captureWindowFrames - 1) / captureWindowFrames > CAPTURE_MAX_WINDOWS) return "bad_args";
+  size_t bytes = (size_t)captureFrames * ADC_CHANNEL_COUNT * sizeof(int16_t);
+  captureBuf = (int16_t*)heap_caps_malloc(bytes, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+  captureInPsram = captureBuf != NULL;
+  if (captureBuf == NULL && bytes <= CAPTURE_INTERNAL_MAX_BYTES) {
+    captureBuf = (int16_t*)heap_caps_malloc(bytes, MALLOC_CAP_8BIT);
+  }
+  if (captureBuf == NULL) return "no_memory";
+  for (int c = 0; c < ADC_CHANNEL_COUNT; c++) {
+    captureAccum[c] = {};
+  }
+  captureTempC = lastTempC;
+  captureTrigger = trigger;
+  captureAttempts = 0;
+  lastCaptureAttempt = 0;
+  captureStartMs = clockMs();
+  captureStartedAt = millis();
+  captureState.store(CAPTURE_RUNNING, std::memory_order_release); // The acquisition task keeps the ADC running meanwhile
+  xTaskNotify(acqTaskHandle, ACQ_WAKE_CAPTURE, eSetBits);
+  Serial.printf("Burst capture (%s): %u frames at %.1f Hz, %u bytes in %s\n", trigger, (unsigned)captureFrames, captureHz,
+                (unsigned)bytes, captureInPsram ? "PSRAM" : "RAM");
+  return "ok";
+}
+// Upload the finished capture: trace chunks first, then the summary, whose
+// "chunks" field tells a reader the trace is complete. Every request is a
+// PUT or PATCH of fixed content, so a failed upload is simply repeated.
+bool uploadCapture() {
+  size_t packedMax = traceChunkMax(ADC_CHANNEL_COUNT, CAPTURE_CHUNK_FRAMES);
+  char* body = (char*)heap_caps_malloc(CAPTURE_BODY_MAX + packedMax, MALLOC_CAP_8BIT);
+  if (body == NULL) return false;
+  uint8_t* packed = (uint8_t*)body + CAPTURE_BODY_MAX;
+  uint32_t frames = captureFramesDone();
+  int chunks = (frames + CAPTURE_CHUNK_FRAMES - 1) / CAPTURE_CHUNK_FRAMES;
+  char path[80];
+  BufWriter base(path, sizeof(path));
+  base.put(deviceBurstsPath);
+  base.put('/');
+  base.putUInt(captureStartMs);
+  bool ok = true;
+  for (int i = 0; ok && i < chunks; i++) {
+    uint32_t first = i * CAPTURE_CHUNK_FRAMES;
+    int n = min((uint32_t)CAPTURE_CHUNK_FRAMES, frames - first);
+    size_t len = encodeTraceChunk(captureBuf + first * ADC_CHANNEL_COUNT, ADC_CHANNEL_COUNT, n, packed, packedMax);
+    BufWriter w(body, CAPTURE_BODY_MAX);
+    w.put('"');
+    w.putBase64(packed, len);
+    w.put('"');
+    char chunkPath[96];
+    BufWriter p(chunkPath, sizeof(chunkPath));
+    p.put(path);
+    p.put("/trace/");
+    p.putUInt(i);
+    int status = w.overflow || p.overflow ? -1 : rtdbRequest("PUT", chunkPath, "print=silent", w.buf, w.len, NULL);
+    ok = status >= 200 && status < 300;
+  }
+  if (ok) {
+    BufWriter w(body, CAPTURE_BODY_MAX);
+    w.put("{\"hz\":");
+    w.putFixed(captureHz, 2);
+    w.put(",\"frames\":");
+    w.putUInt(frames);
+    w.put(",\"window_frames\":");
+    w.putUInt(captureWindowFrames);
+    w.put(",\"chunks\":");
+    w.putUInt(chunks);
+    w.put(",\"trigger\":\"");
+    w.put(captureTrigger);
+    w.put("\",\"t\":");
+    w.putFixed(captureTempC, 2);
+    // Trace channel order, so the dashboard needs no copy of the table
+    w.put(",\"keys\":[");
+    for (int c = 0; c < ADC_CHANNEL_COUNT; c++) {
+      w.put(c ? ",\"" : "\"");
+      w.put(SENSOR_CHANNELS[ANALOG_INDEX[c]].format.key);
+      w.put('"');
+    }
+    w.put("],\"scale\":{");
+    for (int c = 0; c < ADC_CHANNEL_COUNT; c++) {
+      w.put(c ? ",\"" : "\"");
+      w.put(SENSOR_CHANNELS[ANALOG_INDEX[c]].format.key);
+      w.put("\":");
+      w.putUInt((uint64_t)SENSOR_CHANNELS[ANALOG_INDEX[c]].format.scale);
+    }
+    // Per channel, one [min, max, mean, sd] per window
+    w.put("},\"windows\":{");
+    for (int c = 0; c < ADC_CHANNEL_COUNT; c++) {
+      const ValueFormat& f = SENSOR_CHANNELS[ANALOG_INDEX[c]].format;
+      int decimals = f.scale >= 100 ? 2 : 1;
+      w.put(c ? ",\"" : "\"");
+      w.put(f.key);
+      w.put("\":[");
+      for (uint32_t start = 0; start < frames; start += captureWindowFrames) {
+        SpanStats s;
+        for (uint32_t i = start; i < frames && i < start + captureWindowFrames; i++) {
+          s.add(captureBuf[i * ADC_CHANNEL_COUNT + c] / f.scale);
+        }
+        w.put(start ? ",[" : "[");
+        w.putFixed(s.min, decimals);
+        w.put(',');
+        w.putFixed(s.max, decimals);
+        w.put(',');
+        w.putFixed(s.mean, decimals + 1);
+        w.put(',');
+        w.putFixed(s.stddev(), decimals + 1);
+        w.put(']');
+      }
+      w.put(']');
+    }
+    w.put("},\"timestamp\":{\".sv\":\"timestamp\"}}");
+    int status = w.overflow ? -1 : rtdbRequest("PATCH", path, "print=silent", w.buf, w.len, NULL);
+    ok = status >= 200 && status < 300;
+    if (w.overflow) Serial.println("WARNING: Burst summary too large.");
+  }
+  heap_caps_free(body);
+  return ok;
+}
+// Start alert-triggered captures, cut short a stalled one and upload a
+// finished one. Called from the network task loop.
+void serviceCapture() {
+  if (captureAlertRequested) {
+    captureAlertRequested = false;
+    startCapture(BURST_ON_ALERT_S, BURST_DEFAULT_HZ, 1, "alert"); // Ignored if one is already running
+  }
+  if (captureBuf == NULL) return;
+  if (captureState.load(std::memory_order_acquire) == CAPTURE_RUNNING) {
+    if (millis() - captureStartedAt < captureFrames / captureHz * 1000 + CAPTURE_STALL_MS) return;
+    uint8_t running = CAPTURE_RUNNING; // Unless it filled up meanwhile
+    if (captureState.compare_exchange_strong(running, CAPTURE_STOPPING, std::memory_order_acq_rel)) {
+      Serial.println("WARNING: Burst capture stalled, keeping the frames taken so far.");
+    }
+  }
+  // Until serviceAdc() hands the buffer over; it notifies this task when it does
+  if (captureState.load(std::memory_order_acquire) != CAPTURE_STOPPED) return;
+  if (!firebaseOnline() || uploadBackingOff()) return;
+  if (lastCaptureAttempt != 0 && millis() - lastCaptureAttempt < CAPTURE_RETRY_MS) return;
+  lastCaptureAttempt = millis();
+  if (uploadCapture()) {
+    Serial.printf("Burst capture uploaded, %u frames.\n", (unsigned)captureFramesDone());
+    freeCapture();
+  } else if (++captureAttempts >= CAPTURE_MAX_ATTEMPTS) {
+    Serial.println("Burst capture upload FAILED, dropped.");
+    freeCapture();
+  }
+}
+// ============================================================
+
+// ===================== REMOTE COMMANDS =====================
+// Operators send one command at a time by setting /devices/<id>/command:
+//   {"cmd":"sample","ts":{".sv":"timestamp"}}                 take and upload a reading now
+//   {"cmd":"live","minutes":5,"interval_s":1,"ts":{...}}      upload a reading every interval_s for a while
+//   {"cmd":"stop","ts":{...}}                                 end live mode early
+//   {"cmd":"flush","ts":{...}}                                send the batch and offline log now
+//   {"cmd":"config","ts":{...}}                               re-read and re-apply the remote config
+//   {"cmd":"burst","seconds":30,"hz":100,"window_s":1,"ts":{...}}  high-rate capture (see BURST CAPTURE)
+// The node is held open as a Firebase stream, so a command arrives as soon as
+// it is written instead of at the next poll. The stream callback runs in the
+// library's own task; it only parses the command into commandQueue and wakes
+// the network task, which runs it and writes the outcome to
+// /devices/<id>/command_ack. "ts" identifies a command: the stream repeats
+// the node's current value whenever it reconnects, and a command already
+// handled, or older than COMMAND_MAX_AGE_MS, is not run again.
+// An idle stream only costs the server's keep-alive event every ~30 s. TCP
+// keepalive stays off so the radio is not woken for probes as well; a stream
+// that misses two server keep-alives is reconnected by the library.
+const unsigned long COMMAND_MAX_AGE_MS = 120000;
+const unsigned long COMMAND_STREAM_RETRY_MS = 10000;
+const int COMMAND_STREAM_TIMEOUT_MS = 75000;
+const int COMMAND_QUEUE_LEN = 4;
+const float LIVE_MAX_MINUTES = 60;
+enum CommandType { CMD_SAMPLE, CMD_LIVE, CMD_STOP, CMD_FLUSH, CMD_CONFIG, CMD_BURST, CMD_UNKNOWN };
+const char* COMMAND_NAMES[] = { "sample", "live", "stop", "flush", "config", "burst" };
+struct RemoteCommand {
+  CommandType type;
+  uint64_t ts;          // Server time the command was written, epoch ms
+  float minutes;        // live
+  float intervalS;      // live
+  float seconds;        // burst
+  float hz;             // burst
+  float windowS;        // burst
+};
+FirebaseData commandStream;
+QueueHandle_t commandQueue = NULL;
+bool commandStreamStarted = false;
+unsigned long lastCommandStreamAttempt = 0;
+RTC_DATA_ATTR uint64_t lastCommandTs = 0;    // Kept through deep sleep so a wake does not repeat it
+volatile unsigned long liveStartedAt = 0;
+volatile unsigned long liveLengthMs = 0;     // 0 = live mode off
+volatile unsigned long liveEveryMs = 1000;
+
+// True while a "live" command is uploading every reading
+bool liveActive(unsigned long now) {
+  return liveLengthMs > 0 && now - liveStartedAt < liveLengthMs;
+}
+bool parseCommand(const char* json, RemoteCommand& c) {
+  const char* name = jsonValue(json, "cmd");
+  const char* ts = jsonValue(json, "ts");
+  if (name == NULL || *name != '"' || ts == NULL) return false;
+  name++;
+  c.ts = strtoull(ts, NULL, 10);
+  if (c.ts == 0) return false;
+  c.type = CMD_UNKNOWN;
+  for (int i = 0; i < CMD_UNKNOWN; i++) {
+    size_t n = strlen(COMMAND_NAMES[i]);
+    if (strncmp(name, COMMAND_NAMES[i], n) == 0 && name[n] == '"') c.type = (CommandType)i;
+  }
+  c.minutes = 5;
+  c.intervalS = 1;
+  jsonNumber(json, "minutes", c.minutes);
+  jsonNumber(json, "interval_s", c.intervalS);
+  c.seconds = 30;
+  c.hz = BURST_DEFAULT_HZ;
+  c.windowS = 1;
+  jsonNumber(json, "seconds", c.seconds);
+  jsonNumber(json, "hz", c.hz);
+  jsonNumber(json, "window_s", c.windowS);
+  return true;
+}
+// Runs in the Firebase stream task
+void onCommandEvent(StreamData data) {
+  // Only a write of the whole node carries a command; deletes come as null
+  if (strcmp(data.dataPath().c_str(), "/") != 0 || strcmp(data.dataType().c_str(), "json") != 0) return;
+  RemoteCommand c;
+  if (!parseCommand(data.jsonString().c_str(), c)) return;
+  if (xQueueSend(commandQueue, &c, 0) == pdTRUE) xTaskNotifyGive(netTaskHandle);
+}
+void onCommandTimeout(bool timedOut) {
+  if (timedOut) Serial.println("Command stream timed out, reconnecting.");
+}
+// Act on one command. Returns the status written to the ack node.
+const char* runCommand(const RemoteCommand& c) {
+  switch (c.type) {
+    case CMD_SAMPLE:
+      if (!dutyCycleActive) requestUpload(); // A sleep sampling wake has just taken and sent one
+      return "ok";
+    case CMD_LIVE:
+      if (dutyCycleActive) return "asleep";
+      if (c.minutes <= 0 || c.minutes > LIVE_MAX_MINUTES || c.intervalS < 1 || c.intervalS > 60) return "bad_args";
+      liveEveryMs = (unsigned long)(c.intervalS * 1000);
+      liveStartedAt = millis();
+      liveLengthMs = (unsigned long)(c.minutes * 60000);
+      requestUpload();
+      return "ok";
+    case CMD_STOP:
+      liveLengthMs = 0;
+      return "ok";
+    case CMD_FLUSH:
+      uploadBatch.flushRequested = true; // The offline log drains on every network task pass anyway
+      return "ok";
+    case CMD_CONFIG:
+      configPolled = false;
+      configEtag[0][0] = configEtag[1][0] = 0; // Re-apply even if neither node changed
+      return "ok";
+    case CMD_BURST:
+      if (dutyCycleActive) return "asleep";
+      return startCapture(c.seconds, c.hz, c.windowS, "command");
+    default:
+      return "unknown";
+  }
+}
+void ackCommand(const RemoteCommand& c, const char* status) {
+  BufWriter body(uploadBody, sizeof(uploadBody));
+  body.put("{\"ts\":");
+  body.putUInt(c.ts);
+  body.put(",\"cmd\":\"");
+  body.put(c.type == CMD_UNKNOWN ? "?" : COMMAND_NAMES[c.type]);
+  body.put("\",\"status\":\"");
+  body.put(status);
+  body.put("\",\"at\":{\".sv\":\"timestamp\"}}");
+  int http = rtdbRequest("PUT", deviceCommandAckPath, "print=silent", body.buf, body.len, NULL);
+  if (http < 200 || http >= 300) Serial.printf("Command ack FAILED: HTTP %d\n", http);
+}
+void handleCommand(const RemoteCommand& c) {
+  if (c.ts <= lastCommandTs) return; // Replayed on reconnect
+  lastCommandTs = c.ts;
+  if (timeSynced() && clockMs() > c.ts + COMMAND_MAX_AGE_MS) {
+    Serial.println("Ignoring stale remote command.");
+    return;
+  }
+  const char* status = runCommand(c);
+  Serial.printf("Remote command %s: %s\n", c.type == CMD_UNKNOWN ? "?" : COMMAND_NAMES[c.type], status);
+  ackCommand(c, status);
+}
+// Open the command stream once Firebase is up, and run queued commands.
+// Called from the network task loop.
+void serviceCommands() {
+#if REMOTE_COMMANDS
+  if (!commandStreamStarted && firebaseOnline() &&
+      (lastCommandStreamAttempt == 0 || millis() - lastCommandStreamAttempt >= COMMAND_STREAM_RETRY_MS)) {
+    lastCommandStreamAttempt = millis();
+    config.timeout.rtdbKeepAlive = COMMAND_STREAM_TIMEOUT_MS;
+    config.timeout.rtdbStreamReconnect = COMMAND_STREAM_RETRY_MS;
+    if (Firebase.beginStream(commandStream, deviceCommandPath)) {
+      Firebase.setStreamCallback(commandStream, onCommandEvent, onCommandTimeout);
+      commandStreamStarted = true;
+    } else {
+      Serial.printf("Command stream FAILED: %s\n", commandStream.errorReason().c_str());
+    }
+  }
+  RemoteCommand c;
+  while (xQueueReceive(commandQueue, &c, 0) == pdTRUE) {
+    handleCommand(c);
+  }
+#endif
+}
+// Sleep sampling keeps no stream open; a flush wake reads the node once instead
+void pollCommandOnce() {
+#if REMOTE_COMMANDS
+  if (!firebaseOnline()) return;
+  BufWriter body(configBody[1], CONFIG_BODY_MAX);
+  if (rtdbGet(deviceCommandPath, body) != 200 || body.overflow) return;
+  RemoteCommand c;
+  if (parseCommand(body.buf, c)) handleCommand(c);
+#endif
+}
+// ============================================================
+
+// ===================== BUTTON INPUT =====================
+// Each button pin is armed for a level interrupt at the opposite of its
+// debounced state, since only level interrupts can wake the chip from light
+// sleep. The ISR disarms the pin, timestamps the edge and queues it, so no
+// press is missed while the UI task is busy.
+// The UI task sleeps on that queue and runs a small state machine per button:
+// an edge (re)starts a BUTTON_DEBOUNCE_MS settle timer, after which the pin
+// level decides whether a press or release happened. A button held for
+// BUTTON_LONG_MS yields a long-press event, then repeats every
+// BUTTON_REPEAT_MS until it is released.
+enum ButtonId { BUTTON_UP, BUTTON_DOWN, BUTTON_SELECT, BUTTON_BACK, BUTTON_COUNT };
+enum ButtonEventType { BUTTON_PRESS, BUTTON_LONG, BUTTON_REPEAT, BUTTON_RELEASE };
+const int buttonPins[BUTTON_COUNT] = { BTN_UP, BTN_DOWN, BTN_SELECT, BTN_BACK };
+const uint8_t BUTTON_WAKE = 0xFF;                 // Queue entry that only wakes the UI task
+const unsigned long BUTTON_DEBOUNCE_MS = 30;
+const unsigned long BUTTON_LONG_MS = 700;
+const unsigned long BUTTON_REPEAT_MS = 200;
+const int BUTTON_QUEUE_LEN = 16;
+
+struct ButtonEdge {
+  uint8_t button;        // ButtonId, or BUTTON_WAKE
+  uint32_t atMs;         // millis() at the edge
+};
+struct ButtonState {
+  bool pressed;          // Debounced state
+  bool settling;         // Edge seen, waiting for the level to settle
+  bool longSent;
+  uint32_t settleAt;
+  uint32_t pressedAt;
+  uint32_t nextRepeatAt;
+};
+ButtonState buttonStates[BUTTON_COUNT] = {};
+QueueHandle_t buttonQueue = NULL;
+
+void handleMenu(int button, ButtonEventType type); // See MENU HANDLING
+
+// The ISR service is installed without ESP_INTR_FLAG_IRAM, so the handler may
+// call gpio_intr_disable() from flash
+void IRAM_ATTR onButtonEdge(void* arg) {
+  uint8_t button = (uint8_t)(uintptr_t)arg;
+  gpio_intr_disable((gpio_num_t)buttonPins[button]); // A held level would fire again at once
+  ButtonEdge e = { button, (uint32_t)millis() };
+  BaseType_t woken = pdFALSE;
+  xQueueSendFromISR(buttonQueue, &e, &woken);
+  portYIELD_FROM_ISR(woken);
+}
+// Interrupt (and light sleep wakeup) on the level that ends the debounced state
+void armButton(int button, bool pressed) {
+  gpio_num_t pin = (gpio_num_t)buttonPins[button];
+  gpio_int_type_t level = pressed ? GPIO_INTR_HIGH_LEVEL : GPIO_INTR_LOW_LEVEL;
+  if (pmLightSleep) {
+    gpio_wakeup_enable(pin, level); // Also sets the interrupt type
+  } else {
+    gpio_set_intr_type(pin, level);
+  }
+  gpio_intr_enable(pin);
+}
+void initButtons() {
+  buttonQueue = xQueueCreate(BUTTON_QUEUE_LEN, sizeof(ButtonEdge));
+  esp_err_t err = gpio_install_isr_service(0);
+  if (err != ESP_OK && err != ESP_ERR_INVALID_STATE) { // Already installed is fine
+    Serial.printf("WARNING: Button interrupts unavailable (%s).\n", esp_err_to_name(err));
+    return;
+  }
+  for (int i = 0; i < BUTTON_COUNT; i++) {
+    // A button still held from a SELECT wake counts as already pressed
+    buttonStates[i].pressed = digitalRead(buttonPins[i]) == LOW;
+    buttonStates[i].longSent = true;
+    gpio_isr_handler_add((gpio_num_t)buttonPins[i], onButtonEdge, (void*)(uintptr_t)i);
+    armButton(i, buttonStates[i].pressed);
+  }
+}
+// Get the UI task to run its loop now (e.g. to show an alert)
+void wakeUi() {
+  ButtonEdge e = { BUTTON_WAKE, (uint32_t)millis() };
+  if (buttonQueue != NULL) xQueueSendToBack(buttonQueue, &e, 0);
+}
+void noteButtonEdge(const ButtonEdge& e) {
+  if (e.button >= BUTTON_COUNT) return;
+  buttonStates[e.button].settling = true;
+  buttonStates[e.button].settleAt = e.atMs + BUTTON_DEBOUNCE_MS;
+}
+// How long the UI task may sleep before a button timer is due (capped at maxMs)
+unsigned long buttonWaitMs(unsigned long maxMs) {
+  uint32_t now = millis();
+  unsigned long wait = maxMs;
+  for (int i = 0; i < BUTTON_COUNT; i++) {
+    const ButtonState& b = buttonStates[i];
+    uint32_t due;
+    if (b.settling) {
+      due = b.settleAt;
+    } else if (b.pressed) {
+      due = b.longSent ? b.nextRepeatAt : b.pressedAt + BUTTON_LONG_MS;
+    } else {
+      continue;
+    }
+    int32_t left = (int32_t)(due - now);
+    wait = min(wait, (unsigned long)max(left, (int32_t)0));
+  }
+  return wait;
+}
+// Run the per-button timers and hand every resulting event to handleMenu()
+void serviceButtons() {
+  uint32_t now = millis();
+  for (int i = 0; i < BUTTON_COUNT; i++) {
+    ButtonState& b = buttonStates[i];
+    if (b.settling && (int32_t)(now - b.settleAt) >= 0) {
+      b.settling = false;
+      bool level = digitalRead(buttonPins[i]) == LOW;
+      bool changed = level != b.pressed;
+      b.pressed = level;
+      armButton(i, level);
+      if (changed) {
+        if (level) {
+          b.pressedAt = now;
+          b.longSent = false;
+        }
+        wakeLCD();
+        handleMenu(i, level ? BUTTON_PRESS : BUTTON_RELEASE);
+      }
+    }
+    if (b.pressed && !b.settling) {
+      if (!b.longSent && now - b.pressedAt >= BUTTON_LONG_MS) {
+        b.longSent = true;
+        b.nextRepeatAt = now + BUTTON_REPEAT_MS;
+        handleMenu(i, BUTTON_LONG);
+      } else if (b.longSent && (int32_t)(now - b.nextRepeatAt) >= 0) {
+        b.nextRepeatAt += BUTTON_REPEAT_MS;
+        handleMenu(i, BUTTON_REPEAT);
+      }
+    }
+  }
+}
+// ============================================================
+
+// ===================== CALIBRATION WORKFLOW =====================
+// Calibrate menu: pick a probe (a CAL_CURVE entry of SENSOR_CHANNELS), then
+// dip it in each standard in turn and press SELECT once the voltage shown has
+// settled. BACK after two or more points skips the rest. With three points
+// UP/DOWN choose between a piecewise-linear and a quadratic fit; SELECT fits,
+// applies and saves it. pH buffers are entered as what a compensated reading
+// at the current temperature should show, so the curve itself stays
+// referenced to 25 C.
+enum CalStep { CAL_CHOOSE, CAL_CAPTURE, CAL_FIT };
+CalStep calStep = CAL_CHOOSE;
+int calProbe = 0;                  // Index into CAL_PROBES
+int calPoints = 0;                 // Points captured so far
+float calVolts[CAL_MAX_POINTS];
+float calValues[CAL_MAX_POINTS];
+CurveModel calModel = CURVE_PIECEWISE;
+
+// Index of the filter (and channelVolts entry) behind a channel
+int analogSlot(int channel) {
+  for (int i = 0; i < ANALOG_CHANNEL_COUNT; i++) {
+    if (ANALOG_INDEX[i] == channel) return i;
+  }
+  return 0;
+}
+void startCalibration() {
+  calStep = CAL_CHOOSE;
+  calPoints = 0;
+  openLiveView(MENU_CALIBRATE);
+}
+// Live view of the current step; the capture screen shows the probe voltage
+void displayCalibration() {
+  const SensorChannel& p = SENSOR_CHANNELS[CAL_PROBES[calProbe]];
+  char top[LCD_COLS + 1];
+  char bottom[LCD_COLS + 1];
+  if (calStep == CAL_CHOOSE) {
+    snprintf(top, sizeof(top), "Calibrate:");
+    snprintf(bottom, sizeof(bottom), "> %s", p.name);
+  } else if (calStep == CAL_CAPTURE) {
+    snprintf(top, sizeof(top), "%d/%d %s %.2f", calPoints + 1, p.standardCount, p.label, p.standards[calPoints]);
+    float v = channelVolts[analogSlot(CAL_PROBES[calProbe])];
+    if (v < 0) {
+      snprintf(bottom, sizeof(bottom), "No signal");
+    } else {
+      snprintf(bottom, sizeof(bottom), "%.3fV SEL=take", v);
+    }
+  } else {
+    const char* fit = calPoints < 3 ? "linear" : calModel == CURVE_QUADRATIC ? "quadratic" : "piecewise";
+    snprintf(top, sizeof(top), "Fit: %s", fit);
+    snprintf(bottom, sizeof(bottom), "SEL=save BACK=x");
+  }
+  lcdShow(top, bottom);
+}
+// Fit the captured points and make the curve live
+void finishCalibration() {
+  const SensorChannel& p = SENSOR_CHANNELS[CAL_PROBES[calProbe]];
+  CalCurve fitted;
+  if (!fitCalCurve(calVolts, calValues, calPoints, calModel, fitted)) {
+    // A quadratic is also refused if it is not monotonic between the points;
+    // if a piecewise fit of the same points works, that was the reason
+    CalCurve piecewise;
+    bool spacingOk = fitCalCurve(calVolts, calValues, calPoints, CURVE_PIECEWISE, piecewise);
+    displayMessage("Cal failed:", spacingOk ? "use piecewise" : "points too close");
+    displayMenu();
+    return;
+  }
+  storeCalCurve(*p.curve, fitted);
+  saveSettings();
+  Serial.printf("%s calibrated from %d points (%s)\n", p.name, calPoints,
+                fitted.model == CURVE_QUADRATIC ? "quadratic" : "piecewise linear");
+  displayMessage("Calibration", "saved");
+  displayMenu();
+}
+void handleCalibration(int button, ButtonEventType type) {
+  if (type != BUTTON_PRESS) return;
+  const SensorChannel& p = SENSOR_CHANNELS[CAL_PROBES[calProbe]];
+  if (calStep == CAL_CHOOSE) {
+    if (button == BUTTON_UP || button == BUTTON_DOWN) {
+      calProbe = (calProbe + 1) % CAL_PROBE_COUNT;
+    } else if (button == BUTTON_SELECT) {
+      calStep = CAL_CAPTURE;
+      calPoints = 0;
+    } else if (button == BUTTON_BACK) {
+      displayMenu();
+      return;
+    }
+  } else if (calStep == CAL_CAPTURE) {
+    if (button == BUTTON_SELECT) {
+      float v = channelVolts[analogSlot(CAL_PROBES[calProbe])];
+      if (v < 0) return;
+      float value = p.standards[calPoints];
+      SensorSnapshot s;
+      if (p.uncompensate && getLatestSnapshot(s) && s.value[TEMP_CHANNEL] >= 0) {
+        value = p.uncompensate(value, s.value[TEMP_CHANNEL]); // The curve is fitted to 25 C values
+      }
+      calVolts[calPoints] = v;
+      calValues[calPoints] = value;
+      calPoints++;
+      if (calPoints >= p.standardCount) calStep = CAL_FIT;
+    } else if (button == BUTTON_BACK) {
+      if (calPoints < 2) {
+        displayMenu();
+        return;
+      }
+      calStep = CAL_FIT;
+    }
+  } else {
+    if ((button == BUTTON_UP || button == BUTTON_DOWN) && calPoints >= 3) {
+      calModel = calModel == CURVE_QUADRATIC ? CURVE_PIECEWISE : CURVE_QUADRATIC;
+    } else if (button == BUTTON_SELECT) {
+      finishCalibration();
+      return;
+    } else if (button == BUTTON_BACK) {
+      displayMenu();
+      return;
+    }
+  }
+  openLiveView(MENU_CALIBRATE);
+}
+// ============================================================
+
+// ===================== MENU HANDLING =====================
+// Act on one button event. UP/DOWN step on a press and keep stepping while
+// held (through the pages in the Stats view); SELECT and BACK act on the press.
+void handleMenu(int button, ButtonEventType type) {
+  bool step = type == BUTTON_PRESS || type == BUTTON_LONG || type == BUTTON_REPEAT;
+  if (liveItem == MENU_CALIBRATE) {
+    handleCalibration(button, type);
+  } else if (liveItem == MENU_STATS && step && (button == BUTTON_UP || button == BUTTON_DOWN)) {
+    statsPage = (statsPage + (button == BUTTON_UP ? STATS_PAGES - 1 : 1)) % STATS_PAGES;
+    openLiveView(MENU_STATS);
+  } else if (button == BUTTON_UP && step) {
+    currentMenuItem = (currentMenuItem > 0) ? (currentMenuItem - 1) : (menuItemsCount - 1);
+    displayMenu();
+  } else if (button == BUTTON_DOWN && step) {
+    currentMenuItem = (currentMenuItem < menuItemsCount - 1) ? (currentMenuItem + 1) : 0;
+    displayMenu();
+  } else if (button == BUTTON_SELECT && type == BUTTON_PRESS) {
+    if (currentMenuItem < CHANNEL_COUNT) {
+      openLiveView(currentMenuItem);
+      return;
+    }
+    switch (currentMenuItem) {
+      case MENU_POWER_SAVE:
+        powerSaveMode = !powerSaveMode;
+        displayMessage(powerSaveMode ? "Power Save: ON" : "Power Save: OFF", "");
+        displayMenu();
+        break;
+      case MENU_SEND:
+        requestUpload();
+        displayMessage("Data queued!", "");
+        displayMenu();
+        break;
+      case MENU_WIFI:
+        wifiUseEnterprise = !wifiUseEnterprise;
+        saveNetworkMode();
+        wifiRestartRequested = true;
+        displayMessage(wifiUseEnterprise ? "WiFi: Enterprise" : "WiFi: PSK", "");
+        displayMenu();
+        break;
+      case MENU_SLEEP:
+        enterDeepSleep();
+        break;
+      case MENU_STATS:
+        statsPage = 0;
+        openLiveView(MENU_STATS);
+        break;
+      case MENU_CALIBRATE:
+        startCalibration();
+        break;
+    }
+  } else if (button == BUTTON_BACK && type == BUTTON_PRESS) {
+    displayMenu();
+  }
+}
+// ============================================================
+
+// ===================== READING BUS =====================
+// The acquisition task publishes every snapshot exactly once; nothing else
+// touches the sensors. Consumers read without locks, and the producer never
+// waits for them:
+//  - latestSnapshot is a seqlock holding the newest snapshot (LCD views).
+//    The writer makes the sequence odd while it copies; a reader retries if
+//    it saw an odd or changed sequence.
+//  - readingBus is a broadcast ring of the last BUS_SLOTS snapshots with the
+//    acquisition task's verdict on each. Every consumer (uploader, alert
+//    sender) keeps its own BusCursor, so each reads every entry once at its
+//    own pace. Slots carry a stamp of the entry written into them, which lets
+//    a reader that was lapped notice, count the loss and skip ahead.
+// The payload itself is copied with plain stores; the sequence and stamp
+// checks discard any copy that overlapped a write.
+const int BUS_SLOTS = 64;                         // ~1 minute of snapshots
+
+struct BusEntry {
+  SensorSnapshot s;
+  uint8_t upload;        // UploadDecision for this snapshot (UPLOAD_NONE if it is not to be sent)
+  AlertMask freshAlerts; // ALERT bits raised by this snapshot
+};
+struct BusCursor {
+  uint32_t next;         // Ordinal of the next entry to read
+  uint32_t dropped;      // Entries overwritten before this consumer got to them
+};
+struct SnapshotSeqlock {
+  std::atomic<uint32_t> seq{0};
+  SensorSnapshot value;
+};
+struct ReadingBus {
+  std::atomic<uint32_t> head{0};                  // Entries published so far
+  std::atomic<uint32_t> stamps[BUS_SLOTS];        // 2n+1 while entry n is written, 2n+2 once complete
+  BusEntry slots[BUS_SLOTS];
+};
+SnapshotSeqlock latestSnapshot;
+ReadingBus readingBus;
+
+// Acquisition task only
+void publishLatest(const SensorSnapshot& s) {
+  uint32_t q = latestSnapshot.seq.load(std::memory_order_relaxed);
+  latestSnapshot.seq.store(q + 1, std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_release);
+  latestSnapshot.value = s;
+  latestSnapshot.seq.store(q + 2, std::memory_order_release);
+}
+// Copy the newest snapshot. Returns false before the first snapshot has been
+// taken. The UI task outranks the writer on the same core, so a reader that
+// catches a write in progress sleeps a tick to let it finish.
+bool getLatestSnapshot(SensorSnapshot& s) {
+  for (;;) {
+    uint32_t before = latestSnapshot.seq.load(std::memory_order_acquire);
+    if (before == 0) return false;
+    if ((before & 1) == 0) {
+      s = latestSnapshot.value;
+      std::atomic_thread_fence(std::memory_order_acquire);
+      if (latestSnapshot.seq.load(std::memory_order_relaxed) == before) return true;
+    }
+    vTaskDelay(1);
+  }
+}
+// Acquisition task only
+void busPublish(const BusEntry& e) {
+  uint32_t n = readingBus.head.load(std::memory_order_relaxed);
+  int i = n % BUS_SLOTS;
+  readingBus.stamps[i].store(2 * n + 1, std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_release);
+  readingBus.slots[i] = e;
+  readingBus.stamps[i].store(2 * n + 2, std::memory_order_release);
+  readingBus.head.store(n + 1, std::memory_order_release);
+}
+// Read the cursor's next entry. Returns false once it has caught up.
+bool busRead(BusCursor& c, BusEntry& out) {
+  for (;;) {
+    uint32_t head = readingBus.head.load(std::memory_order_acquire);
+    if (c.next == head) return false;
+    if (head - c.next >= (uint32_t)BUS_SLOTS) {
+      // The slot is being (or has been) reused; skip to the oldest entry left
+      c.dropped += head - BUS_SLOTS + 1 - c.next;
+      c.next = head - BUS_SLOTS + 1;
+    }
+    int i = c.next % BUS_SLOTS;
+    uint32_t stamp = 2 * c.next + 2;
+    if (readingBus.stamps[i].load(std::memory_order_acquire) != stamp) continue;
+    out = readingBus.slots[i];
+    std::atomic_thread_fence(std::memory_order_acquire);
+    if (readingBus.stamps[i].load(std::memory_order_relaxed) != stamp) continue;
+    c.next++;
+    return true;
+  }
+}
+// ============================================================
+
+// ===================== ADAPTIVE UPLOADS =====================
+// A snapshot is taken every SNAPSHOT_INTERVAL_MS, but uploaded only when it
+// says something new. Each channel is compared with the last uploaded
+// reading: once any of them has moved past its deadband, readings go up every
+// runtimeConfig.sampleIntervalMs; a jump of URGENT_CHANGE deadbands or more is
+// sent and flushed straight away. While everything stays inside its deadband
+// only a heartbeat reading is sent every runtimeConfig.heartbeatMs. The
+// deadbands are in SENSOR_CHANNELS; derived channels move with the ones they
+// come from and are not compared.
+const float URGENT_CHANGE = 5.0;                  // Deadbands moved that make a reading urgent
+const unsigned long URGENT_MIN_INTERVAL_MS = 2000; // Spacing of urgent readings during an event
+enum UploadDecision { UPLOAD_NONE, UPLOAD_ROUTINE, UPLOAD_URGENT };
+SensorSnapshot lastUploaded;
+bool haveLastUploaded = false;
+
+// Largest change of any channel since the last uploaded reading, in deadbands
+float changeSinceUpload(const SensorSnapshot& s) {
+  float change = 0;
+  for (int c = 0; c < RECORD_VALUES; c++) {
+    change = max(change, fabsf(s.value[c] - lastUploaded.value[c]) / SENSOR_CHANNELS[c].deadband);
+  }
+  return change;
+}
+// Decide whether a snapshot should be uploaded, given the time since the last one
+UploadDecision uploadDecision(const SensorSnapshot& s, unsigned long sinceLast) {
+#if ADAPTIVE_UPLOADS
+  if (!haveLastUploaded || snapshotHasError(s) || snapshotHasError(lastUploaded)) {
+    return sinceLast >= runtimeConfig.sampleIntervalMs ? UPLOAD_ROUTINE : UPLOAD_NONE;
+  }
+  float change = changeSinceUpload(s);
+  if (change >= URGENT_CHANGE && sinceLast >= URGENT_MIN_INTERVAL_MS) return UPLOAD_URGENT;
+  if (change >= 1.0 && sinceLast >= runtimeConfig.sampleIntervalMs) return UPLOAD_ROUTINE;
+  if (sinceLast >= runtimeConfig.heartbeatMs) return UPLOAD_ROUTINE;
+  return UPLOAD_NONE;
+#else
+  return sinceLast >= runtimeConfig.sampleIntervalMs ? UPLOAD_ROUTINE : UPLOAD_NONE;
+#endif
+}
+// ============================================================
+
+// ===================== ANOMALY DETECTION =====================
+// Every snapshot is checked against the alert limits and against its own
+// recent history: per channel, a running mean and variance (Welford's method,
+// with the count capped at ANOMALY_WINDOW so old samples fade out) give a
+// z-score for each new value. The resulting ALERT_* bits ship with the reading.
+// A bit that was not already raised in the last ALERT_CLEAR_MS is a new alert:
+// it is written straight to the device's alerts node and shown on the LCD.
+// The bit layout (LIMIT_ALERT, ZSCORE_ALERT) comes from SENSOR CHANNELS.
+const uint32_t ANOMALY_WINDOW = 600;              // Samples (10 min at one snapshot per second)
+const uint32_t ANOMALY_WARMUP = 60;               // Samples before z-scores are trusted
+const unsigned long ALERT_CLEAR_MS = 300000;      // Quiet time before the same alert can fire again
+
+struct RunningStats {
+  uint32_t n = 0;
+  float mean = 0;
+  float m2 = 0;             // Sum of squared deviations
+
+  void add(float x) {
+    if (n < ANOMALY_WINDOW) n++;
+    float delta = x - mean;
+    mean += delta / n;
+    if (n == ANOMALY_WINDOW) m2 -= m2 / n; // Fade the oldest samples out
+    m2 += delta * (x - mean);
+  }
+  // Standard deviations from the mean. minSd keeps a very steady signal from
+  // turning sensor noise into huge scores.
+  float z(float x, float minSd) const {
+    float sd = n > 1 ? sqrtf(m2 / (n - 1)) : 0;
+    return fabsf(x - mean) / max(sd, minSd);
+  }
+};
+RunningStats channelStats[RECORD_VALUES];
+unsigned long alertLastSeen[ALERT_BITS];
+AlertMask latchedAlerts = 0;
+volatile AlertMask activeAlerts = 0;      // Alerts on the latest snapshot, for the LCD
+volatile bool alertDisplayPending = false;
+BusCursor alertCursor = {};             // Network task's place in readingBus, for new alerts
+
+// Score one channel and fold the value into its statistics
+bool channelAnomalous(RunningStats& stats, float x, float minSd) {
+  if (x < 0) return false; // Sensor error
+  bool anomalous = stats.n >= ANOMALY_WARMUP && stats.z(x, minSd) >= runtimeConfig.zThreshold;
+  stats.add(x);
+  return anomalous;
+}
+// Limit checks only, for readings without a history (sleep sampling)
+AlertMask limitAlerts(const SensorSnapshot& s) {
+  AlertMask a = 0;
+  for (int c = 0; c < CHANNEL_COUNT; c++) {
+    float v = s.value[c];
+    if (LIMIT_ALERT[c] == 0 || v < 0) continue; // No limits, or a sensor error
+    // A NAN bound compares false, so it never raises the alert
+    if (v < runtimeConfig.limitMin[c] || v > runtimeConfig.limitMax[c]) a |= LIMIT_ALERT[c];
+  }
+  return a;
+}
+// Set s.alerts. Returns the bits that are new alerts.
+AlertMask assessSnapshot(SensorSnapshot& s) {
+  s.alerts = limitAlerts(s);
+  for (int c = 0; c < RECORD_VALUES; c++) {
+    if (channelAnomalous(channelStats[c], s.value[c], SENSOR_CHANNELS[c].deadband / 2)) {
+      s.alerts |= ZSCORE_ALERT[c];
+    }
+  }
+
+  unsigned long now = millis();
+  for (int i = 0; i < ALERT_BITS; i++) {
+    AlertMask bit = (AlertMask)1 << i;
+    if (s.alerts & bit) {
+      alertLastSeen[i] = now;
+    } else if ((latchedAlerts & bit) && now - alertLastSeen[i] >= ALERT_CLEAR_MS) {
+      latchedAlerts &= ~bit;
+    }
+  }
+  AlertMask fresh = s.alerts & ~latchedAlerts;
+  latchedAlerts |= s.alerts;
+  activeAlerts = s.alerts;
+  return fresh;
+}
+// Short channel list for the LCD, e.g. "pH TDS"
+void describeAlerts(AlertMask alerts, char* out, size_t cap) {
+  out[0] = 0;
+  for (int c = 0; c < CHANNEL_COUNT; c++) {
+    AlertMask bits = LIMIT_ALERT[c] | (c < RECORD_VALUES ? ZSCORE_ALERT[c] : 0);
+    if (alerts & bits) {
+      strlcat(out, SENSOR_CHANNELS[c].label, cap);
+      strlcat(out, " ", cap);
+    }
+  }
+}
+// Write one alerting reading to /devices/<id>/alerts, keyed like the readings.
+// Returns the HTTP status, or -1 if no response arrived.
+int sendAlert(const LogRecord& r) {
+  BufWriter body(uploadBody, sizeof(uploadBody));
+  encodeRecords(&r, 1, VALUE_FORMATS.data(), CHANNEL_COUNT, body);
+  int status = rtdbPatch(deviceAlertsPath, body.buf, body.len);
+  Serial.printf("Alert 0x%02lx sent to %s: HTTP %d\n", (unsigned long)r.alerts, deviceAlertsPath, status);
+  return status;
+}
+// Network task: hand new alerts to the alert lane (see UPLOAD SCHEDULER),
+// which sends them ahead of everything else and retries them. The readings
+// themselves carry the alert bits too, so an alert the lane has to drop is
+// still recorded once its reading is uploaded or replayed.
+void serviceAlerts() {
+  BusEntry e;
+  while (busRead(alertCursor, e)) {
+    if (e.freshAlerts != 0) queueAlert(recordFromSnapshot(e.s));
+  }
+}
+// ============================================================
+
+// ===================== ROLLUPS =====================
+// Every reading (each snapshot, or each sleep sampling wake) is folded into
+// an open 1-minute and an open 1-hour bucket. When a reading falls past the
+// end of a bucket, the bucket is closed into rollupPending and the network
+// task writes it to /rollups/<id>/1m/<start ms> or /1h/<start ms> (see
+// ROLLUPS in sensor_pipeline.h for the fields). Charts over long ranges read
+// these instead of every reading. Everything lives in RTC memory, so sleep
+// sampling keeps its buckets across wakes. Readings taken before the clock is
+// set are left out, since they cannot be placed in a bucket. The pending
+// ring has one producer (whoever samples) and one consumer (the uploader).
+const int ROLLUP_LEVELS = 2;
+const uint32_t ROLLUP_LENGTH_S[ROLLUP_LEVELS] = { 60, 3600 };
+const char* const ROLLUP_LEVEL_KEYS[ROLLUP_LEVELS] = { "1m", "1h" };
+const int ROLLUP_PENDING = 24;       // Closed buckets waiting for upload; covers a sleep sampling flush interval
+const size_t ROLLUP_JSON_MAX = 64 + 64 * RECORD_VALUES;  // Worst case for one encoded bucket and its key
+RTC_DATA_ATTR RollupBucket rollupOpen[ROLLUP_LEVELS];
+RTC_DATA_ATTR RollupBucket rollupPending[ROLLUP_PENDING];
+RTC_DATA_ATTR std::atomic<uint32_t> rollupHead(0);   // Buckets ever closed
+RTC_DATA_ATTR std::atomic<uint32_t> rollupTail(0);   // Buckets ever uploaded
+RTC_DATA_ATTR uint32_t rollupDropped = 0;            // Closed while the ring was full
+
+void rollupClose(RollupBucket& b) {
+  uint32_t head = rollupHead.load(std::memory_order_relaxed);
+  if (head - rollupTail.load(std::memory_order_acquire) >= ROLLUP_PENDING) {
+    rollupDropped++;
+  } else {
+    rollupPending[head % ROLLUP_PENDING] = b;
+    rollupHead.store(head + 1, std::memory_order_release);
+  }
+  b.count = 0;
+}
+// Fold one reading into the open buckets, closing those it has moved past
+void rollupReading(const SensorSnapshot& s) {
+  if (snapshotHasError(s) || s.timestampMs < EPOCH_VALID_MS) return;
+  uint32_t t = s.timestampMs / 1000;
+  for (int i = 0; i < ROLLUP_LEVELS; i++) {
+    RollupBucket& b = rollupOpen[i];
+    uint32_t start = t - t % ROLLUP_LENGTH_S[i];
+    if (b.count > 0 && b.startS != start) rollupClose(b);
+    if (b.count == 0) {
+      b = {};
+      b.startS = start;
+      b.level = i;
+    }
+    rollupAdd(b, s.value);
+  }
+}
+// Write closed buckets as one multi-path update. Returns false if some are
+// still pending because the write failed.
+bool uploadRollups() {
+  uint32_t tail = rollupTail.load(std::memory_order_relaxed);
+  uint32_t head = rollupHead.load(std::memory_order_acquire);
+  while (head != tail) {
+    BufWriter body(uploadBody, sizeof(uploadBody));
+    body.put('{');
+    uint32_t end = tail;
+    while (end != head && body.len + ROLLUP_JSON_MAX < body.cap) {
+      const RollupBucket& b = rollupPending[end % ROLLUP_PENDING];
+      body.put(end == tail ? "\"" : ",\"");
+      body.put(ROLLUP_LEVEL_KEYS[b.level]);
+      body.put('/');
+      body.putUInt((uint64_t)b.startS * 1000);
+      body.put("\":");
+      encodeRollup(b, VALUE_FORMATS.data(), body);
+      end++;
+    }
+    body.put('}');
+    if (body.overflow) return false;
+    int status = rtdbPatch(deviceRollupsPath, body.buf, body.len);
+    if (status < 200 || status >= 300) {
+      Serial.printf("Rollup upload FAILED: HTTP %d\n", status);
+      return false;
+    }
+    tail = end;
+    rollupTail.store(tail, std::memory_order_release);
+  }
+  if (rollupDropped > 0) {
+    Serial.printf("WARNING: %u rollup bucket(s) dropped while offline.\n", (unsigned)rollupDropped);
+    rollupDropped = 0;
+  }
+  return true;
+}
+// Called from the network task loop
+void serviceRollups() {
+  if (rollupHead.load(std::memory_order_acquire) == rollupTail.load(std::memory_order_relaxed)) return;
+  if (!firebaseOnline() || uploadBackingOff()) return;
+  uploadRollups();
+}
+// ============================================================
+
+// ===================== SLEEP SAMPLING =====================
+// Duty-cycled mode for battery sites. The device wakes on a timer every
+// DUTY_CYCLE_WAKE_S seconds, takes one snapshot into an RTC memory buffer and
+// goes back to deep sleep without touching the radio. Every
+// DUTY_CYCLE_FLUSH_EVERY wakes it brings WiFi up and uploads the buffer;
+// readings it cannot deliver (or that overflow RTC memory) move to the
+// offline log in flash.
+RTC_DATA_ATTR int rtcSampleCount = 0;
+RTC_DATA_ATTR LogRecord rtcSamples[RTC_SAMPLE_CAPACITY];
+RTC_DATA_ATTR AlertMask dutyAlerts = 0;   // Alert bits of the previous wake's reading
+
+void spillRtcSamplesToLog() {
+  for (int i = 0; i < rtcSampleCount; i++) {
+    logAppend(rtcSamples[i]);
+  }
+  rtcSampleCount = 0;
+}
+// Block until the temperature cache and every ADC channel hold a first reading
+void waitForFirstReadings(unsigned long timeoutMs) {
+  unsigned long start = millis();
+  while (millis() - start < timeoutMs) {
+    serviceTemperature();
+    serviceAdc();
+    powerAccount(POWER_MODE_SLEEP_WAKE);
+    bool ready = adcChannelsReady();
+#if TEMP_ASYNC_MODE
+    ready = ready && tempValid;
+#endif
+    if (ready) return;
+    delay(10);
+  }
+}
+// Bring WiFi up just long enough to upload the RTC buffer and drain the log.
+// A new alert, if given, is sent first.
+void dutyCycleFlush(const LogRecord* alert) {
+  CpuBoost boost; // TLS and encoding at full clock
+  beginWifi();
+  unsigned long start = millis();
+  while (!firebaseOnline() && millis() - start < DUTY_CYCLE_FLUSH_TIMEOUT_MS) {
+    serviceWifi();
+    powerAccount(POWER_MODE_SLEEP_WAKE);
+    delay(50);
+  }
+  int sent = 0;
+  if (firebaseOnline()) {
+    persistFirebaseToken();
+    if (alert != NULL) sendAlert(*alert);
+    while (sent < rtcSampleCount) {
+      int n = min(rtcSampleCount - sent, UPLOAD_MAX_RECORDS);
+      if (!httpOk(uploadRecords(rtcSamples + sent, n))) break;
+      sent += n;
+    }
+  }
+  for (int i = sent; i < rtcSampleCount; i++) {
+    logAppend(rtcSamples[i]);
+  }
+  rtcSampleCount = 0;
+  uint32_t before = 0;
+  while (logPending() > 0 && logPending() != before && millis() - start < DUTY_CYCLE_FLUSH_TIMEOUT_MS) {
+    before = logPending();
+    replayOfflineLog();
+  }
+  if (firebaseOnline()) uploadRollups();
+  pollCommandOnce();
+  pollRemoteConfig();
+  rtdbClose();
+  WiFi.disconnect(true);
+  WiFi.mode(WIFI_OFF);
+}
+// Timer wakeup in sleep sampling mode: sample, maybe flush, sleep again
+void dutyCycleWake() {
+  dutyWakeCount++;
+  waitForFirstReadings(tempConvTime + 500);
+  SensorSnapshot s = takeSnapshot();
+  // One reading per wake gives no history for z-scores, so only limits are
+  // checked. An alert that was not raised on the previous wake flushes now.
+  s.alerts = limitAlerts(s);
+  bool newAlert = (s.alerts & ~dutyAlerts) != 0;
+  dutyAlerts = s.alerts;
+  LogRecord r = recordFromSnapshot(s);
+  rollupReading(s);
+  if (!snapshotHasError(s)) {
+    if (rtcSampleCount >= RTC_SAMPLE_CAPACITY) {
+      spillRtcSamplesToLog();
+    }
+    rtcSamples[rtcSampleCount++] = r;
+  }
+  Serial.printf("Sleep sampling wake %u, %d reading(s) buffered.\n", (unsigned)dutyWakeCount, rtcSampleCount);
+  if (newAlert || dutyWakeCount % DUTY_CYCLE_FLUSH_EVERY == 0) {
+    dutyCycleFlush(newAlert ? &r : NULL);
+  }
+  deepSleepNow();
+}
+// ============================================================
+
+// ===================== TASKS =====================
+// Acquisition and the LCD/menu share core 1, with the UI at a higher priority
+// so button presses preempt sampling. WiFi/Firebase run alone on core 0, so a
+// slow upload never delays either of them. Snapshots reach the LCD and the
+// network task through the READING BUS.
+const unsigned long ACQ_TICK_MS = 20;             // Acquisition service tick
+const unsigned long UI_IDLE_MS = 1000;            // Longest UI task sleep with no button activity
+const unsigned long SNAPSHOT_INTERVAL_MS = 1000;  // Refresh of the latest snapshot shown on the LCD
+const unsigned long NET_IDLE_MS = 1000;           // Network task wakeup when no reading arrives
+const unsigned long ADC_BURST_LEAD_MS = 60;       // ADC burst start ahead of a snapshot (one block takes ~40 ms)
+const unsigned long ADC_BURST_TIMEOUT_MS = 250;   // Longest a snapshot waits for its burst
+BusCursor uploadCursor = {};       // Network task's place in readingBus, for uploads
+// Ask the acquisition task to take a snapshot and upload it, together with
+// any batched readings, right away
+void requestUpload() {
+  xTaskNotify(acqTaskHandle, ACQ_WAKE_SAMPLE, eSetBits);
+}
+// Core 1: drives the DS18B20 and ADC state machines and publishes snapshots
+// to the reading bus. Between steps it blocks until the next one is due (or a
+// notification arrives), so with the ADC paused the chip can light-sleep
+// through the whole gap instead of waking every ACQ_TICK_MS.
+void acquisitionTask(void* param) {
+  unsigned long lastSnapshot = 0;
+  unsigned long burstStarted = 0;
+  unsigned long lastLiveSend = 0;
+  bool sendPending = false;
+  for (;;) {
+    serviceTemperature();
+    serviceAdc();
+    servicePowerMonitor();
+    unsigned long now = millis();
+    if (liveActive(now) && now - lastLiveSend >= liveEveryMs) {
+      sendPending = true;
+      lastLiveSend = now;
+    }
+    bool due = sendPending || now - lastSnapshot >= SNAPSHOT_INTERVAL_MS;
+    if (pmLightSleep && adcContinuousActive) {
+      // Burst mode: run the DMA engine only for the lead-in to each snapshot
+      if (!adcRunning && (captureState.load() == CAPTURE_RUNNING || sendPending || now - lastSnapshot >= SNAPSHOT_INTERVAL_MS - ADC_BURST_LEAD_MS)) {
+        adcResume();
+        burstStarted = now;
+      }
+      if (due && !adcChannelsReady() && now - burstStarted < ADC_BURST_TIMEOUT_MS) due = false;
+    }
+    if (due) {
+      bool sendNow = sendPending;
+      sendPending = false;
+      SensorSnapshot s = takeSnapshot();
+      lastSnapshot = now;
+      if (pmLightSleep && captureState.load() != CAPTURE_RUNNING) adcPause();
+      AlertMask newAlerts = assessSnapshot(s);
+      publishLatest(s);
+      rollupReading(s);
+      if (newAlerts) {
+        alertDisplayPending = true;
+        wakeUi();
+        sendNow = true; // The reading itself goes up right away too
+        if (BURST_ON_ALERT_S > 0) captureAlertRequested = true;
+      }
+      UploadDecision decision = sendNow ? UPLOAD_URGENT : uploadDecision(s, now - lastRead);
+      BusEntry e = { s, UPLOAD_NONE, newAlerts };
+      if (decision != UPLOAD_NONE) {
+        lastRead = now;
+        lastUploaded = s;
+        haveLastUploaded = true;
+        if (sendNow || !powerSaveMode) e.upload = decision;
+      }
+      busPublish(e);
+      if (e.upload == UPLOAD_URGENT) {
+        uploadBatch.flushRequested = true; // Set after publishing so the flush includes this reading
+      }
+      if (e.upload != UPLOAD_NONE || newAlerts) xTaskNotifyGive(netTaskHandle);
+    }
+    unsigned long wait = ACQ_TICK_MS; // While the DMA engine runs its pool has to be drained
+    if (!adcRunning) {
+      now = millis();
+      unsigned long snapshotIn = SNAPSHOT_INTERVAL_MS;
+      if (pmLightSleep && adcContinuousActive) snapshotIn -= ADC_BURST_LEAD_MS; // Start the burst in time
+      wait = snapshotIn - min(now - lastSnapshot, snapshotIn);
+      if (liveActive(now)) {
+        unsigned long every = liveEveryMs;
+        wait = min(wait, every - min(now - lastLiveSend, every));
+      }
+      wait = min(wait, temperatureWaitMs());
+      wait = min(wait, powerMonitorWaitMs());
+      wait = max(wait, 1UL); // A step due now still yields a tick
+    }
+    uint32_t wakeBits = 0;
+    if (xTaskNotifyWait(0, UINT32_MAX, &wakeBits, pdMS_TO_TICKS(wait)) == pdTRUE && (wakeBits & ACQ_WAKE_SAMPLE)) {
+      sendPending = true;
+    }
+  }
+}
+// Core 1, higher priority: buttons, LCD and power management
+void uiTask(void* param) {
+  for (;;) {
+    // Sleep until a button edge or wakeup arrives, or a timer is due
+    unsigned long wait = buttonWaitMs(liveItem >= 0 ? LIVE_REFRESH_MS : UI_IDLE_MS);
+    ButtonEdge e;
+    if (xQueueReceive(buttonQueue, &e, pdMS_TO_TICKS(wait)) == pdTRUE) {
+      do {
+        noteButtonEdge(e);
+      } while (xQueueReceive(buttonQueue, &e, 0) == pdTRUE);
+    }
+    CpuBoost boost; // LCD updates at full clock, released when the task blocks again
+    if (alertDisplayPending) {
+      alertDisplayPending = false;
+      displayAlert(activeAlerts);
+    }
+    serviceButtons();  // Debounce and hand button events to handleMenu()
+    refreshLiveView();
+    managePower();     // Handle power saving features (LCD backlight, deep sleep)
+  }
+}
+// Core 0: everything that talks to WiFi/Firebase. Readings are batched, and
+// batches that cannot be delivered go to the offline log, which is drained
+// once the link is back.
+// Take the readings marked for upload from the reading bus into the batch
+void collectUploads() {
+  BusEntry e;
+  uint32_t dropped = uploadCursor.dropped;
+  while (busRead(uploadCursor, e)) {
+    if (e.upload == UPLOAD_NONE) continue;
+    if (snapshotHasError(e.s)) {
+      Serial.println("Skipping Firebase send due to sensor error values.");
+    } else {
+      batchReading(e.s);
+    }
+  }
+  if (uploadCursor.dropped != dropped) {
+    Serial.printf("WARNING: Uploader fell behind, %u snapshot(s) skipped.\n", (unsigned)(uploadCursor.dropped - dropped));
+  }
+}
+void networkTask(void* param) {
+  for (;;) {
+    // Woken by the acquisition task when a reading is to be sent or an alert is new
+    ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(NET_IDLE_MS));
+    CpuBoost boost; // TLS, encoding and uploads at full clock, released when the task blocks again
+    serviceWifi();
+    serviceAlerts();
+    serviceCommands();
+    serviceCapture();
+    serviceRollups();
+    collectUploads();
+    if (sleepRequested) {
+      // Keep everything already sampled before powering down
+      collectUploads();
+      if (uploadBatch.count > 0) flushUploadBatch();
+      deepSleepNow();
+    }
+    serviceUploads();
+    pollRemoteConfig();
+    serviceSettings();
+    publishDiagnostics();
+  }
+}
+void startTasks() {
+  initButtons();
+  commandQueue = xQueueCreate(COMMAND_QUEUE_LEN, sizeof(RemoteCommand));
+  // The network task first: the acquisition task notifies it
+  xTaskCreatePinnedToCore(networkTask, "net", 12288, NULL, 1, &netTaskHandle, 0);
+  xTaskCreatePinnedToCore(acquisitionTask, "acq", 4096, NULL, 2, &acqTaskHandle, 1);
+  xTaskCreatePinnedToCore(uiTask, "ui", 4096, NULL, 3, NULL, 1);
+}
+// ============================================================
+
+void loop() {
+  // All work happens in the tasks started by setup()
+  vTaskDelete(NULL);
+}
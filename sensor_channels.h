@@ -0,0 +1,287 @@
+// The firmware's sensor channel table and everything derived from it: the
+// probe pins, alert limits and calibration defaults, the conversions, the
+// per-kind index lists, the alert bit layout and the record types. main.cpp
+// and the host programs in bench/ both include it, so the host runs the same
+// channels, filters and conversions as the device. Like sensor_pipeline.h it
+// needs no Arduino or ESP-IDF header; writing a calibration curve
+// (storeCalCurve()) needs a critical section and stays in main.cpp.
+#pragma once
+#include "sensor_pipeline.h"
+#include <array>
+#include <atomic>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+
+// ===================== CHANNEL CONFIGURATION =====================
+#define ALERT_PH_MIN 6.5                          // Alert limits (WHO drinking water guidance); remote config may change them
+#define ALERT_PH_MAX 8.5
+#define ALERT_TURB_MAX 5.0                        // NTU
+#define ALERT_TDS_MAX 600.0                       // ppm
+#define CAL_PH_BUFFERS { 7.0, 4.0, 10.0 }         // pH buffers used by the Calibrate menu (2-3), in capture order
+#define CAL_TURB_STANDARDS { 0.0, 100.0 }         // Turbidity standards (NTU) used by the Calibrate menu (2-3)
+// =============================================================
+
+// Pin assignments
+const int PH_PIN = 34;      // Analog pin for pH sensor
+const int TURB_PIN = 35;    // Analog pin for Turbidity sensor
+const int TDS_PIN = 36;     // Analog pin for TDS/EC sensor
+
+// Calibration values (main.cpp loads them from Preferences; these are the defaults)
+inline float ph_slope = -1.5;
+inline float ph_intercept = 7.0;
+inline float turb_slope = -50.0;
+inline float turb_intercept = 100.0;
+inline float tds_k = 0.5; // TDS probe constant
+// Multi-point calibrations from the Calibrate menu; CURVE_NONE uses the
+// slope/intercept. The acquisition task evaluates them while the UI and
+// network tasks may replace them, so each sits behind a seqlock and is only
+// touched through storeCalCurve() and loadCalCurve().
+struct CurveSeqlock {
+  std::atomic<uint32_t> seq{0};
+  CalCurve curve = {};
+};
+inline CurveSeqlock phCurve;
+inline CurveSeqlock turbCurve;
+const float calPhBuffers[] = CAL_PH_BUFFERS;
+const float calTurbStandards[] = CAL_TURB_STANDARDS;
+static_assert(sizeof(calPhBuffers) / sizeof(float) <= CAL_MAX_POINTS, "too many pH buffers");
+static_assert(sizeof(calTurbStandards) / sizeof(float) <= CAL_MAX_POINTS, "too many turbidity standards");
+
+// Analog probe conversions (see SENSOR CHANNELS)
+// Copy a calibration curve, retrying if the copy overlapped a write
+inline CalCurve loadCalCurve(const CurveSeqlock& k) {
+  for (;;) {
+    uint32_t before = k.seq.load(std::memory_order_acquire);
+    if ((before & 1) == 0) {
+      CalCurve c = k.curve;
+      std::atomic_thread_fence(std::memory_order_acquire);
+      if (k.seq.load(std::memory_order_relaxed) == before) return c;
+    }
+  }
+}
+inline float convertPh(float v, float tempC) {
+  CalCurve k = loadCalCurve(phCurve);
+  if (k.model == CURVE_NONE) return phFromVolts(v, tempC, ph_slope, ph_intercept);
+  return phCompensate(evalCalCurve(k, v), tempC);
+}
+inline float convertTurbidity(float v, float /*tempC*/) {
+  CalCurve k = loadCalCurve(turbCurve);
+  if (k.model == CURVE_NONE) return turbidityFromVolts(v, turb_slope, turb_intercept);
+  return turbidityClamp(evalCalCurve(k, v));
+}
+inline float convertTds(float v, float tempC) {
+  return tdsFromVolts(v, tempC, tds_k);
+}
+
+// ===================== SENSOR CHANNELS =====================
+// Everything the device measures, in menu and record order. Each entry
+// describes one channel end to end: where its value comes from (for an analog
+// probe the pin, filter and conversion), how it is shown, its upload key and
+// fixed-point scale, its upload deadband and alert limits, and how it is
+// calibrated. The snapshot, the LogRecord slots, the readings, compact and
+// rollup keys, the menu items and live views, the Calibrate menu's probes, the
+// ADC scan pattern, the filters and the alert bits all come from this table, and
+// sampleChannels() in main.cpp expands into straight-line code for every
+// analog entry at compile time, so the table costs nothing at run time. A new probe (e.g. ORP)
+// is an entry here plus its conversion function. Stored channels come first;
+// derived ones are recomputed from them on upload instead of being logged.
+enum ChannelSource : uint8_t {
+  SOURCE_DS18B20,  // The OneWire temperature sensor (see serviceTemperature() in main.cpp)
+  SOURCE_ANALOG,   // An ADC1 pin through a ChannelFilter and a conversion
+  SOURCE_DERIVED,  // format.factor * the channel at format.from
+};
+enum CalModel : uint8_t {
+  CAL_FACTORY,     // Nothing to calibrate on the device
+  CAL_CONSTANT,    // A probe constant, set through the remote config
+  CAL_CURVE,       // Slope/intercept, or a curve fitted in the Calibrate menu
+};
+// Every entry sets the fields without a default.
+struct SensorChannel {
+  const char* name;                            // Menu item and live view heading
+  const char* label;                           // Short name for alerts and calibration screens
+  const char* unit;                            // "" if unitless
+  ValueFormat format;                          // Upload key, decimals and fixed-point scale
+  float deadband;                              // Change worth uploading (see ADAPTIVE UPLOADS), 0 if derived
+  const char* limitKey = NULL;                 // Alert limits: remote config keys <limitKey>_min/_max, NULL if none
+  float limitMin = NAN;                        // Default limits, NAN for no bound on that side
+  float limitMax = NAN;
+  ChannelSource source;
+  int pin = -1;                                // SOURCE_ANALOG only
+  int window = 1;                              // Median filter length
+  float alpha = 1;                             // EMA weight
+  float (*convert)(float volts, float tempC) = NULL;  // Calibration and temperature compensation
+  float (*uncompensate)(float value, float tempC) = NULL; // CAL_CURVE: undoes convert's compensation, NULL if none
+  CalModel cal;
+  CurveSeqlock* curve = NULL;                  // CAL_CURVE: the fitted curve and
+  const float* standards = NULL;               // the standards the Calibrate menu steps through
+  int standardCount = 0;
+};
+constexpr SensorChannel SENSOR_CHANNELS[] = {
+  { .name = "Temperature", .label = "Temp", .unit = "C", .format = { "t", 1, 100, -1, 0 }, .deadband = 0.5,
+    .source = SOURCE_DS18B20, .cal = CAL_FACTORY },
+  { .name = "pH", .label = "pH", .unit = "", .format = { "p", 1, 100, -1, 0 }, .deadband = 0.1,
+    .limitKey = "ph", .limitMin = ALERT_PH_MIN, .limitMax = ALERT_PH_MAX,
+    .source = SOURCE_ANALOG, .pin = PH_PIN, .window = 5, .alpha = 0.3,
+    .convert = convertPh, .uncompensate = phUncompensate, .cal = CAL_CURVE, .curve = &phCurve,
+    .standards = calPhBuffers, .standardCount = sizeof(calPhBuffers) / sizeof(calPhBuffers[0]) },
+  { .name = "Turbidity", .label = "Turb", .unit = "NTU", .format = { "n", 1, 10, -1, 0 }, .deadband = 2.0,
+    .limitKey = "turb", .limitMin = NAN, .limitMax = ALERT_TURB_MAX, .source = SOURCE_ANALOG, .pin = TURB_PIN,
+    .window = 7, .alpha = 0.3, // Wider window: bubbles cause longer spikes
+    .convert = convertTurbidity, .cal = CAL_CURVE, .curve = &turbCurve, .standards = calTurbStandards,
+    .standardCount = sizeof(calTurbStandards) / sizeof(calTurbStandards[0]) },
+  { .name = "TDS", .label = "TDS", .unit = "ppm", .format = { "d", 1, 10, -1, 0 }, .deadband = 10.0,
+    .limitKey = "tds", .limitMin = NAN, .limitMax = ALERT_TDS_MAX,
+    .source = SOURCE_ANALOG, .pin = TDS_PIN, .window = 5, .alpha = 0.3, .convert = convertTds, .cal = CAL_CONSTANT },
+  { .name = "EC", .label = "EC", .unit = "uS/cm", .format = { "ec", 1, 1, 3, 2.0 }, .deadband = 0,
+    .source = SOURCE_DERIVED, .cal = CAL_FACTORY }, // EC = 2 * TDS
+};
+constexpr int CHANNEL_COUNT = sizeof(SENSOR_CHANNELS) / sizeof(SENSOR_CHANNELS[0]);
+
+// Counts and per-kind index lists, worked out from the table at compile time
+constexpr int RECORD_VALUES = [] {
+  int n = 0;
+  for (const SensorChannel& c : SENSOR_CHANNELS) n += c.source != SOURCE_DERIVED;
+  return n;
+}();
+constexpr int ANALOG_CHANNEL_COUNT = [] {
+  int n = 0;
+  for (const SensorChannel& c : SENSOR_CHANNELS) n += c.source == SOURCE_ANALOG;
+  return n;
+}();
+// The entry whose value the conversions compensate for
+constexpr int TEMP_CHANNEL = [] {
+  for (int c = 0; c < CHANNEL_COUNT; c++) {
+    if (SENSOR_CHANNELS[c].source == SOURCE_DS18B20) return c;
+  }
+  return -1;
+}();
+constexpr int CAL_PROBE_COUNT = [] {
+  int n = 0;
+  for (const SensorChannel& c : SENSOR_CHANNELS) n += c.cal == CAL_CURVE;
+  return n;
+}();
+// ANALOG_INDEX[i]: the table entry behind adcAccum[i] and filter i
+constexpr std::array<int, ANALOG_CHANNEL_COUNT> ANALOG_INDEX = [] {
+  std::array<int, ANALOG_CHANNEL_COUNT> idx = {};
+  int n = 0;
+  for (int c = 0; c < CHANNEL_COUNT; c++) {
+    if (SENSOR_CHANNELS[c].source == SOURCE_ANALOG) idx[n++] = c;
+  }
+  return idx;
+}();
+// CAL_PROBES[i]: the table entry behind the i-th probe in the Calibrate menu
+constexpr std::array<int, CAL_PROBE_COUNT> CAL_PROBES = [] {
+  std::array<int, CAL_PROBE_COUNT> idx = {};
+  int n = 0;
+  for (int c = 0; c < CHANNEL_COUNT; c++) {
+    if (SENSOR_CHANNELS[c].cal == CAL_CURVE) idx[n++] = c;
+  }
+  return idx;
+}();
+// The formats the encoders in sensor_pipeline.h take, in table order
+constexpr std::array<ValueFormat, CHANNEL_COUNT> VALUE_FORMATS = [] {
+  std::array<ValueFormat, CHANNEL_COUNT> f = {};
+  for (int c = 0; c < CHANNEL_COUNT; c++) f[c] = SENSOR_CHANNELS[c].format;
+  return f;
+}();
+static_assert([] {
+  for (int c = 0; c < CHANNEL_COUNT; c++) {
+    const SensorChannel& ch = SENSOR_CHANNELS[c];
+    if ((ch.source == SOURCE_DERIVED) != (c >= RECORD_VALUES)) return false;
+    if (ch.source == SOURCE_DERIVED && (ch.format.from < 0 || ch.format.from >= RECORD_VALUES)) return false;
+    if (ch.source != SOURCE_DERIVED && ch.format.from >= 0) return false;
+    if (ch.cal == CAL_CURVE && (ch.source != SOURCE_ANALOG || ch.curve == NULL || ch.standardCount < 2)) return false;
+  }
+  return true;
+}(), "stored channels must come first, derived ones must name a stored channel, and calibrated ones an analog curve");
+static_assert(TEMP_CHANNEL >= 0, "the conversions need a temperature channel");
+// Compact batch headers carry each format's key and whole-number scale
+static_assert(CHANNEL_COUNT <= COMPACT_FORMAT_MAX && [] {
+  for (const SensorChannel& ch : SENSOR_CHANNELS) {
+    int len = 0;
+    while (ch.format.key[len]) len++;
+    if (len > COMPACT_KEY_MAX || ch.format.scale < 1 || ch.format.scale != (float)(int)ch.format.scale) return false;
+  }
+  return true;
+}(), "compact batch headers need keys of up to COMPACT_KEY_MAX characters and whole-number scales");
+
+// Alert bits, laid out from the table: first one bit per channel with limits,
+// in table order, then a z-score bit per stored channel (see ANOMALY
+// DETECTION). They ship as "a" with every reading and in compact batches.
+constexpr int LIMIT_ALERT_COUNT = [] {
+  int n = 0;
+  for (const SensorChannel& c : SENSOR_CHANNELS) n += c.limitKey != NULL;
+  return n;
+}();
+static_assert([] {
+  for (const SensorChannel& ch : SENSOR_CHANNELS) {
+    int len = 0;
+    while (ch.limitKey && ch.limitKey[len]) len++;
+    if (len > 11) return false;
+  }
+  return true;
+}(), "limit keys must leave room for _min/_max in a 15-character NVS key");
+constexpr int ALERT_BITS = LIMIT_ALERT_COUNT + RECORD_VALUES;
+static_assert(ALERT_BITS <= 32, "alert bits must fit in 32 bits");
+using AlertMask = std::conditional_t<ALERT_BITS <= 8, uint8_t, std::conditional_t<ALERT_BITS <= 16, uint16_t, uint32_t>>;
+// LIMIT_ALERT[c]: the limit bit of table entry c, 0 if it has no limits
+constexpr std::array<AlertMask, CHANNEL_COUNT> LIMIT_ALERT = [] {
+  std::array<AlertMask, CHANNEL_COUNT> bit = {};
+  int n = 0;
+  for (int c = 0; c < CHANNEL_COUNT; c++) {
+    if (SENSOR_CHANNELS[c].limitKey != NULL) bit[c] = (AlertMask)1 << n++;
+  }
+  return bit;
+}();
+// ZSCORE_ALERT[c]: the z-score bit of stored channel c
+constexpr std::array<AlertMask, RECORD_VALUES> ZSCORE_ALERT = [] {
+  std::array<AlertMask, RECORD_VALUES> bit = {};
+  for (int c = 0; c < RECORD_VALUES; c++) bit[c] = (AlertMask)1 << (LIMIT_ALERT_COUNT + c);
+  return bit;
+}();
+// Default limits by table entry, NAN where there is no bound
+constexpr std::array<float, CHANNEL_COUNT> LIMIT_MIN_DEFAULTS = [] {
+  std::array<float, CHANNEL_COUNT> v = {};
+  for (int c = 0; c < CHANNEL_COUNT; c++) v[c] = SENSOR_CHANNELS[c].limitKey ? SENSOR_CHANNELS[c].limitMin : NAN;
+  return v;
+}();
+constexpr std::array<float, CHANNEL_COUNT> LIMIT_MAX_DEFAULTS = [] {
+  std::array<float, CHANNEL_COUNT> v = {};
+  for (int c = 0; c < CHANNEL_COUNT; c++) v[c] = SENSOR_CHANNELS[c].limitKey ? SENSOR_CHANNELS[c].limitMax : NAN;
+  return v;
+}();
+
+// One complete set of readings taken together (see takeSnapshot() in main.cpp)
+struct SensorSnapshot {
+  float value[CHANNEL_COUNT];  // By table entry, in its unit; -1 on a sensor error
+  uint64_t timestampMs;  // clockMs() when the snapshot was taken
+  AlertMask alerts;      // ALERT bits (see assessSnapshot() in main.cpp)
+};
+using LogRecord = LogRecordOf<RECORD_VALUES, AlertMask>;
+const size_t RECORD_JSON_MAX = 64 + 20 * CHANNEL_COUNT;  // Worst case for one reading from encodeRecords()
+using RollupBucket = RollupBucketOf<RECORD_VALUES>;
+
+// One ChannelFilter per analog entry, each sized by its window
+template <size_t... I>
+auto makeChannelFilters(std::index_sequence<I...>) {
+  return std::make_tuple(
+      ChannelFilter<SENSOR_CHANNELS[ANALOG_INDEX[I]].window>(SENSOR_CHANNELS[ANALOG_INDEX[I]].alpha)...);
+}
+using ChannelFilters = decltype(makeChannelFilters(std::make_index_sequence<ANALOG_CHANNEL_COUNT>()));
+// Snapshot value of analog channel I from its filtered volts (-1 on a sensor
+// error). The entry is a constant, so the conversion resolves at compile time.
+template <size_t I>
+float analogValue(float volts, float tempC) {
+  constexpr SensorChannel c = SENSOR_CHANNELS[ANALOG_INDEX[I]];
+  return volts < 0 ? -1.0f : c.convert(volts, tempC);
+}
+// Fill in the derived channels (see SENSOR CHANNELS) from the stored ones
+inline void deriveChannels(SensorSnapshot& s) {
+  for (int c = RECORD_VALUES; c < CHANNEL_COUNT; c++) {
+    const ValueFormat& f = SENSOR_CHANNELS[c].format;
+    float from = s.value[f.from];
+    s.value[c] = from < 0 ? -1.0f : f.factor * from;
+  }
+}
+// ============================================================
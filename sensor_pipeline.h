@@ -0,0 +1,593 @@
+// Hardware-independent parts of the sensor and upload pipeline: the streaming
+// filter, the probe conversion formulas, the log record layout, the upload
+// encoders, batching and backoff. Nothing here includes an Arduino or ESP-IDF
+// header, so the same code builds for the ESP32 and natively on a host
+// (bench/: benchmarks, tests and trace replay against mock backends). The
+// channel table built on it is in sensor_channels.h. The one hardware-
+// dependent hook, recordEpochMs(), is supplied by whichever target links it
+// (main.cpp: PAYLOAD ENCODING, bench/host_channels.h).
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+#include <math.h>
+#include <string.h>
+
+// ===================== FILTERING =====================
+// Per-channel streaming filter: a median over the last N samples rejects
+// spikes, then an exponential moving average smooths what is left. Storage is
+// fixed at compile time, so there is no allocation per sample.
+template <int N>
+struct ChannelFilter {
+  float window[N];
+  int head = 0;             // Next slot to overwrite
+  int filled = 0;           // Valid samples in the window (saturates at N)
+  float ema = 0;
+  float alpha;              // EMA weight of each new median
+  unsigned long accepted = 0;
+  unsigned long rejected = 0;
+
+  explicit ChannelFilter(float emaAlpha) : alpha(emaAlpha) {}
+
+  void push(float v) {
+    window[head] = v;
+    head = (head + 1) % N;
+    if (filled < N) filled++;
+    float m = median();
+    ema = (accepted == 0) ? m : ema + alpha * (m - ema);
+    accepted++;
+  }
+  void reject() { rejected++; }
+  bool hasValue() const { return accepted > 0; }
+  bool warmedUp() const { return filled >= N; } // Window holds N real samples
+  float value() const { return ema; }
+  float median() const {
+    float sorted[N];
+    for (int i = 0; i < filled; i++) {
+      float v = window[i];
+      int j = i;
+      for (; j > 0 && sorted[j - 1] > v; j--) sorted[j] = sorted[j - 1];
+      sorted[j] = v;
+    }
+    return sorted[filled / 2];
+  }
+};
+
+// Feed one raw 12-bit sample (and its calibrated voltage) to a channel
+// filter. A rail hit (0 or 4095) means a disconnected or saturated probe and
+// is rejected, returning true; a negative raw value (no sample yet) is ignored.
+template <int N>
+bool filterAdcSample(int raw, float volts, ChannelFilter<N>& filter) {
+  if (raw == 0 || raw >= 4095) {
+    filter.reject();
+    return true;
+  }
+  if (raw > 0) filter.push(volts);
+  return false;
+}
+// ============================================================
+
+// ===================== CONVERSION =====================
+inline float clampFloat(float v, float lo, float hi) {
+  return v < lo ? lo : (v > hi ? hi : v);
+}
+// Temperature compensation of a pH calibrated at 25 C
+const float PH_TEMP_COEFF = 0.0198;  // pH per degree C
+inline float phCompensate(float ph, float tempC) {
+  ph += (PH_TEMP_COEFF * (tempC - 25.0));
+  return clampFloat(ph, 0.0, 14.0);
+}
+// The 25 C value a calibration curve must give for a reading of ph at tempC
+inline float phUncompensate(float ph, float tempC) {
+  return ph - PH_TEMP_COEFF * (tempC - 25.0);
+}
+// pH from probe volts, compensated to 25 C
+inline float phFromVolts(float v, float tempC, float slope, float intercept) {
+  return phCompensate(slope * v + intercept, tempC);
+}
+inline float turbidityClamp(float ntu) {
+  return clampFloat(ntu, 0.0, 150.0);
+}
+inline float turbidityFromVolts(float v, float slope, float intercept) {
+  return turbidityClamp(slope * v + intercept);
+}
+// TDS in ppm from probe volts, compensated to 25 C
+inline float tdsFromVolts(float v, float tempC, float k) {
+  return v * k * (1.0 + 0.02 * (tempC - 25.0));
+}
+// ============================================================
+
+// ===================== CALIBRATION CURVES =====================
+// A multi-point calibration maps probe volts to a value. The fit is done once
+// when the points are captured; what is stored is ready to evaluate, so a
+// reading costs one segment choice and a multiply-add (piecewise linear) or
+// a Horner step (quadratic).
+const int CAL_MAX_POINTS = 3;
+enum CurveModel : uint8_t {
+  CURVE_NONE,       // Not calibrated this way; the linear slope/intercept apply
+  CURVE_PIECEWISE,  // Straight lines between the points, extended past the ends
+  CURVE_QUADRATIC,  // Parabola through three points
+};
+// Stored byte for byte in the settings blob, which is compared with memcmp,
+// so every byte is a named field: no compiler padding to carry stale bytes.
+struct CalCurve {
+  uint8_t model;                       // CurveModel
+  uint8_t segments;                    // CURVE_PIECEWISE: points - 1
+  uint8_t reserved[2];                 // Always 0; aligns the floats
+  float knot[CAL_MAX_POINTS - 2];      // Volts at which segment i + 1 starts (ascending)
+  float m[CAL_MAX_POINTS - 1];         // Segment i: value = m[i] * v + b[i]
+  float b[CAL_MAX_POINTS - 1];
+  float c[3];                          // CURVE_QUADRATIC: c[0] + v * (c[1] + v * c[2])
+};
+static_assert(sizeof(CalCurve) == 4 + sizeof(float) * (3 * CAL_MAX_POINTS - 1), "CalCurve has padding");
+
+inline float evalCalCurve(const CalCurve& k, float v) {
+  if (k.model == CURVE_QUADRATIC) return k.c[0] + v * (k.c[1] + v * k.c[2]);
+  int i = 0;
+  while (i < k.segments - 1 && v >= k.knot[i]) i++;
+  return k.m[i] * v + k.b[i];
+}
+// Fit n (2..CAL_MAX_POINTS) captured points. A quadratic needs three points;
+// with two, the fit is a single line whatever model is asked for. Fails if two
+// points are less than minSpacing volts apart, since the slope would be noise,
+// or if a quadratic turns round between the outer points: a reading there
+// would then map back to two different values.
+inline bool fitCalCurve(const float* volts, const float* values, int n, CurveModel model, CalCurve& out,
+                        float minSpacing = 0.02) {
+  if (n < 2 || n > CAL_MAX_POINTS) return false;
+  float x[CAL_MAX_POINTS], y[CAL_MAX_POINTS];
+  for (int i = 0; i < n; i++) {
+    int j = i;
+    for (; j > 0 && x[j - 1] > volts[i]; j--) {
+      x[j] = x[j - 1];
+      y[j] = y[j - 1];
+    }
+    x[j] = volts[i];
+    y[j] = values[i];
+  }
+  for (int i = 1; i < n; i++) {
+    if (x[i] - x[i - 1] < minSpacing) return false;
+  }
+  out = {};
+  if (model == CURVE_QUADRATIC && n == 3) {
+    // Newton form through the three points, expanded to c0 + c1 v + c2 v^2
+    float d01 = (y[1] - y[0]) / (x[1] - x[0]);
+    float d12 = (y[2] - y[1]) / (x[2] - x[1]);
+    float c2 = (d12 - d01) / (x[2] - x[0]);
+    float c1 = d01 - c2 * (x[0] + x[1]);
+    // The slope c1 + 2 c2 v is linear in v, so it keeps its sign over
+    // [x0, x2] exactly when it has the same sign at both ends
+    float slope0 = c1 + 2 * c2 * x[0];
+    float slope2 = c1 + 2 * c2 * x[2];
+    if (!(slope0 * slope2 > 0)) return false;
+    out.model = CURVE_QUADRATIC;
+    out.c[0] = y[0] - x[0] * (c1 + x[0] * c2);
+    out.c[1] = c1;
+    out.c[2] = c2;
+    return true;
+  }
+  out.model = CURVE_PIECEWISE;
+  out.segments = n - 1;
+  for (int i = 0; i < n - 1; i++) {
+    out.m[i] = (y[i + 1] - y[i]) / (x[i + 1] - x[i]);
+    out.b[i] = y[i] - out.m[i] * x[i];
+    if (i > 0) out.knot[i - 1] = x[i];
+  }
+  return true;
+}
+// ============================================================
+
+// ===================== RECORDS AND ENCODING =====================
+// What a record holds comes from the channel table (sensor_channels.h:
+// SENSOR CHANNELS). The encoders get one ValueFormat per channel, stored
+// values first; a channel that is not stored is derived on encode from one
+// that is, as factor * value[from].
+struct ValueFormat {
+  const char* key;       // Field name in the readings JSON and rollups
+  uint8_t decimals;      // Places written to the readings JSON
+  float scale;           // Fixed-point steps per unit in compact batches and burst traces
+  int8_t from;           // -1 if stored in the record, else the stored value it is derived from
+  float factor;
+};
+
+// One reading as stored in the offline log and RTC buffer (see OFFLINE LOG),
+// with Values stored channels and alert bits of type Alerts
+template <int Values, typename Alerts = uint8_t>
+struct __attribute__((packed)) LogRecordOf {
+  uint64_t timestampMs;  // When the sample was taken
+  float value[Values];   // Stored channels, in table order
+  uint16_t session;      // Power session the timestamp belongs to (see TimeState)
+  uint8_t flags;         // LOG_FLAG_* bits
+  Alerts alerts;         // ALERT_* bits
+  uint16_t crc;          // CRC16 over the fields above
+  uint16_t sent;         // 0xFFFF until uploaded, then 0
+};
+const uint8_t LOG_FLAG_UNSYNCED = 0x01;  // timestampMs counts from power-on, not Unix time
+
+// The encoders call recordEpochMs(const LogRecordOf<Values, Alerts>& r, uint64_t& epochMs)
+// for the Unix time in ms at which a record was sampled (false if it cannot be
+// dated). The target provides it: it depends on the clock and power session state.
+
+// Appends text to a fixed buffer, flagging overflow instead of growing
+struct BufWriter {
+  char* buf;
+  size_t cap;
+  size_t len;
+  bool overflow;
+
+  BufWriter(char* b, size_t c) : buf(b), cap(c), len(0), overflow(false) { buf[0] = 0; }
+  void put(char c) {
+    if (len + 1 < cap) {
+      buf[len++] = c;
+      buf[len] = 0;
+    } else {
+      overflow = true;
+    }
+  }
+  void put(const char* s) {
+    while (*s) put(*s++);
+  }
+  void putUInt(uint64_t v) {
+    char digits[21];
+    int n = 0;
+    do {
+      digits[n++] = '0' + v % 10;
+      v /= 10;
+    } while (v);
+    while (n) put(digits[--n]);
+  }
+  void putBase64(const uint8_t* data, size_t n) {
+    static const char alphabet[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    for (size_t i = 0; i < n; i += 3) {
+      uint32_t v = (uint32_t)data[i] << 16;
+      if (i + 1 < n) v |= (uint32_t)data[i + 1] << 8;
+      if (i + 2 < n) v |= data[i + 2];
+      put(alphabet[(v >> 18) & 0x3F]);
+      put(alphabet[(v >> 12) & 0x3F]);
+      put(i + 1 < n ? alphabet[(v >> 6) & 0x3F] : '=');
+      put(i + 2 < n ? alphabet[v & 0x3F] : '=');
+    }
+  }
+  // Fixed-point decimal for float or double, e.g. putFixed(7.06, 1) -> "7.1",
+  // without printf/dtoa. Running sums (see ROLLUPS) need the double's precision.
+  template <typename T>
+  void putFixed(T v, int decimals) {
+    if (isnan(v) || isinf(v)) {
+      put("null");
+      return;
+    }
+    uint32_t scale = 1;
+    for (int i = 0; i < decimals; i++) scale *= 10;
+    T scaled = v * scale;
+    int64_t q = (int64_t)(scaled < 0 ? scaled - (T)0.5 : scaled + (T)0.5);
+    if (q < 0) {
+      put('-');
+      q = -q;
+    }
+    putUInt(q / scale);
+    if (decimals > 0) {
+      put('.');
+      uint32_t frac = q % scale;
+      for (uint32_t div = scale / 10; div > 0; div /= 10) {
+        put('0' + (frac / div) % 10);
+      }
+    }
+  }
+};
+
+// Value of format f for record r, stored or derived
+template <int Values, typename Alerts>
+float recordValue(const LogRecordOf<Values, Alerts>& r, const ValueFormat* formats, int f) {
+  return formats[f].from < 0 ? r.value[f] : formats[f].factor * r.value[formats[f].from];
+}
+// Encode readings as one multi-path update body, keyed by epoch ms, with one
+// field per format, e.g.
+// {"<key>":{"t":23.4,"p":7.1,"n":3.2,"d":120.5,"ec":241.0,"a":0,"timestamp":{".sv":"timestamp"}},...}
+// "a" carries the reading's ALERT_* bits.
+// Readings that cannot be dated use u<session>-<ms since power-on>.
+template <int Values, typename Alerts>
+void encodeRecords(const LogRecordOf<Values, Alerts>* records, int n, const ValueFormat* formats, int formatCount,
+                   BufWriter& w) {
+  w.put('{');
+  for (int i = 0; i < n; i++) {
+    const LogRecordOf<Values, Alerts>& r = records[i];
+    if (i > 0) w.put(',');
+    w.put('"');
+    uint64_t epochMs;
+    if (recordEpochMs(r, epochMs)) {
+      w.putUInt(epochMs);
+    } else {
+      w.put('u');
+      w.putUInt(r.session);
+      w.put('-');
+      w.putUInt(r.timestampMs);
+    }
+    w.put("\":{");
+    for (int f = 0; f < formatCount; f++) {
+      w.put(f == 0 ? "\"" : ",\"");
+      w.put(formats[f].key);
+      w.put("\":");
+      w.putFixed(recordValue(r, formats, f), formats[f].decimals);
+    }
+    w.put(",\"a\":");
+    w.putUInt(r.alerts);
+    w.put(",\"timestamp\":{\".sv\":\"timestamp\"}}");
+  }
+  w.put('}');
+}
+
+// Compact format: a whole batch becomes one entry under the device's "packed"
+// node, keyed by the first reading's epoch ms, {"<key>":{"b":"<base64>",...}}.
+// The bytes describe their own channels, so a decoder needs no copy of the
+// table. They are a version byte (3), a count byte and a format count byte,
+// then per format:
+//   1 byte  key length, then the key
+//   1 byte  index of the stored value it is derived from, 0xFF if stored
+//   stored: zigzag varint fixed-point scale; derived: float32 LE factor
+// and then per reading:
+//   zigzag varint  ms since the previous reading (the first is 0)
+//   zigzag varint per stored value, as int16 fixed point in its format's
+//                 scale, each a delta against the previous reading (the first
+//                 against 0)
+//   zigzag varint  alert bits
+// Derived values are not sent. lib/compact-readings.ts decodes this (and
+// versions 1 and 2, whose channels and scales were fixed).
+const uint8_t COMPACT_VERSION = 3;
+const int COMPACT_FORMAT_MAX = 16;  // Formats a header can describe
+const int COMPACT_KEY_MAX = 7;      // Longest key a header can carry
+
+inline size_t putVarint(uint8_t* out, int64_t v) {
+  uint64_t z = ((uint64_t)v << 1) ^ (uint64_t)(v >> 63);
+  size_t n = 0;
+  do {
+    uint8_t b = z & 0x7F;
+    z >>= 7;
+    out[n++] = z ? (b | 0x80) : b;
+  } while (z);
+  return n;
+}
+inline int16_t toFixed16(float v, float scale) {
+  long q = lroundf(v * scale);
+  return (int16_t)(q < -32768L ? -32768L : (q > 32767L ? 32767L : q));
+}
+// Batches of up to MaxRecords readings, packed in a static buffer. Returns
+// false, without writing anything, if a reading cannot be dated or the
+// formats do not fit the header; such batches are sent as JSON instead.
+template <int MaxRecords, int Values, typename Alerts>
+bool encodeRecordsCompact(const LogRecordOf<Values, Alerts>* records, int n, const ValueFormat* formats,
+                          int formatCount, BufWriter& w) {
+  static_assert(MaxRecords <= 255 && Values <= 255, "compact batches carry one-byte counts");
+  const int headerMax = 3 + COMPACT_FORMAT_MAX * (2 + COMPACT_KEY_MAX + 5);
+  const int recordMax = 10 + Values * 3 + 5;  // Worst-case bytes per reading
+  static uint8_t compactBuf[headerMax + recordMax * MaxRecords];
+  if (formatCount < Values || formatCount > COMPACT_FORMAT_MAX) return false;
+  uint64_t times[MaxRecords];
+  for (int i = 0; i < n; i++) {
+    if (!recordEpochMs(records[i], times[i])) return false;
+  }
+  size_t len = 0;
+  compactBuf[len++] = COMPACT_VERSION;
+  compactBuf[len++] = n;
+  compactBuf[len++] = formatCount;
+  for (int f = 0; f < formatCount; f++) {
+    size_t keyLen = strlen(formats[f].key);
+    if (keyLen > (size_t)COMPACT_KEY_MAX || (formats[f].from < 0) != (f < Values)) return false;
+    compactBuf[len++] = keyLen;
+    memcpy(compactBuf + len, formats[f].key, keyLen);
+    len += keyLen;
+    compactBuf[len++] = (uint8_t)formats[f].from;
+    if (formats[f].from < 0) {
+      len += putVarint(compactBuf + len, lroundf(formats[f].scale));
+    } else {
+      uint32_t bits;
+      memcpy(&bits, &formats[f].factor, sizeof(bits));
+      for (int b = 0; b < 4; b++) compactBuf[len++] = bits >> (8 * b);
+    }
+  }
+  int16_t prev[Values] = {};
+  for (int i = 0; i < n; i++) {
+    const LogRecordOf<Values, Alerts>& r = records[i];
+    len += putVarint(compactBuf + len, i == 0 ? 0 : (int64_t)(times[i] - times[i - 1]));
+    for (int c = 0; c < Values; c++) {
+      int16_t q = toFixed16(r.value[c], formats[c].scale);
+      len += putVarint(compactBuf + len, (int32_t)q - prev[c]);
+      prev[c] = q;
+    }
+    len += putVarint(compactBuf + len, r.alerts);
+  }
+  w.put("{\"");
+  w.putUInt(times[0]);
+  w.put("\":{\"b\":\"");
+  w.putBase64(compactBuf, len);
+  w.put("\",\"timestamp\":{\".sv\":\"timestamp\"}}}");
+  return true;
+}
+// One upload body for a batch: compact when Compact is set and every reading
+// can be dated, JSON otherwise. Returns true if the body is compact, so it
+// goes under the device's "packed" node instead of "readings".
+template <int MaxRecords, bool Compact, int Values, typename Alerts>
+bool encodeUploadBody(const LogRecordOf<Values, Alerts>* records, int n, const ValueFormat* formats, int formatCount,
+                      BufWriter& body) {
+  if constexpr (Compact) {
+    if (encodeRecordsCompact<MaxRecords>(records, n, formats, formatCount, body)) return true;
+  }
+  encodeRecords(records, n, formats, formatCount, body);
+  return false;
+}
+// ============================================================
+
+// ===================== BURST TRACES =====================
+// A burst capture is a run of frames taken at a fixed rate, each holding one
+// int16 fixed-point value per analog channel. It is summarised per sub-window
+// with SpanStats and uploaded in chunks, each packed as
+//   version byte (1), channel count byte, zigzag varint frame count,
+//   then per frame and channel a zigzag varint delta against the previous
+//   frame's value (the chunk's first frame against 0)
+// so every chunk decodes on its own. Slow-moving probe signals give one-byte
+// deltas, about a third of the raw int16 size. lib/compact-readings.ts
+// decodes it (decodeTraceChunk).
+const uint8_t TRACE_VERSION = 1;
+const int TRACE_VALUE_MAX = 3;     // Worst-case varint bytes for an int16 delta
+
+// Min/max/mean/standard deviation of a stream of values (Welford's method,
+// so a long window does not lose precision in float)
+struct SpanStats {
+  uint32_t n = 0;
+  float min = 0;
+  float max = 0;
+  float mean = 0;
+  float m2 = 0;
+
+  void add(float v) {
+    if (n == 0 || v < min) min = v;
+    if (n == 0 || v > max) max = v;
+    n++;
+    float d = v - mean;
+    mean += d / n;
+    m2 += d * (v - mean);
+  }
+  float stddev() const { return n > 1 ? sqrtf(m2 / n) : 0; }
+};
+
+// Bytes encodeTraceChunk() may need for count frames
+inline size_t traceChunkMax(int channels, int count) {
+  return 2 + 5 + (size_t)count * channels * TRACE_VALUE_MAX;
+}
+// Pack count frames of channels values each. Returns the bytes written, or 0
+// if out (cap bytes) could be too small.
+inline size_t encodeTraceChunk(const int16_t* frames, int channels, int count, uint8_t* out, size_t cap) {
+  if (cap < traceChunkMax(channels, count) || channels > 255) return 0;
+  size_t len = 0;
+  out[len++] = TRACE_VERSION;
+  out[len++] = channels;
+  len += putVarint(out + len, count);
+  const int16_t* prev = NULL;
+  for (int i = 0; i < count; i++) {
+    const int16_t* f = frames + i * channels;
+    for (int c = 0; c < channels; c++) {
+      len += putVarint(out + len, (int32_t)f[c] - (prev != NULL ? prev[c] : 0));
+    }
+    prev = f;
+  }
+  return len;
+}
+// ============================================================
+
+// ===================== ROLLUPS =====================
+// Time buckets of readings kept as count, min, max, sum and sum of squares
+// per stored channel. Those merge by addition, so a reader combines 1-minute
+// buckets into any coarser span, and mean and variance follow as
+// sum / n and sumSq / n - mean^2. Sums are double, since a float sum of
+// squares over an hour of TDS readings keeps only about 7 digits.
+struct RollupChannel {
+  float min;
+  float max;
+  double sum;
+  double sumSq;
+};
+template <int Channels>
+struct RollupBucketOf {
+  uint32_t startS;     // Unix time the bucket starts at, s
+  uint16_t count;      // Readings in the bucket (0 = empty)
+  uint8_t level;       // Index into the target's bucket lengths
+  RollupChannel ch[Channels];
+};
+
+template <int Channels>
+void rollupAdd(RollupBucketOf<Channels>& b, const float* values) {
+  for (int c = 0; c < Channels; c++) {
+    RollupChannel& r = b.ch[c];
+    float v = values[c];
+    if (b.count == 0 || v < r.min) r.min = v;
+    if (b.count == 0 || v > r.max) r.max = v;
+    r.sum += v;
+    r.sumSq += (double)v * v;
+  }
+  b.count++;
+}
+// One bucket as {"count":60,"t":[min,max,sum,sumSq],"p":[...],...}, keyed by
+// the stored channels' formats
+template <int Channels>
+void encodeRollup(const RollupBucketOf<Channels>& b, const ValueFormat* formats, BufWriter& w) {
+  w.put("{\"count\":");
+  w.putUInt(b.count);
+  for (int c = 0; c < Channels; c++) {
+    const RollupChannel& r = b.ch[c];
+    w.put(",\"");
+    w.put(formats[c].key);
+    w.put("\":[");
+    w.putFixed(r.min, 2);
+    w.put(',');
+    w.putFixed(r.max, 2);
+    w.put(',');
+    w.putFixed(r.sum, 3);
+    w.put(',');
+    w.putFixed(r.sumSq, 3);
+    w.put(']');
+  }
+  w.put('}');
+}
+// ============================================================
+
+// ===================== UPLOAD BATCHING =====================
+// Live readings collect in a batch that is written as one request, so the
+// TLS/HTTP/radio cost is paid once per batch rather than once per reading.
+// The target supplies the clock and what sending a batch means (main.cpp:
+// FIREBASE UPLOAD; bench/: the mock database).
+template <typename Record, int Capacity>
+struct UploadBatcher {
+  Record records[Capacity];
+  int count = 0;
+  unsigned long startedAt = 0;           // Clock ms when the first reading went in
+  volatile bool flushRequested = false;  // Send what there is at the next check
+
+  // Due once it holds batchSize readings, its first reading is maxAgeMs old
+  // or a flush was requested. During a backoff only a full batch is due; it
+  // then goes to the offline log instead of waiting for a retry.
+  bool due(unsigned long now, int batchSize, unsigned long maxAgeMs, bool backingOff) const {
+    if (count == 0) return false;
+    if (backingOff && count < batchSize) return false;
+    return flushRequested || count >= batchSize || now - startedAt >= maxAgeMs;
+  }
+  // Hand the readings to send(records, n) and start an empty batch
+  template <typename Send>
+  void flush(Send send) {
+    send((const Record*)records, count);
+    count = 0;
+    flushRequested = false;
+  }
+  // Add a reading, first flushing a batch that already holds batchSize
+  template <typename Send>
+  void add(const Record& r, unsigned long now, int batchSize, Send send) {
+    if (count >= batchSize || count >= Capacity) flush(send);
+    if (count == 0) startedAt = now;
+    records[count++] = r;
+  }
+};
+
+inline bool httpOk(int status) {
+  return status >= 200 && status < 300;
+}
+// Failures that may succeed if the same request is sent again later (401/403
+// after a token refresh, see uploadResult() in main.cpp)
+inline bool uploadRetryable(int status) {
+  return status < 0 || status == 401 || status == 403 || status == 408 || status == 429 || status >= 500;
+}
+// Exponential backoff shared by every upload lane: it doubles from minMs up
+// to maxMs with each failure in a row, and a success clears it. The wait is
+// jittered (at least half the backoff, the rest at random) so devices that
+// failed together do not retry together.
+struct UploadBackoff {
+  unsigned long backoffMs = 0;  // 0 = not backing off
+  unsigned long retryAt = 0;    // Clock ms when requests may resume
+
+  bool active(unsigned long now) const { return backoffMs > 0 && (long)(now - retryAt) < 0; }
+  void succeeded() { backoffMs = 0; }
+  // Back off after a failure; random is any 32-bit random number. Returns the wait.
+  unsigned long failed(unsigned long now, uint32_t random, unsigned long minMs, unsigned long maxMs) {
+    backoffMs = backoffMs == 0 ? minMs : (backoffMs * 2 < maxMs ? backoffMs * 2 : maxMs);
+    unsigned long wait = backoffMs / 2 + random % (backoffMs / 2 + 1);
+    retryAt = now + wait;
+    return wait;
+  }
+};
+// ============================================================